@@ -0,0 +1,572 @@
+#include "batch.h"
+#include "../common/argparse.h"
+#include "../common/streq.h"
+#include "cli.h"
+#include "print.h"
+#include "stats.h"
+#include <assert.h>
+#include <errno.h>
+#include <json.h>
+#include <passwand/passwand.h>
+#include <printbuf.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// An operation read from stdin. Operations naming the same space and key share
+// a target, so each entry of interest is only sought once however many
+// operations refer to it.
+typedef enum {
+  OP_GET,
+  OP_SET,
+  OP_UPDATE,
+  OP_DELETE,
+} op_kind_t;
+
+typedef struct {
+  op_kind_t kind;
+  size_t target;      ///< index into `targets`
+  char *value;        ///< new value for set and update, in secure memory
+  const char *result; ///< value seen by a get
+  const char *error;  ///< reason this operation failed, if it did
+} op_t;
+
+typedef struct {
+  char *space;
+  char *key;
+
+  // result of the scan
+  atomic_bool found;
+  size_t index; ///< index of the existing entry, if found
+  char *value;  ///< value of the existing entry, in secure memory
+
+  // state while applying operations
+  bool exists;
+  const char *current; ///< value as of the last operation
+  bool changed;        ///< has an operation modified this?
+} target_t;
+
+static op_t *ops;
+static size_t op_len;
+
+static target_t *targets;
+static size_t target_len;
+static atomic_size_t found_len;
+
+// longest line of input accepted, to fit within one secure allocation
+enum { MAX_LINE = 4096 };
+
+static bool writes; ///< do any operations modify the database?
+static bool initialized;
+
+static _Thread_local size_t current_index;
+
+static const main_t *saved_main;
+static passwand_entry_t *saved_entries;
+static size_t saved_entry_len;
+
+/// free all operations and targets
+static void discard(void) {
+  for (size_t i = 0; i < op_len; ++i)
+    secure_strfree(ops[i].value);
+  free(ops);
+  ops = NULL;
+  op_len = 0;
+
+  for (size_t i = 0; i < target_len; ++i) {
+    free(targets[i].space);
+    free(targets[i].key);
+    secure_strfree(targets[i].value);
+  }
+  free(targets);
+  targets = NULL;
+  target_len = 0;
+}
+
+/// look up a string member of a JSON object
+///
+/// @return The member’s value, or NULL if it is absent or not a string
+static const char *get_string(json_object *j, const char *name) {
+  json_object *v;
+  if (!json_object_object_get_ex(j, name, &v))
+    return NULL;
+  if (!json_object_is_type(v, json_type_string))
+    return NULL;
+  return json_object_get_string(v);
+}
+
+/// find or create the target for a space and key
+///
+/// @return 0 on success
+static int add_target(const char *space, const char *key, size_t *target) {
+  for (size_t i = 0; i < target_len; ++i) {
+    if (streq(targets[i].space, space) && streq(targets[i].key, key)) {
+      *target = i;
+      return 0;
+    }
+  }
+
+  target_t *ts = realloc(targets, (target_len + 1) * sizeof(targets[0]));
+  if (ts == NULL)
+    return -1;
+  targets = ts;
+
+  target_t *t = &targets[target_len];
+  *t = (target_t){0};
+  t->space = strdup(space);
+  t->key = strdup(key);
+  if (t->space == NULL || t->key == NULL) {
+    free(t->space);
+    free(t->key);
+    return -1;
+  }
+
+  *target = target_len++;
+  return 0;
+}
+
+/// parse one line of input into an operation
+///
+/// JSON-C copies what it parses into its own buffers, which it frees without
+/// erasing, so we scrub anything that may hold a value before releasing it.
+///
+/// @return 0 on success
+static int parse_op(const char *line, size_t len, size_t lineno) {
+
+  json_tokener *tok = NULL;
+  json_object *j = NULL;
+  int rc = -1;
+
+  tok = json_tokener_new();
+  if (tok == NULL) {
+    eprint("out of memory\n");
+    goto done;
+  }
+
+  // Size the tokener’s buffer to fit the whole line up front. Otherwise, it
+  // would be reallocated as a long string is parsed, leaving behind a copy of
+  // the string’s start that we could not erase.
+  if (printbuf_memset(tok->pb, 0, 0, (int)len + 1) < 0) {
+    eprint("out of memory\n");
+    goto done;
+  }
+
+  j = json_tokener_parse_ex(tok, line, (int)len);
+  if (j == NULL || !json_object_is_type(j, json_type_object)) {
+    eprint("line %zu: expected a JSON object\n", lineno);
+    goto done;
+  }
+
+  const char *kind = get_string(j, "op");
+  const char *space = get_string(j, "space");
+  const char *key = get_string(j, "key");
+  const char *value = get_string(j, "value");
+
+  op_t op = {0};
+  if (kind == NULL) {
+    eprint("line %zu: missing \"op\"\n", lineno);
+    goto done;
+  } else if (streq(kind, "get")) {
+    op.kind = OP_GET;
+  } else if (streq(kind, "set")) {
+    op.kind = OP_SET;
+  } else if (streq(kind, "update")) {
+    op.kind = OP_UPDATE;
+  } else if (streq(kind, "delete")) {
+    op.kind = OP_DELETE;
+  } else {
+    eprint("line %zu: invalid op \"%s\"\n", lineno, kind);
+    goto done;
+  }
+
+  if (space == NULL) {
+    eprint("line %zu: missing \"space\"\n", lineno);
+    goto done;
+  }
+  if (key == NULL) {
+    eprint("line %zu: missing \"key\"\n", lineno);
+    goto done;
+  }
+  const bool need_value = op.kind == OP_SET || op.kind == OP_UPDATE;
+  if (need_value && value == NULL) {
+    eprint("line %zu: missing \"value\"\n", lineno);
+    goto done;
+  } else if (!need_value && value != NULL) {
+    eprint("line %zu: irrelevant \"value\"\n", lineno);
+    goto done;
+  }
+
+  op_t *os = realloc(ops, (op_len + 1) * sizeof(ops[0]));
+  if (os == NULL) {
+    eprint("out of memory\n");
+    goto done;
+  }
+  ops = os;
+
+  if (add_target(space, key, &op.target) != 0) {
+    eprint("out of memory\n");
+    goto done;
+  }
+
+  if (value != NULL) {
+    op.value = secure_strdup(value);
+    if (op.value == NULL) {
+      eprint("line %zu: failed to allocate secure memory\n", lineno);
+      goto done;
+    }
+  }
+
+  ops[op_len++] = op;
+  rc = 0;
+
+done:
+  if (j != NULL) {
+    json_object *v;
+    if (json_object_object_get_ex(j, "value", &v) &&
+        json_object_is_type(v, json_type_string))
+      (void)passwand_erase((char *)json_object_get_string(v),
+                           (size_t)json_object_get_string_len(v));
+    (void)json_object_put(j);
+  }
+  if (tok != NULL) {
+    (void)passwand_erase(tok->pb->buf, (size_t)tok->pb->size);
+    json_tokener_free(tok);
+  }
+
+  return rc;
+}
+
+/// is this line empty but for whitespace?
+static bool is_blank(const char *line, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    if (strchr(" \t\r", line[i]) == NULL)
+      return false;
+  }
+  return true;
+}
+
+static int prepare(void) {
+
+  initialized = false;
+
+  // Read all operations up front, so malformed input is rejected before we
+  // change anything and we know whether the database needs an exclusive lock.
+  // Input is read straight into secure memory, rather than through stdio,
+  // whose buffer we could not erase.
+  char *chunk = passwand_secure_malloc(MAX_LINE);
+  char *line = passwand_secure_malloc(MAX_LINE);
+  size_t line_len = 0;
+  int rc = -1;
+  if (chunk == NULL || line == NULL) {
+    eprint("failed to allocate secure memory\n");
+    goto done;
+  }
+  for (size_t lineno = 1;;) {
+    const ssize_t r = read(STDIN_FILENO, chunk, MAX_LINE);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      eprint("failed to read operations\n");
+      goto done;
+    }
+
+    // the last line may lack a line ending
+    if (r == 0) {
+      if (!is_blank(line, line_len) && parse_op(line, line_len, lineno) != 0)
+        goto done;
+      break;
+    }
+
+    for (size_t i = 0; i < (size_t)r; ++i) {
+      if (chunk[i] != '\n') {
+        if (line_len == MAX_LINE) {
+          eprint("line %zu: too long\n", lineno);
+          goto done;
+        }
+        line[line_len++] = chunk[i];
+        continue;
+      }
+      if (!is_blank(line, line_len) && parse_op(line, line_len, lineno) != 0)
+        goto done;
+      line_len = 0;
+      ++lineno;
+    }
+  }
+
+  writes = false;
+  for (size_t i = 0; i < op_len; ++i)
+    writes |= ops[i].kind != OP_GET;
+
+  // a batch of look ups can share the database with other readers
+  rc = writes ? LOCK_EX : LOCK_SH;
+
+done:
+  // the input may contain values, so is erased as it is freed
+  if (line != NULL)
+    passwand_secure_free(line, MAX_LINE);
+  if (chunk != NULL)
+    passwand_secure_free(chunk, MAX_LINE);
+  if (rc < 0)
+    discard();
+
+  return rc;
+}
+
+static int initialize(const main_t *mainpass, passwand_entry_t *entries,
+                      size_t entry_len) {
+
+  saved_main = mainpass;
+  saved_entries = entries;
+  saved_entry_len = entry_len;
+  found_len = 0;
+
+  // writes are checked against the main password in the same way as for set
+  if (writes && !mainpass->confirmed) {
+    main_t *confirm = getpassword("confirm main password: ");
+    if (confirm == NULL) {
+      eprint("out of memory\n");
+      return -1;
+    }
+    bool r = streq(mainpass->main, confirm->main);
+    discard_main(&confirm);
+    if (!r) {
+      eprint("passwords do not match\n");
+      return -1;
+    }
+  }
+
+  initialized = true;
+  return 0;
+}
+
+static void loop_notify(size_t entry_index) { current_index = entry_index; }
+
+static bool loop_condition(void) { return found_len < target_len; }
+
+static void loop_body(const char *space, const char *key, const char *value) {
+
+  assert(space != NULL);
+  assert(key != NULL);
+  assert(value != NULL);
+
+  for (size_t i = 0; i < target_len; ++i) {
+    target_t *t = &targets[i];
+    if (!streq(t->space, space) || !streq(t->key, key))
+      continue;
+
+    // As in update, there should only be one matching entry unless the
+    // database has been tampered with, in which case the first seen wins.
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&t->found, &expected, true)) {
+      t->index = current_index;
+      t->value = secure_strdup(value);
+      ++found_len;
+    }
+    break;
+  }
+}
+
+/// print a string as a JSON string literal
+static void print_json_string(const char *s) {
+  print("\"");
+  for (const char *p = s; *p != '\0';) {
+    // print the longest run not needing escaping in one go
+    size_t run = 0;
+    while (p[run] != '\0' && p[run] != '"' && p[run] != '\\' &&
+           (unsigned char)p[run] >= 0x20)
+      ++run;
+    if (run > 0) {
+      print("%.*s", (int)run, p);
+      p += run;
+      continue;
+    }
+    if (*p == '"' || *p == '\\') {
+      print("\\%c", *p);
+    } else {
+      print("\\u%04x", (unsigned)(unsigned char)*p);
+    }
+    ++p;
+  }
+  print("\"");
+}
+
+/// apply operations to their targets in order, recording any failures
+static void apply(bool failure_pending) {
+  for (size_t i = 0; i < target_len; ++i) {
+    targets[i].exists = targets[i].found;
+    targets[i].current = targets[i].value;
+  }
+
+  for (size_t i = 0; i < op_len; ++i) {
+    op_t *op = &ops[i];
+    target_t *t = &targets[op->target];
+
+    if (op->kind != OP_SET && !t->exists) {
+      op->error = "not found";
+      continue;
+    }
+
+    switch (op->kind) {
+
+    case OP_GET:
+      op->result = t->current;
+      if (op->result == NULL)
+        op->error = "failed to allocate secure memory";
+      break;
+
+    case OP_SET:
+      if (t->exists) {
+        op->error = "already exists";
+      } else if (failure_pending) {
+        // an entry we could not decrypt may be this one
+        op->error = "cannot check for an existing entry";
+      } else {
+        t->exists = true;
+        t->current = op->value;
+        t->changed = true;
+      }
+      break;
+
+    case OP_UPDATE:
+      t->current = op->value;
+      t->changed = true;
+      break;
+
+    case OP_DELETE:
+      t->exists = false;
+      t->current = NULL;
+      t->changed = true;
+      break;
+    }
+  }
+}
+
+/// write the database with all changed targets in one export
+///
+/// @return PW_OK on success
+static passwand_error_t commit(void) {
+
+  size_t new_len = 0;
+  size_t new_entry_len = 0;
+  passwand_entry_t *new_entries = NULL;
+  passwand_error_t rc = PW_NO_MEM;
+
+  new_entries = calloc(saved_entry_len + target_len, sizeof(new_entries[0]));
+  if (new_entries == NULL)
+    goto done;
+
+  // insert new and updated entries at the start of the list, as we assume we
+  // will be looking them up in the near future
+  for (size_t i = 0; i < target_len; ++i) {
+    const target_t *t = &targets[i];
+    if (!t->changed || !t->exists)
+      continue;
+    passwand_error_t err =
+        passwand_entry_new(&new_entries[new_len], saved_main->main, t->space,
+                           t->key, t->current, options.db.work_factor);
+    if (err != PW_OK) {
+      rc = err;
+      goto done;
+    }
+    ++new_len;
+  }
+
+  // retain every existing entry we did not replace or delete
+  new_entry_len = new_len;
+  for (size_t i = 0; i < saved_entry_len; ++i) {
+    bool replaced = false;
+    for (size_t j = 0; j < target_len; ++j) {
+      const target_t *t = &targets[j];
+      if (t->found && t->changed && t->index == i) {
+        replaced = true;
+        break;
+      }
+    }
+    if (!replaced)
+      new_entries[new_entry_len++] = saved_entries[i];
+  }
+
+  rc = export_entries(options.db.path, new_entries, new_entry_len);
+
+done:
+  for (size_t i = 0; i < new_len; ++i) {
+    free(new_entries[i].space);
+    free(new_entries[i].key);
+    free(new_entries[i].value);
+    free(new_entries[i].hmac);
+    free(new_entries[i].hmac_salt);
+    free(new_entries[i].salt);
+    free(new_entries[i].iv);
+  }
+  free(new_entries);
+
+  return rc;
+}
+
+static int finalize(bool failure_pending) {
+
+  // if we never got as far as scanning, there is nothing to report
+  if (!initialized) {
+    discard();
+    return 0;
+  }
+
+  apply(failure_pending);
+
+  bool changed = false;
+  for (size_t i = 0; i < target_len; ++i)
+    changed |= targets[i].changed;
+
+  if (changed) {
+    passwand_error_t err = commit();
+    if (err != PW_OK) {
+      eprint("failed to export entries: %s\n", passwand_error(err));
+      for (size_t i = 0; i < op_len; ++i) {
+        if (ops[i].kind != OP_GET && ops[i].error == NULL)
+          ops[i].error = "not written";
+      }
+    }
+  }
+
+  // report results in the order operations were given
+  int rc = 0;
+  for (size_t i = 0; i < op_len; ++i) {
+    const op_t *op = &ops[i];
+    if (op->error != NULL) {
+      print("{\"ok\":false,\"error\":");
+      print_json_string(op->error);
+      print("}\n");
+      rc = -1;
+    } else if (op->kind == OP_GET) {
+      print("{\"ok\":true,\"value\":");
+      print_json_string(op->result);
+      print("}\n");
+    } else {
+      print("{\"ok\":true}\n");
+    }
+  }
+
+  discard();
+
+  return rc;
+}
+
+const command_t batch = {
+    .need_space = DISALLOWED,
+    .need_key = DISALLOWED,
+    .need_value = DISALLOWED,
+    .need_length = DISALLOWED,
+    .access = LOCK_EX,
+    .prepare = prepare,
+    .initialize = initialize,
+    .loop_notify = loop_notify,
+    .loop_condition = loop_condition,
+    .loop_body = loop_body,
+    .finalize = finalize,
+};
@@ -0,0 +1,5 @@
+#pragma once
+
+#include "cli.h"
+
+extern const command_t batch;
@@ -0,0 +1,628 @@
+#include "breach.h"
+#include "print.h"
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/sha.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// number of distinct 16-bit hash prefixes
+enum { FANOUT = 1 << 16 };
+
+// The index file is a header followed by an array of records, sorted by hash.
+// As for the dictionary index, it is in native byte order.
+typedef struct {
+  char magic[8];
+  uint64_t record_len;         ///< number of records
+  uint64_t fanout[FANOUT + 1]; ///< first record of each prefix, and the end
+} header_t;
+
+typedef struct {
+  unsigned char hash[SHA_DIGEST_LENGTH];
+  uint32_t count; ///< times seen in breaches, saturating
+} record_t;
+
+static const char MAGIC[8] = "pwhibp1\n";
+
+// The filter is a blocked Bloom filter, a header followed by an array of
+// blocks. Each hash sets K bits within a single block, so a look up touches
+// only one cache line, and one page, of the filter.
+enum {
+  BLOCK_BITS = 512,  ///< bits per block, one cache line
+  BITS_PER_KEY = 10, ///< space to spend on each hash
+  K = 7,             ///< bits set per hash, taken 9 at a time from 64 bits
+};
+
+typedef struct {
+  char magic[8];
+  uint64_t key_len;   ///< number of hashes added
+  uint64_t block_len; ///< number of blocks
+} filter_header_t;
+
+typedef struct {
+  uint64_t word[BLOCK_BITS / 64];
+} block_t;
+
+static const char FILTER_MAGIC[8] = "pwbloom1";
+
+// number of absent hashes to try when measuring the false positive rate
+enum { PROBES = 1 << 16 };
+
+// the loaded index and filter, either of which may be absent
+static void *image;
+static size_t image_size;
+static const header_t *header;
+static const record_t *records;
+static void *filter_image;
+static size_t filter_image_size;
+static const filter_header_t *filter;
+static const block_t *blocks;
+
+/// find the path of a file derived from a breach list
+static char *derived_path(const char *path, const char *suffix) {
+  char *p = NULL;
+  if (asprintf(&p, "%s%s", path, suffix) < 0)
+    return NULL;
+  return p;
+}
+
+static size_t prefix_of(const unsigned char *hash) {
+  return (size_t)hash[0] << 8 | hash[1];
+}
+
+static int hex_digit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+/// parse a line of the breach list, “<hash>:<count>”
+///
+/// @return 0 on success
+static int parse_line(const char *line, record_t *r) {
+
+  for (size_t i = 0; i < SHA_DIGEST_LENGTH; ++i) {
+    const int high = hex_digit(line[i * 2]);
+    if (high < 0)
+      return -1;
+    const int low = hex_digit(line[i * 2 + 1]);
+    if (low < 0)
+      return -1;
+    r->hash[i] = (unsigned char)(high << 4 | low);
+  }
+
+  const char *p = &line[SHA_DIGEST_LENGTH * 2];
+  if (*p != ':' || !isdigit((unsigned char)p[1]))
+    return -1;
+
+  char *end = NULL;
+  errno = 0;
+  const unsigned long long count = strtoull(&p[1], &end, 10);
+  if (*end != '\0')
+    return -1;
+  r->count =
+      errno == ERANGE || count > UINT32_MAX ? UINT32_MAX : (uint32_t)count;
+
+  // being listed at all means it was seen, which a count of 0 would hide
+  if (r->count == 0)
+    r->count = 1;
+
+  return 0;
+}
+
+/// find the filter bits for a hash
+///
+/// SHA-1 hashes are uniformly distributed, so their bytes can be used as is.
+static size_t filter_bits(const unsigned char *digest, uint64_t block_len,
+                          unsigned bit[static K]) {
+  uint64_t h1;
+  uint64_t h2;
+  memcpy(&h1, &digest[4], sizeof(h1));
+  memcpy(&h2, &digest[12], sizeof(h2));
+  for (size_t i = 0; i < K; ++i) {
+    bit[i] = (unsigned)(h2 % BLOCK_BITS);
+    h2 /= BLOCK_BITS;
+  }
+  return (size_t)(h1 % block_len);
+}
+
+static bool filter_has(const block_t *bs, uint64_t block_len,
+                       const unsigned char *digest) {
+  unsigned bit[K];
+  const block_t *b = &bs[filter_bits(digest, block_len, bit)];
+  for (size_t i = 0; i < K; ++i) {
+    if (!(b->word[bit[i] / 64] & (UINT64_C(1) << (bit[i] % 64))))
+      return false;
+  }
+  return true;
+}
+
+/// write a filter of the given records alongside the breach list
+///
+/// @return 0 on success
+static int build_filter(const char *path, const record_t *rs, size_t len) {
+
+  char *target = NULL;
+  char *tmp = NULL;
+  int fd = -1;
+  void *m = MAP_FAILED;
+  int rc = -1;
+
+  const uint64_t block_len =
+      len == 0 ? 1 : (len * BITS_PER_KEY + BLOCK_BITS - 1) / BLOCK_BITS;
+  const size_t size = sizeof(filter_header_t) + block_len * sizeof(block_t);
+
+  target = derived_path(path, ".filter");
+  if (target == NULL || asprintf(&tmp, "%s.XXXXXX", target) < 0) {
+    tmp = NULL;
+    eprint("out of memory\n");
+    goto done;
+  }
+
+  fd = mkstemp(tmp);
+  if (fd < 0) {
+    eprint("failed to create %s: %s\n", tmp, strerror(errno));
+    free(tmp);
+    tmp = NULL;
+    goto done;
+  }
+
+  if (ftruncate(fd, (off_t)size) != 0) {
+    eprint("failed to write %s: %s\n", tmp, strerror(errno));
+    goto done;
+  }
+
+  m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (m == MAP_FAILED) {
+    eprint("failed to map %s: %s\n", tmp, strerror(errno));
+    goto done;
+  }
+  filter_header_t *h = m;
+  block_t *bs = (void *)((char *)m + sizeof(*h));
+
+  memcpy(h->magic, FILTER_MAGIC, sizeof(FILTER_MAGIC));
+  h->key_len = len;
+  h->block_len = block_len;
+  for (size_t i = 0; i < len; ++i) {
+    unsigned bit[K];
+    block_t *b = &bs[filter_bits(rs[i].hash, block_len, bit)];
+    for (size_t j = 0; j < K; ++j)
+      b->word[bit[j] / 64] |= UINT64_C(1) << (bit[j] % 64);
+  }
+
+  // Measure the false positive rate, rather than estimating it, as blocking
+  // makes the usual formula optimistic. The probes are hashes of numbers,
+  // which are vanishingly unlikely to be breached passwords.
+  size_t positives = 0;
+  for (uint32_t i = 0; i < PROBES; ++i) {
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    SHA1((const unsigned char *)&i, sizeof(i), digest);
+    if (filter_has(bs, block_len, digest))
+      ++positives;
+  }
+
+  (void)munmap(m, size);
+  m = MAP_FAILED;
+
+  {
+    const int r = close(fd);
+    fd = -1;
+    if (r != 0) {
+      eprint("failed to write %s: %s\n", tmp, strerror(errno));
+      goto done;
+    }
+  }
+
+  if (rename(tmp, target) != 0) {
+    eprint("failed to rename %s to %s: %s\n", tmp, target, strerror(errno));
+    goto done;
+  }
+  free(tmp);
+  tmp = NULL;
+
+  eprint("built filter of %zu bytes into %s (%.2f bytes per hash, %.2f%% "
+         "false positives)\n",
+         size, target, len == 0 ? 0.0 : (double)size / (double)len,
+         100.0 * (double)positives / PROBES);
+  rc = 0;
+
+done:
+  if (m != MAP_FAILED)
+    (void)munmap(m, size);
+  if (fd >= 0)
+    (void)close(fd);
+  if (tmp != NULL)
+    (void)unlink(tmp);
+  free(tmp);
+  free(target);
+
+  return rc;
+}
+
+static int cmp_record(const void *a, const void *b) {
+  const record_t *x = a;
+  const record_t *y = b;
+  return memcmp(x->hash, y->hash, sizeof(x->hash));
+}
+
+int breach_build(const char *path) {
+
+  assert(path != NULL);
+
+  char *target = NULL;
+  char *tmp = NULL;
+  FILE *source = NULL;
+  FILE *out = NULL;
+  void *m = MAP_FAILED;
+  size_t size = 0;
+  char *line = NULL;
+  size_t line_size = 0;
+  int rc = -1;
+
+  target = derived_path(path, ".idx");
+  if (target == NULL || asprintf(&tmp, "%s.XXXXXX", target) < 0) {
+    tmp = NULL;
+    eprint("out of memory\n");
+    goto done;
+  }
+
+  source = fopen(path, "r");
+  if (source == NULL) {
+    eprint("failed to open %s: %s\n", path, strerror(errno));
+    goto done;
+  }
+
+  {
+    const int fd = mkstemp(tmp);
+    if (fd < 0) {
+      eprint("failed to create %s: %s\n", tmp, strerror(errno));
+      free(tmp);
+      tmp = NULL;
+      goto done;
+    }
+    out = fdopen(fd, "w");
+    if (out == NULL) {
+      eprint("failed to open %s: %s\n", tmp, strerror(errno));
+      (void)close(fd);
+      goto done;
+    }
+  }
+
+  // leave room for the header, which is written once the records are known
+  if (fseek(out, (long)sizeof(header_t), SEEK_SET) != 0) {
+    eprint("failed to write %s: %s\n", tmp, strerror(errno));
+    goto done;
+  }
+
+  // copy the records, noting whether they need sorting
+  size_t record_len = 0;
+  bool sorted = true;
+  record_t last = {0};
+  for (size_t lineno = 1; getline(&line, &line_size, source) > 0; ++lineno) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0')
+      continue;
+
+    record_t r = {0};
+    if (parse_line(line, &r) != 0) {
+      eprint("%s:%zu: expected a SHA-1 hash and count\n", path, lineno);
+      goto done;
+    }
+
+    if (record_len > 0 && cmp_record(&last, &r) >= 0)
+      sorted = false;
+
+    if (fwrite(&r, sizeof(r), 1, out) != 1) {
+      eprint("failed to write %s: %s\n", tmp, strerror(errno));
+      goto done;
+    }
+    last = r;
+    ++record_len;
+  }
+  if (ferror(source)) {
+    eprint("failed to read %s\n", path);
+    goto done;
+  }
+
+  size = sizeof(header_t) + record_len * sizeof(record_t);
+  if (fflush(out) != 0 || ftruncate(fileno(out), (off_t)size) != 0) {
+    eprint("failed to write %s: %s\n", tmp, strerror(errno));
+    goto done;
+  }
+
+  // Finish the index in place. Mapping it, rather than reading it into memory,
+  // lets a list larger than memory be sorted.
+  m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(out), 0);
+  if (m == MAP_FAILED) {
+    eprint("failed to map %s: %s\n", tmp, strerror(errno));
+    goto done;
+  }
+  header_t *h = m;
+  record_t *rs = (void *)((char *)m + sizeof(*h));
+
+  // The published lists are already sorted, but lists assembled from the
+  // range API may not be.
+  if (!sorted)
+    qsort(rs, record_len, sizeof(rs[0]), cmp_record);
+
+  // merge duplicates
+  size_t unique = 0;
+  for (size_t i = 0; i < record_len; ++i) {
+    if (unique > 0 && cmp_record(&rs[unique - 1], &rs[i]) == 0) {
+      const uint32_t c = rs[unique - 1].count;
+      rs[unique - 1].count =
+          c > UINT32_MAX - rs[i].count ? UINT32_MAX : c + rs[i].count;
+      continue;
+    }
+    rs[unique++] = rs[i];
+  }
+
+  memcpy(h->magic, MAGIC, sizeof(MAGIC));
+  h->record_len = unique;
+  size_t prefix = 0;
+  for (size_t i = 0; i < unique; ++i) {
+    while (prefix <= prefix_of(rs[i].hash))
+      h->fanout[prefix++] = i;
+  }
+  while (prefix <= FANOUT)
+    h->fanout[prefix++] = unique;
+
+  if (build_filter(path, rs, unique) != 0)
+    goto done;
+
+  (void)munmap(m, size);
+  m = MAP_FAILED;
+
+  size = sizeof(header_t) + unique * sizeof(record_t);
+  if (ftruncate(fileno(out), (off_t)size) != 0) {
+    eprint("failed to write %s: %s\n", tmp, strerror(errno));
+    goto done;
+  }
+
+  {
+    const int r = fclose(out);
+    out = NULL;
+    if (r != 0) {
+      eprint("failed to write %s: %s\n", tmp, strerror(errno));
+      goto done;
+    }
+  }
+
+  if (rename(tmp, target) != 0) {
+    eprint("failed to rename %s to %s: %s\n", tmp, target, strerror(errno));
+    goto done;
+  }
+  free(tmp);
+  tmp = NULL;
+
+  eprint("indexed %zu breached password hashes into %s\n", unique, target);
+  rc = 0;
+
+done:
+  if (m != MAP_FAILED)
+    (void)munmap(m, size);
+  if (out != NULL)
+    (void)fclose(out);
+  if (tmp != NULL)
+    (void)unlink(tmp);
+  free(tmp);
+  if (source != NULL)
+    (void)fclose(source);
+  free(line);
+  free(target);
+
+  return rc;
+}
+
+/// is this a well formed index?
+static bool valid(const void *data, size_t size) {
+
+  if (size < sizeof(header_t))
+    return false;
+  const header_t *h = data;
+
+  if (memcmp(h->magic, MAGIC, sizeof(MAGIC)) != 0)
+    return false;
+
+  if (h->record_len != (size - sizeof(*h)) / sizeof(record_t) ||
+      (size - sizeof(*h)) % sizeof(record_t) != 0)
+    return false;
+
+  if (h->fanout[0] != 0)
+    return false;
+  for (size_t i = 0; i < FANOUT; ++i) {
+    if (h->fanout[i] > h->fanout[i + 1])
+      return false;
+  }
+  if (h->fanout[FANOUT] != h->record_len)
+    return false;
+
+  return true;
+}
+
+/// is this a well formed filter?
+static bool valid_filter(const void *data, size_t size) {
+
+  if (size < sizeof(filter_header_t))
+    return false;
+  const filter_header_t *h = data;
+
+  if (memcmp(h->magic, FILTER_MAGIC, sizeof(FILTER_MAGIC)) != 0)
+    return false;
+
+  if (h->block_len == 0 ||
+      h->block_len != (size - sizeof(*h)) / sizeof(block_t) ||
+      (size - sizeof(*h)) % sizeof(block_t) != 0)
+    return false;
+
+  return true;
+}
+
+/// map a file derived from a breach list
+///
+/// @param path Path to the derived file
+/// @param source Path to the breach list
+/// @param size [out] Size of the mapping
+/// @return The mapping, or NULL with errno set on failure
+static void *map(const char *path, const char *source, size_t *size) {
+
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  void *m = NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    goto done;
+
+  // the list may have been deleted to save space, but if it has been updated
+  // this is probably missing recent breaches
+  struct stat src;
+  if (stat(source, &src) == 0 && src.st_mtime > st.st_mtime)
+    eprint("warning: %s is older than %s; rerun check --build-index\n", path,
+           source);
+
+  *size = (size_t)st.st_size;
+  if (*size == 0) {
+    errno = EINVAL;
+    goto done;
+  }
+  m = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (m == MAP_FAILED) {
+    m = NULL;
+    goto done;
+  }
+
+  // look ups touch the file at random, so reading ahead is wasted I/O
+  (void)madvise(m, *size, MADV_RANDOM);
+
+done:
+  {
+    const int saved = errno;
+    (void)close(fd);
+    errno = saved;
+  }
+
+  return m;
+}
+
+int breach_open(const char *path) {
+
+  assert(path != NULL);
+  assert(image == NULL && filter_image == NULL && "breach list opened twice");
+
+  char *index_path = derived_path(path, ".idx");
+  char *filter_path = derived_path(path, ".filter");
+  int rc = -1;
+
+  if (index_path == NULL || filter_path == NULL) {
+    eprint("out of memory\n");
+    goto done;
+  }
+
+  // Either of the filter or the index can be deleted to save space. Without
+  // the index, possible hits in the filter are confirmed by Have I Been Pwned.
+  void *f = map(filter_path, path, &filter_image_size);
+  if (f == NULL && errno != ENOENT) {
+    eprint("failed to open %s: %s\n", filter_path, strerror(errno));
+    goto done;
+  }
+  if (f != NULL) {
+    if (!valid_filter(f, filter_image_size)) {
+      (void)munmap(f, filter_image_size);
+      eprint("%s is not a breach filter\n", filter_path);
+      goto done;
+    }
+    filter_image = f;
+    filter = f;
+    blocks = (const void *)((const char *)f + sizeof(*filter));
+  }
+
+  void *m = map(index_path, path, &image_size);
+  if (m == NULL && (errno != ENOENT || filter == NULL)) {
+    eprint("failed to open %s: %s (run check --build-index first)\n",
+           index_path, strerror(errno));
+    goto done;
+  }
+  if (m != NULL) {
+    if (!valid(m, image_size)) {
+      (void)munmap(m, image_size);
+      eprint("%s is not a breach index\n", index_path);
+      goto done;
+    }
+    image = m;
+    header = m;
+    records = (const void *)((const char *)m + sizeof(*header));
+  }
+
+  rc = 0;
+
+done:
+  if (rc != 0)
+    breach_close();
+  free(filter_path);
+  free(index_path);
+
+  return rc;
+}
+
+breach_t breach_find(const unsigned char digest[static SHA_DIGEST_LENGTH],
+                     unsigned long *count) {
+  assert(digest != NULL);
+  assert(count != NULL);
+
+  // the filter, being small enough to stay cached, can rule out most hashes
+  // without touching the index
+  if (filter != NULL && !filter_has(blocks, filter->block_len, digest))
+    return BREACH_ABSENT;
+
+  if (header == NULL)
+    return BREACH_UNKNOWN;
+
+  const size_t prefix = prefix_of(digest);
+  size_t lo = header->fanout[prefix];
+  size_t hi = header->fanout[prefix + 1];
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    const int c = memcmp(records[mid].hash, digest, SHA_DIGEST_LENGTH);
+    if (c == 0) {
+      *count = records[mid].count;
+      return BREACH_PRESENT;
+    }
+    if (c < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return BREACH_ABSENT;
+}
+
+void breach_close(void) {
+  if (image != NULL)
+    (void)munmap(image, image_size);
+  image = NULL;
+  image_size = 0;
+  header = NULL;
+  records = NULL;
+  if (filter_image != NULL)
+    (void)munmap(filter_image, filter_image_size);
+  filter_image = NULL;
+  filter_image_size = 0;
+  filter = NULL;
+  blocks = NULL;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <openssl/sha.h>
+
+// A local copy of the Have I Been Pwned password list, for checking passwords
+// without network access. The list, as downloaded, is lines of SHA-1 hashes in
+// hex with a count of how often each was seen. This is slow to search, so it is
+// converted once into an index, <list>.idx, of the hashes in binary, sorted,
+// with a table of where each 16-bit prefix starts. The index is then mapped
+// into memory, making a look up a binary search within a single prefix.
+//
+// The index of the full list runs to gigabytes, so most look ups would go to
+// disk. Alongside it, a Bloom filter of the hashes, <list>.filter, is built
+// that is small enough to stay in the page cache. Only hashes the filter
+// reports as possibly present are looked up in the index.
+
+// result of looking up a hash
+typedef enum {
+  BREACH_ABSENT,  ///< not in the list
+  BREACH_PRESENT, ///< in the list
+  BREACH_UNKNOWN, ///< possibly in the list, but there is no index to confirm it
+} breach_t;
+
+/** Convert a downloaded breach list into an index and filter alongside it
+ *
+ * Errors are reported to stderr.
+ *
+ * @param path Path to the breach list
+ * @return 0 on success
+ */
+int breach_build(const char *path);
+
+/** Load the index and filter of a breach list
+ *
+ * Either may be missing, but not both. Errors are reported to stderr.
+ *
+ * @param path Path to the breach list, from which the index was built
+ * @return 0 on success
+ */
+int breach_open(const char *path);
+
+/** Look up a hash in the loaded index and filter
+ *
+ * This may be called concurrently from multiple threads.
+ *
+ * @param digest SHA-1 hash of the password to look up
+ * @param count [out] Number of times the password was seen in breaches, if it
+ *   was found
+ * @return Whether the password was found
+ */
+breach_t breach_find(const unsigned char digest[static SHA_DIGEST_LENGTH],
+                     unsigned long *count);
+
+/// unload the index and filter
+void breach_close(void);
@@ -1,12 +1,40 @@
+// Changing the main password re-encrypts every entry, which is slow for large
+// databases. To avoid losing this work to an interruption, re-encrypted entries
+// are periodically checkpointed to a shadow database, <database>.rekey. Its
+// first entry is a marker, encrypted under the new password, that identifies
+// the database being re-encrypted. The remaining entries are re-encryptions of
+// a prefix of the database’s entries, in order. A later change-main to the
+// same new password picks up from where this left off.
+//
+// The shadow database is only accessed while holding the exclusive lock on the
+// database itself, so it cannot be seen half-written by another change-main.
+
 #include "change-main.h"
 #include "../common/argparse.h"
 #include "../common/streq.h"
 #include "cli.h"
 #include "print.h"
+#include "stats.h"
+#include <assert.h>
+#include <inttypes.h>
 #include <passwand/passwand.h>
+#include <pthread.h>
 #include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/file.h>
+#include <time.h>
+#include <unistd.h>
+
+// fields of the marker entry
+static const char MARKER_SPACE[] = "passwand";
+static const char MARKER_KEY[] = "rekey";
+
+// minimum time between checkpoints, in seconds
+enum { CHECKPOINT_INTERVAL = 5 };
 
 static main_t *new_main;
 
@@ -16,6 +44,182 @@ static _Thread_local size_t new_entry_index;
 
 static _Atomic passwand_error_t err;
 
+// progress through `new_entries`
+static atomic_bool *done;      ///< which entries have been re-encrypted?
+static atomic_size_t done_len; ///< how many entries have been re-encrypted?
+static size_t resumed;         ///< entries recovered from an earlier run
+
+// checkpointing state
+static char *shadow_path;
+static passwand_entry_t marker;
+static bool marker_created;
+static pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t prefix;       ///< length of the contiguous done prefix
+static size_t checkpointed; ///< entries in the last checkpoint
+static time_t last_checkpoint;
+
+// should we display progress?
+static bool show_progress;
+
+static void discard_entry(passwand_entry_t *e) {
+  free(e->space);
+  free(e->key);
+  free(e->value);
+  free(e->hmac);
+  free(e->hmac_salt);
+  free(e->salt);
+  free(e->iv);
+}
+
+/// describe the database being re-encrypted, to detect stale checkpoints
+///
+/// This is an FNV-1a hash of the entries’ MACs, which change if any entry
+/// changes. The work factor is included because it is not recorded in the
+/// entries themselves.
+static char *fingerprint(const passwand_entry_t *entries, size_t entry_len) {
+  uint64_t h = UINT64_C(0xcbf29ce484222325);
+  for (size_t i = 0; i < entry_len; ++i) {
+    for (size_t j = 0; j < entries[i].hmac_len; ++j) {
+      h ^= entries[i].hmac[j];
+      h *= UINT64_C(0x100000001b3);
+    }
+  }
+  char *f = NULL;
+  if (asprintf(&f, "%016" PRIx64 " %zu %u", h, entry_len,
+               options.db.work_factor) < 0)
+    return NULL;
+  return f;
+}
+
+typedef struct {
+  const char *expected;
+  bool matches;
+} marker_check_t;
+
+static void check_marker(void *state, const char *space, const char *key,
+                         const char *value) {
+  marker_check_t *c = state;
+  c->matches = streq(space, MARKER_SPACE) && streq(key, MARKER_KEY) &&
+               streq(value, c->expected);
+}
+
+/// recover re-encrypted entries from an interrupted run, if there was one
+///
+/// @return 0 on success
+static int resume(const main_t *mainpass, const passwand_entry_t *entries,
+                  const char *expected) {
+
+  passwand_entry_t *shadow = NULL;
+  size_t shadow_len = 0;
+  int rc = -1;
+
+  if (access(shadow_path, F_OK) != 0) {
+    rc = 0;
+    goto done;
+  }
+
+  passwand_error_t e = passwand_import(shadow_path, &shadow, &shadow_len);
+  if (e == PW_NO_MEM) {
+    eprint("out of memory\n");
+    goto done;
+  }
+
+  // Does this pick up where a change-main of this database to this password
+  // left off? If not, it is of no use and will be overwritten.
+  marker_check_t check = {.expected = expected};
+  if (e == PW_OK && shadow_len > 0 && shadow_len - 1 <= new_entries_len) {
+    shadow[0].work_factor = options.db.work_factor;
+    e = passwand_entry_do(new_main->main, &shadow[0], check_marker, &check);
+  }
+  if (!check.matches) {
+    eprint("ignoring progress from an unrelated change-main in %s\n",
+           shadow_path);
+    rc = 0;
+    goto done;
+  }
+
+  // The skipped entries will not be decrypted, so would not reveal a main
+  // password that differs from the one the earlier run used. Each run checks
+  // its own entries, so checking the first is enough to know the prefix was
+  // decrypted with this password.
+  if (shadow_len > 1) {
+    e = passwand_entry_check_mac(mainpass->main, &entries[0]);
+    if (e != PW_OK) {
+      eprint("failed to resume from %s: %s\n", shadow_path, passwand_error(e));
+      goto done;
+    }
+  }
+
+  // take ownership of the marker and recovered entries
+  marker = shadow[0];
+  marker_created = true;
+  resumed = shadow_len - 1;
+  for (size_t i = 0; i < resumed; ++i) {
+    new_entries[i] = shadow[i + 1];
+    done[i] = true;
+  }
+  shadow_len = 0;
+  done_len = prefix = checkpointed = resumed;
+
+  eprint("resuming from entry %zu of %zu\n", resumed, new_entries_len);
+  rc = 0;
+
+done:
+  for (size_t i = 0; i < shadow_len; ++i)
+    discard_entry(&shadow[i]);
+  free(shadow);
+
+  return rc;
+}
+
+/// write the re-encrypted prefix to the shadow database
+///
+/// The caller must hold `checkpoint_lock`.
+static void checkpoint(void) {
+
+  if (prefix == checkpointed)
+    return;
+
+  passwand_entry_t *shadow = calloc(prefix + 1, sizeof(shadow[0]));
+  if (shadow == NULL)
+    return;
+  shadow[0] = marker;
+  for (size_t i = 0; i < prefix; ++i)
+    shadow[i + 1] = new_entries[i];
+
+  // failing to checkpoint only loses the ability to resume, so is not fatal
+  passwand_error_t e = export_entries(shadow_path, shadow, prefix + 1);
+  free(shadow);
+  if (e != PW_OK) {
+    eprint("failed to checkpoint progress to %s: %s\n", shadow_path,
+           passwand_error(e));
+    return;
+  }
+
+  checkpointed = prefix;
+  last_checkpoint = time(NULL);
+}
+
+/// note an entry is complete, checkpointing if it is time to
+static void complete(size_t index) {
+
+  done[index] = true;
+  const size_t n = ++done_len;
+
+  if (show_progress)
+    eprint("\rre-encrypted %zu of %zu entries", n, new_entries_len);
+
+  // If another thread is already checkpointing, leave it to that. It may not
+  // account for this entry, but a later checkpoint will.
+  if (pthread_mutex_trylock(&checkpoint_lock) != 0)
+    return;
+  while (prefix < new_entries_len && done[prefix])
+    ++prefix;
+  if (time(NULL) - last_checkpoint >= CHECKPOINT_INTERVAL)
+    checkpoint();
+  (void)pthread_mutex_unlock(&checkpoint_lock);
+}
+
 static void loop_notify(size_t entry_index) { new_entry_index = entry_index; }
 
 static bool loop_condition(void) { return err == PW_OK; }
@@ -30,11 +234,15 @@ static void loop_body(const char *space, const char *key, const char *value) {
     if (atomic_compare_exchange_strong(&err, &none, e))
       eprint("failed to process entry %zu: %s\n", new_entry_index,
              passwand_error(e));
+    return;
   }
+
+  complete(new_entry_index);
 }
 
-static int initialize(const main_t *mainpass __attribute__((unused)),
-                      passwand_entry_t *entries __attribute__((unused)),
+static size_t skip(void) { return resumed; }
+
+static int initialize(const main_t *mainpass, passwand_entry_t *entries,
                       size_t entry_len) {
 
   new_main = NULL;
@@ -42,6 +250,15 @@ static int initialize(const main_t *mainpass __attribute__((unused)),
   new_entries = NULL;
   new_entries_len = entry_len;
   err = PW_OK;
+  done = NULL;
+  done_len = 0;
+  resumed = 0;
+  shadow_path = NULL;
+  marker_created = false;
+  prefix = checkpointed = 0;
+  last_checkpoint = time(NULL);
+  show_progress = isatty(STDERR_FILENO);
+  char *expected = NULL;
   int ret = -1;
 
   new_main = getpassword("new main password: ");
@@ -64,16 +281,47 @@ static int initialize(const main_t *mainpass __attribute__((unused)),
   discard_main(&confirm_new);
 
   new_entries = calloc(entry_len, sizeof(*new_entries));
-  if (new_entries == NULL) {
+  done = calloc(entry_len, sizeof(*done));
+  if ((entry_len > 0 && (new_entries == NULL || done == NULL)) ||
+      asprintf(&shadow_path, "%s.rekey", options.db.path) < 0) {
+    shadow_path = NULL;
+    eprint("out of memory\n");
+    goto done;
+  }
+
+  expected = fingerprint(entries, entry_len);
+  if (expected == NULL) {
     eprint("out of memory\n");
     goto done;
   }
 
+  if (resume(mainpass, entries, expected) != 0)
+    goto done;
+
+  if (!marker_created) {
+    passwand_error_t e =
+        passwand_entry_new(&marker, new_main->main, MARKER_SPACE, MARKER_KEY,
+                           expected, options.db.work_factor);
+    if (e != PW_OK) {
+      eprint("failed to create checkpoint marker: %s\n", passwand_error(e));
+      goto done;
+    }
+    marker_created = true;
+  }
+
   ret = 0;
 
 done:
-  if (ret != 0)
+  free(expected);
+  if (ret != 0) {
+    for (size_t i = 0; i < resumed; ++i)
+      discard_entry(&new_entries[i]);
     free(new_entries);
+    free(done);
+    free(shadow_path);
+    if (marker_created)
+      discard_entry(&marker);
+  }
   discard_main(&confirm_new);
   if (ret != 0)
     discard_main(&new_main);
@@ -84,22 +332,34 @@ static int finalize(bool failure_pending) {
 
   discard_main(&new_main);
 
+  if (show_progress && done_len > resumed)
+    eprint("\n");
+
   if (!failure_pending && err == PW_OK) {
-    err = passwand_export(options.db.path, new_entries, new_entries_len);
-    if (err != PW_OK)
+    err = export_entries(options.db.path, new_entries, new_entries_len);
+    if (err != PW_OK) {
       eprint("failed to export entries: %s\n", passwand_error(err));
+    } else {
+      // the shadow’s marker no longer matches the database, but tidy it up
+      (void)unlink(shadow_path);
+    }
+  } else {
+    // save what we have, so it can be resumed
+    (void)pthread_mutex_lock(&checkpoint_lock);
+    while (prefix < new_entries_len && done[prefix])
+      ++prefix;
+    checkpoint();
+    (void)pthread_mutex_unlock(&checkpoint_lock);
+    if (checkpointed > 0)
+      eprint("progress saved; rerun change-main to resume\n");
   }
 
-  for (size_t i = 0; i < new_entries_len; i++) {
-    free(new_entries[i].space);
-    free(new_entries[i].key);
-    free(new_entries[i].value);
-    free(new_entries[i].hmac);
-    free(new_entries[i].hmac_salt);
-    free(new_entries[i].salt);
-    free(new_entries[i].iv);
-  }
+  for (size_t i = 0; i < new_entries_len; i++)
+    discard_entry(&new_entries[i]);
   free(new_entries);
+  free(done);
+  free(shadow_path);
+  discard_entry(&marker);
 
   return err != PW_OK;
 }
@@ -111,6 +371,7 @@ const command_t change_main = {
     .need_length = DISALLOWED,
     .access = LOCK_EX,
     .initialize = initialize,
+    .skip = skip,
     .loop_notify = loop_notify,
     .loop_condition = loop_condition,
     .loop_body = loop_body,
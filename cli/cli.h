@@ -15,6 +15,12 @@ main_t *getpassword(const char *prompt);
 
 void discard_main(main_t **m);
 
+// duplicate a string into secure memory
+char *secure_strdup(const char *s);
+
+// free a string from secure_strdup, or do nothing if it is NULL
+void secure_strfree(char *s);
+
 // how a command line argument is used
 typedef enum {
   DISALLOWED,
@@ -29,15 +35,42 @@ typedef struct {
   arg_required_t need_value;  // whether the command uses the --value argument
   arg_required_t need_length; // whether the command uses the --length argument
 
+  // whether --space and --key may be repeated and --keys-from given, to
+  // operate on more than one entry
+  bool many_targets;
+
+  // whether the command accepts options that configure checking passwords,
+  // like --dictionary
+  bool checks_passwords;
+
+  // whether the command accepts options that configure generating passwords,
+  // like --charset
+  bool generates_passwords;
+
   // mode to access the database in:
   //  LOCK_SH - shared (read)
   //  LOCK_EX - exclusive (write)
   int access;
 
+  // Optional step run before the database is locked, for commands that only
+  // know which mode they need once they have read their input. Returns the
+  // mode to use in place of `access`, or -1 on failure. If this succeeds,
+  // `finalize` is called even if `initialize` is never reached.
+  int (*prepare)(void);
+
+  // Should entries be scanned most-likely-first, according to the access
+  // statistics? This only helps commands that stop at the first match.
+  bool ordered;
+
   // constructor
   int (*initialize)(const main_t *mainpass, passwand_entry_t *entries,
                     size_t entry_len);
 
+  // Optional number of leading entries that need not be visited, e.g. because
+  // they were handled by an earlier, interrupted run. This is queried after
+  // `initialize`.
+  size_t (*skip)(void);
+
   // prepare to run `loop_body` on an entry
   void (*loop_notify)(size_t entry_index);
 
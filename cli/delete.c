@@ -3,6 +3,7 @@
 #include "../common/streq.h"
 #include "cli.h"
 #include "print.h"
+#include "stats.h"
 #include <assert.h>
 #include <passwand/passwand.h>
 #include <stdatomic.h>
@@ -67,7 +68,7 @@ static int finalize(bool failure_pending) {
   saved_entries[saved_entry_len - 1] = deleted;
 
   passwand_error_t err =
-      passwand_export(options.db.path, saved_entries, saved_entry_len - 1);
+      export_entries(options.db.path, saved_entries, saved_entry_len - 1);
   if (err != PW_OK) {
     eprint("failed to export entries: %s\n", passwand_error(err));
     return -1;
@@ -82,6 +83,7 @@ const command_t delete = {
     .need_value = DISALLOWED,
     .need_length = DISALLOWED,
     .access = LOCK_EX,
+    .ordered = true,
     .initialize = initialize,
     .loop_notify = loop_notify,
     .loop_condition = loop_condition,
@@ -0,0 +1,428 @@
+#include "dictionary.h"
+#include "../common/getenv.h"
+#include <assert.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <passwand/passwand.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// longest word that is indexed
+enum { MAX_LENGTH = 63 };
+
+// The index file is a header, followed by the path of the word list, followed
+// by an array of keys, followed by the text of the keys as NUL-terminated
+// strings. The path is NUL-terminated and padded to a multiple of 8 bytes.
+// Keys are sorted by length, then bytewise, so the keys of each length form a
+// contiguous bucket to be binary searched. The index is only read on the
+// machine that wrote it, so it is in native byte order.
+typedef struct {
+  char magic[8];
+  uint64_t source_dev;             ///< device holding the word list
+  uint64_t source_inode;           ///< identity of the word list
+  uint64_t source_mtime;           ///< modification time of the word list
+  uint64_t source_size;            ///< size of the word list
+  uint64_t path_len;               ///< length of the word list’s path
+  uint64_t key_len;                ///< number of keys
+  uint64_t pool_len;               ///< bytes of key text
+  uint64_t bucket[MAX_LENGTH + 2]; ///< first key of each length, and the end
+} header_t;
+
+static const char MAGIC[8] = "pwdict2\n";
+
+// flag on a key’s offset into the text, for words in the list as given
+static const uint32_t EXACT = UINT32_C(1) << 31;
+
+// the loaded index, either mapped from the cache or built in memory
+static void *image;
+static size_t image_size;
+static bool mapped;
+static const header_t *header;
+static const uint32_t *keys;
+static const char *pool;
+
+void dictionary_normalise(char *s) {
+  assert(s != NULL);
+  for (char *p = s; *p != '\0'; ++p) {
+    switch (*p) {
+    case '0':
+      *p = 'o';
+      break;
+    case '1':
+    case '!':
+      *p = 'i';
+      break;
+    case '3':
+      *p = 'e';
+      break;
+    case '4':
+    case '@':
+      *p = 'a';
+      break;
+    case '5':
+    case '$':
+      *p = 's';
+      break;
+    case '7':
+      *p = 't';
+      break;
+    case '9':
+      *p = 'g';
+      break;
+    default:
+      *p = (char)tolower((unsigned char)*p);
+    }
+  }
+}
+
+/// bytes occupied by a word list path of the given length in the index
+static size_t path_space(size_t len) { return (len + 1 + 7) / 8 * 8; }
+
+/// find the path of the cached index
+static char *cache_path(void) {
+  const char *home = getenv_("HOME");
+  if (home == NULL)
+    return NULL;
+  char *path = NULL;
+  if (asprintf(&path, "%s/.passwand.dict", home) < 0)
+    return NULL;
+  return path;
+}
+
+/// does this index describe the given word list, and is it well formed?
+static bool valid(const void *data, size_t size, const char *path,
+                  const struct stat *source) {
+
+  if (size < sizeof(header_t))
+    return false;
+  const header_t *h = data;
+
+  if (memcmp(h->magic, MAGIC, sizeof(MAGIC)) != 0)
+    return false;
+  if (h->source_dev != (uint64_t)source->st_dev ||
+      h->source_inode != (uint64_t)source->st_ino ||
+      h->source_mtime != (uint64_t)source->st_mtime ||
+      h->source_size != (uint64_t)source->st_size)
+    return false;
+
+  const size_t path_len = strlen(path);
+  if (h->path_len != path_len)
+    return false;
+  if (path_space(path_len) > size - sizeof(*h))
+    return false;
+  if (memcmp((const char *)data + sizeof(*h), path, path_len + 1) != 0)
+    return false;
+  const size_t rest = size - sizeof(*h) - path_space(path_len);
+
+  if (h->key_len > rest / sizeof(keys[0]))
+    return false;
+  if (h->pool_len != rest - h->key_len * sizeof(keys[0]))
+    return false;
+
+  for (size_t i = 0; i <= MAX_LENGTH; ++i) {
+    if (h->bucket[i] > h->bucket[i + 1])
+      return false;
+  }
+  if (h->bucket[MAX_LENGTH + 1] != h->key_len)
+    return false;
+
+  return true;
+}
+
+typedef struct {
+  char *text;
+  size_t len;
+  bool exact;
+} word_t;
+
+static int cmp_word(const void *a, const void *b) {
+  const word_t *x = a;
+  const word_t *y = b;
+  if (x->len != y->len)
+    return x->len < y->len ? -1 : 1;
+  return memcmp(x->text, y->text, x->len);
+}
+
+static int add_word(word_t **words, size_t *len, size_t *capacity,
+                    const char *text, bool exact) {
+  if (*len == *capacity) {
+    const size_t c = *capacity == 0 ? 1024 : *capacity * 2;
+    word_t *w = realloc(*words, c * sizeof(w[0]));
+    if (w == NULL)
+      return -1;
+    *words = w;
+    *capacity = c;
+  }
+  char *t = strdup(text);
+  if (t == NULL)
+    return -1;
+  (*words)[(*len)++] = (word_t){.text = t, .len = strlen(t), .exact = exact};
+  return 0;
+}
+
+/// build an index of a word list in memory
+static void *build(FILE *source, const char *path, const struct stat *st,
+                   size_t *size) {
+
+  word_t *words = NULL;
+  size_t word_len = 0;
+  size_t capacity = 0;
+  char *line = NULL;
+  size_t line_size = 0;
+  void *result = NULL;
+
+  while (getline(&line, &line_size, source) > 0) {
+    line[strcspn(line, "\r\n")] = '\0';
+    const size_t len = strlen(line);
+    if (len == 0 || len > MAX_LENGTH)
+      continue;
+
+    if (add_word(&words, &word_len, &capacity, line, true) != 0)
+      goto done;
+    dictionary_normalise(line);
+    if (add_word(&words, &word_len, &capacity, line, false) != 0)
+      goto done;
+  }
+
+  // sort and merge duplicates, keeping track of which appeared as given
+  if (word_len > 0)
+    qsort(words, word_len, sizeof(words[0]), cmp_word);
+  size_t unique = 0;
+  size_t pool_len = 0;
+  for (size_t i = 0; i < word_len; ++i) {
+    if (unique > 0 && cmp_word(&words[unique - 1], &words[i]) == 0) {
+      words[unique - 1].exact |= words[i].exact;
+      free(words[i].text);
+      continue;
+    }
+    words[unique++] = words[i];
+    pool_len += words[i].len + 1;
+  }
+  word_len = unique;
+
+  // offsets into the text must leave room for the EXACT flag
+  if (pool_len >= EXACT)
+    goto done;
+
+  const size_t path_len = strlen(path);
+  *size = sizeof(header_t) + path_space(path_len) +
+          word_len * sizeof(keys[0]) + pool_len;
+  result = calloc(1, *size);
+  if (result == NULL)
+    goto done;
+
+  header_t *h = result;
+  memcpy(h->magic, MAGIC, sizeof(MAGIC));
+  h->source_dev = (uint64_t)st->st_dev;
+  h->source_inode = (uint64_t)st->st_ino;
+  h->source_mtime = (uint64_t)st->st_mtime;
+  h->source_size = (uint64_t)st->st_size;
+  h->path_len = path_len;
+  h->key_len = word_len;
+  h->pool_len = pool_len;
+  memcpy((char *)result + sizeof(*h), path, path_len + 1);
+
+  uint32_t *k = (void *)((char *)result + sizeof(*h) + path_space(path_len));
+  char *text = (char *)&k[word_len];
+  size_t offset = 0;
+  size_t length = 0;
+  for (size_t i = 0; i < word_len; ++i) {
+    while (length < words[i].len)
+      h->bucket[++length] = i;
+    k[i] = (uint32_t)offset | (words[i].exact ? EXACT : 0);
+    memcpy(&text[offset], words[i].text, words[i].len + 1);
+    offset += words[i].len + 1;
+  }
+  while (length <= MAX_LENGTH)
+    h->bucket[++length] = word_len;
+
+done:
+  for (size_t i = 0; i < word_len; ++i)
+    free(words[i].text);
+  free(words);
+  free(line);
+
+  return result;
+}
+
+/// write an index to the cache
+///
+/// Failure is ignored, as it only means rebuilding the index next time.
+static void save(const char *path, const void *data, size_t size) {
+
+  char *tmp = NULL;
+  if (asprintf(&tmp, "%s.XXXXXX", path) < 0)
+    return;
+
+  const int fd = mkstemp(tmp);
+  if (fd < 0) {
+    free(tmp);
+    return;
+  }
+
+  bool ok = true;
+  for (size_t written = 0; ok && written < size;) {
+    const ssize_t w = write(fd, (const char *)data + written, size - written);
+    if (w < 0) {
+      ok = false;
+    } else {
+      written += (size_t)w;
+    }
+  }
+
+  if (close(fd) != 0)
+    ok = false;
+  if (!ok || rename(tmp, path) != 0)
+    (void)unlink(tmp);
+  free(tmp);
+}
+
+/// map the cached index, if it is up to date
+static void load(const char *path, const char *source_path,
+                 const struct stat *source) {
+
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    const size_t size = (size_t)st.st_size;
+    void *m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m != MAP_FAILED) {
+      if (valid(m, size, source_path, source)) {
+        image = m;
+        image_size = size;
+        mapped = true;
+      } else {
+        (void)munmap(m, size);
+      }
+    }
+  }
+
+  (void)close(fd);
+}
+
+int dictionary_open(const char *path) {
+
+  assert(path != NULL);
+  assert(image == NULL && "dictionary opened twice");
+
+  char *cache = cache_path();
+  FILE *source = NULL;
+  int rc = -1;
+
+  // identify the word list by its full path, so the index of another is not
+  // mistaken for its own
+  char *full = realpath(path, NULL);
+  const char *id = full == NULL ? path : full;
+
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    // no word list, so nothing to find
+    rc = 0;
+    goto done;
+  }
+
+  // try the cached index
+  if (cache != NULL)
+    load(cache, id, &st);
+
+  // otherwise, build it afresh
+  if (image == NULL) {
+    source = fopen(path, "r");
+    if (source == NULL) {
+      rc = 0;
+      goto done;
+    }
+    image = build(source, id, &st, &image_size);
+    if (image == NULL)
+      goto done;
+    mapped = false;
+    if (cache != NULL)
+      save(cache, image, image_size);
+  }
+
+  header = image;
+  keys = (const void *)((const char *)image + sizeof(*header) +
+                        path_space(header->path_len));
+  pool = (const char *)&keys[header->key_len];
+  rc = 0;
+
+done:
+  if (source != NULL)
+    (void)fclose(source);
+  free(full);
+  free(cache);
+
+  return rc;
+}
+
+/// binary search the keys of a given length
+///
+/// @return The key’s offset and flags, or -1 if it is not present
+static int64_t lookup(const char *s, size_t len) {
+  assert(len <= MAX_LENGTH);
+
+  size_t lo = header->bucket[len];
+  size_t hi = header->bucket[len + 1];
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    const size_t offset = keys[mid] & ~EXACT;
+    if (offset + len >= header->pool_len)
+      return -1; // corrupted
+    const int c = memcmp(&pool[offset], s, len);
+    if (c == 0)
+      return keys[mid];
+    if (c < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return -1;
+}
+
+dict_match_t dictionary_find(const char *password) {
+  assert(password != NULL);
+
+  if (header == NULL)
+    return DICT_NONE;
+
+  const size_t len = strlen(password);
+  if (len == 0 || len > MAX_LENGTH)
+    return DICT_NONE;
+
+  const int64_t key = lookup(password, len);
+  if (key >= 0 && (key & EXACT))
+    return DICT_EXACT;
+
+  char normalised[MAX_LENGTH + 1];
+  memcpy(normalised, password, len + 1);
+  dictionary_normalise(normalised);
+  const bool found = lookup(normalised, len) >= 0;
+  (void)passwand_erase(normalised, sizeof(normalised));
+
+  return found ? DICT_VARIANT : DICT_NONE;
+}
+
+void dictionary_close(void) {
+  if (mapped) {
+    (void)munmap(image, image_size);
+  } else {
+    free(image);
+  }
+  image = NULL;
+  image_size = 0;
+  mapped = false;
+  header = NULL;
+  keys = NULL;
+  pool = NULL;
+}
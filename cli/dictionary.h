@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+
+// An index of a word list, used to recognise weak passwords. Building it from
+// the word list is slow, so it is cached in ~/.passwand.dict and rebuilt only
+// when the word list changes or a different one is used. The index is then
+// mapped into memory, making a look up a binary search within the words of the
+// same length.
+//
+// Words are indexed both as given and normalised, so passwords that differ
+// from a word only in case or in common character substitutions (“p4ssw0rd”)
+// are also recognised.
+
+// how a password matched the word list
+typedef enum {
+  DICT_NONE,    ///< not found
+  DICT_EXACT,   ///< found as given
+  DICT_VARIANT, ///< found after normalising case and substitutions
+} dict_match_t;
+
+/** Load the index of a word list, building it if necessary
+ *
+ * A word list that does not exist is treated as empty.
+ *
+ * @param path Path to the word list, one word per line
+ * @return 0 on success
+ */
+int dictionary_open(const char *path);
+
+/** Look up a password in the loaded index
+ *
+ * This may be called concurrently from multiple threads.
+ *
+ * @param password Password to look up
+ * @return How the password matched
+ */
+dict_match_t dictionary_find(const char *password);
+
+/** Normalise a password for comparison against normalised words
+ *
+ * Letters are lower cased and common substitutions (0 for o, 3 for e, @ for a,
+ * …) are undone, in place.
+ *
+ * @param s String to normalise
+ */
+void dictionary_normalise(char *s);
+
+/// unload the index
+void dictionary_close(void);
@@ -1,82 +1,392 @@
+// Generation of entries with random passwords. Characters are drawn uniformly
+// from the alphabet by range reduction over a pool of random state, which is
+// unbiased and, unlike discarding random bytes that fall outside the
+// alphabet, uses nearly every bit of randomness read. Several entries can be
+// generated at once, and are inserted in a single export of the database.
+
 #include "generate.h"
 #include "../common/argparse.h"
 #include "cli.h"
 #include "print.h"
 #include "set.h"
+#include "stats.h"
 #include <assert.h>
 #include <ctype.h>
 #include <passwand/passwand.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/file.h>
 
 // default value if --length was not given
 static const size_t DEFAULT_LENGTH = 30;
 
-// characters we accept in a password
-static bool is_ok(char c) {
-  if (c >= 'a' && c <= 'z')
-    return true;
-  if (c >= 'A' && c <= 'Z')
-    return true;
-  if (isdigit(c))
-    return true;
-  if (c == '_')
-    return true;
-  return false;
+// characters we choose from if --charset was not given
+static const char DEFAULT_CHARSET[] =
+    "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ_abcdefghijklmnopqrstuvwxyz";
+
+// characters left out by --no-ambiguous, as they look alike in many fonts
+static const char AMBIGUOUS[] = "01IOl|";
+
+// characters passwords are drawn from
+static char alphabet[128];
+static size_t alphabet_len;
+
+// random state that characters are drawn from
+typedef struct {
+  uint64_t value; ///< uniformly distributed in [0, range)
+  uint64_t range;
+  unsigned char pool[256]; ///< random bytes not yet added to `value`
+  size_t pool_used;
+} sampler_t;
+
+// an entry to generate
+typedef struct {
+  char *space;
+  char *value;
+} target_t;
+
+static const main_t *saved_main;
+static passwand_entry_t *saved_entries;
+static size_t saved_entry_len;
+
+static target_t *targets;
+static size_t target_len;
+static size_t value_len; ///< characters in each generated password
+
+// 1 + index of a target that already exists in the database, or 0
+static atomic_size_t conflict;
+
+/// classify a character, for --require
+static unsigned class_of(char c) {
+  if (islower((unsigned char)c))
+    return CLASS_LOWER;
+  if (isupper((unsigned char)c))
+    return CLASS_UPPER;
+  if (isdigit((unsigned char)c))
+    return CLASS_DIGIT;
+  return CLASS_SYMBOL;
+}
+
+/// draw a uniformly random number in [0, n)
+///
+/// The state holds a value uniformly distributed over a range. If it falls
+/// within the largest multiple of `n` that fits in the range, the remainder
+/// modulo `n` is the result and the quotient, still uniform, is kept for
+/// later draws. Otherwise, the value is uniform over the leftover part of the
+/// range, which is kept instead. Either way, little randomness is lost.
+///
+/// @param s State to draw from
+/// @param n Number of possible results
+/// @param[out] result Drawn number
+/// @return PW_OK on success
+static passwand_error_t draw(sampler_t *s, size_t n, size_t *result) {
+
+  assert(s != NULL);
+  assert(n > 0 && n <= UINT8_MAX + 1);
+  assert(result != NULL);
+
+  while (true) {
+
+    // top up the state, so that a draw is rarely rejected
+    while (s->range <= UINT64_MAX >> 8) {
+      if (s->pool_used == sizeof(s->pool)) {
+        passwand_error_t err =
+            passwand_random_bytes_ex(s->pool, sizeof(s->pool));
+        if (err != PW_OK)
+          return err;
+        s->pool_used = 0;
+      }
+      s->value = (s->value << 8) | s->pool[s->pool_used];
+      s->range <<= 8;
+      s->pool[s->pool_used] = 0;
+      ++s->pool_used;
+    }
+
+    const uint64_t limit = s->range - s->range % n;
+    if (s->value < limit) {
+      *result = (size_t)(s->value % n);
+      s->value /= n;
+      s->range = limit / n;
+      return PW_OK;
+    }
+
+    s->value -= limit;
+    s->range -= limit;
+  }
+}
+
+/// generate a password that meets the policy
+///
+/// @param s State to draw from
+/// @param[out] password Buffer to fill
+/// @param length Number of characters to generate
+/// @return PW_OK on success
+static passwand_error_t make_password(sampler_t *s, char *password,
+                                      size_t length) {
+
+  // Redrawing the whole password until it contains each required class, rather
+  // than placing required characters at chosen positions, keeps every
+  // acceptable password equally likely.
+  unsigned seen;
+  do {
+    seen = 0;
+    for (size_t i = 0; i < length; ++i) {
+      size_t index;
+      passwand_error_t err = draw(s, alphabet_len, &index);
+      if (err != PW_OK)
+        return err;
+      password[i] = alphabet[index];
+      seen |= class_of(password[i]);
+    }
+  } while ((seen & options.require) != options.require);
+  password[length] = '\0';
+
+  return PW_OK;
+}
+
+static void discard_targets(void) {
+  for (size_t i = 0; i < target_len; ++i) {
+    free(targets[i].space);
+    if (targets[i].value != NULL)
+      (void)passwand_erase(targets[i].value, value_len + 1);
+    free(targets[i].value);
+  }
+  free(targets);
+  targets = NULL;
+  target_len = 0;
+}
+
+/// choose the characters to generate from
+///
+/// @return 0 on success
+static int make_alphabet(size_t length) {
+
+  const char *charset =
+      options.charset == NULL ? DEFAULT_CHARSET : options.charset;
+
+  unsigned present = 0;
+  alphabet_len = 0;
+  for (const char *c = charset; *c != '\0'; ++c) {
+    if (options.no_ambiguous && strchr(AMBIGUOUS, *c) != NULL)
+      continue;
+    assert(alphabet_len < sizeof(alphabet));
+    alphabet[alphabet_len++] = *c;
+    present |= class_of(*c);
+  }
+
+  if (alphabet_len == 0) {
+    eprint("no characters are left to generate passwords from\n");
+    return -1;
+  }
+
+  if ((options.require & present) != options.require) {
+    eprint("--require names a class of characters that cannot be generated\n");
+    return -1;
+  }
+
+  size_t required = 0;
+  for (unsigned r = options.require; r != 0; r &= r - 1)
+    ++required;
+  if (length < required) {
+    eprint("--length is too short to include every class in --require\n");
+    return -1;
+  }
+
+  return 0;
 }
 
 static int initialize(const main_t *mainpass, passwand_entry_t *entries,
                       size_t entry_len) {
 
+  saved_main = mainpass;
+  saved_entries = entries;
+  saved_entry_len = entry_len;
+  conflict = 0;
+  targets = NULL;
+  target_len = 0;
+
   // piggy-back off `set` constructor
   int r = set.initialize(mainpass, entries, entry_len);
   if (r != 0)
     return r;
 
-  // create space to store a generated password
-  size_t length = options.length == 0 ? DEFAULT_LENGTH : options.length;
-  assert(options.value == NULL);
-  options.value = malloc(sizeof(char) * (length + 1));
-  if (options.value == NULL) {
+  const size_t length = options.length == 0 ? DEFAULT_LENGTH : options.length;
+  if (length == SIZE_MAX) {
     eprint("out of memory\n");
     return -1;
   }
-  options.value[length] = '\0';
+  if (make_alphabet(length) != 0)
+    return -1;
+  value_len = length;
 
-  // generate the password
-  size_t offset = 0;
-  while (length > 0) {
-    char buffer[UINT8_MAX];
-    uint8_t chunk = length > UINT8_MAX ? UINT8_MAX : (uint8_t)length;
-    passwand_error_t err = passwand_random_bytes(buffer, chunk);
+  const size_t count = options.count == 0 ? 1 : options.count;
+  targets = calloc(count, sizeof(targets[0]));
+  if (targets == NULL) {
+    eprint("out of memory\n");
+    return -1;
+  }
+  target_len = count;
+
+  sampler_t *s = passwand_secure_malloc(sizeof(*s));
+  if (s == NULL) {
+    eprint("out of memory\n");
+    goto fail;
+  }
+  *s = (sampler_t){.range = 1, .pool_used = sizeof(s->pool)};
+
+  for (size_t i = 0; i < count; ++i) {
+    target_t *t = &targets[i];
+
+    if (options.space_prefix == NULL) {
+      t->space = strdup(options.space);
+    } else if (asprintf(&t->space, "%s%zu", options.space_prefix, i + 1) < 0) {
+      t->space = NULL;
+    }
+    t->value = malloc(length + 1);
+    if (t->space == NULL || t->value == NULL) {
+      eprint("out of memory\n");
+      goto fail;
+    }
+
+    passwand_error_t err = make_password(s, t->value, length);
     if (err != PW_OK) {
       eprint("failed to generate random bytes: %s\n", passwand_error(err));
-      return -1;
+      goto fail;
     }
+  }
 
-    for (uint8_t i = 0; i < chunk; ++i) {
-      if (is_ok(buffer[i])) {
-        options.value[offset] = buffer[i];
-        ++offset;
-        --length;
-      }
+  passwand_secure_free(s, sizeof(*s));
+  return 0;
+
+fail:
+  if (s != NULL)
+    passwand_secure_free(s, sizeof(*s));
+  discard_targets();
+  return -1;
+}
+
+/// find which target an existing entry’s space names, if any
+///
+/// @return 1 + index of the target, or 0 if none
+static size_t find_target(const char *space) {
+
+  if (options.space_prefix == NULL)
+    return strcmp(space, options.space) == 0 ? 1 : 0;
+
+  // match “<prefix><n>” for 1 ≤ n ≤ target_len, without a leading zero
+  const size_t prefix_len = strlen(options.space_prefix);
+  if (strncmp(space, options.space_prefix, prefix_len) != 0)
+    return 0;
+  const char *digits = &space[prefix_len];
+  if (*digits < '1' || *digits > '9')
+    return 0;
+  size_t n = 0;
+  for (const char *d = digits; *d != '\0'; ++d) {
+    if (*d < '0' || *d > '9')
+      return 0;
+    n = n * 10 + (size_t)(*d - '0');
+    if (n > target_len)
+      return 0;
+  }
+  return n;
+}
+
+static bool loop_condition(void) { return conflict == 0; }
+
+static void loop_body(const char *space, const char *key,
+                      const char *value __attribute__((unused))) {
+
+  assert(space != NULL);
+  assert(key != NULL);
+
+  if (strcmp(options.key, key) != 0)
+    return;
+
+  const size_t index = find_target(space);
+  if (index == 0)
+    return;
+
+  size_t expected = 0;
+  (void)atomic_compare_exchange_strong(&conflict, &expected, index);
+}
+
+static int finalize(bool failure_pending) {
+
+  passwand_entry_t *new_entries = NULL;
+  size_t new_len = 0;
+  int rc = -1;
+
+  const size_t c = conflict;
+  if (c != 0) {
+    eprint("an entry for %s/%s already exists\n", targets[c - 1].space,
+           options.key);
+    goto done;
+  }
+
+  if (failure_pending) {
+    rc = 0;
+    goto done;
+  }
+
+  new_entries = calloc(target_len + saved_entry_len, sizeof(new_entries[0]));
+  if (new_entries == NULL) {
+    eprint("out of memory\n");
+    goto done;
+  }
+
+  // insert the new entries at the start of the list, as we assume we will be
+  // looking them up in the near future
+  for (size_t i = 0; i < target_len; ++i) {
+    passwand_error_t err = passwand_entry_new(
+        &new_entries[i], saved_main->main, targets[i].space, options.key,
+        targets[i].value, options.db.work_factor);
+    if (err != PW_OK) {
+      eprint("failed to create new entry: %s\n", passwand_error(err));
+      goto done;
     }
+    ++new_len;
   }
+  for (size_t i = 0; i < saved_entry_len; ++i)
+    new_entries[target_len + i] = saved_entries[i];
 
-  return 0;
+  passwand_error_t err = export_entries(options.db.path, new_entries,
+                                        target_len + saved_entry_len);
+  if (err != PW_OK) {
+    eprint("failed to export entries: %s\n", passwand_error(err));
+    goto done;
+  }
+
+  rc = 0;
+
+done:
+  for (size_t i = 0; i < new_len; ++i) {
+    free(new_entries[i].space);
+    free(new_entries[i].key);
+    free(new_entries[i].value);
+    free(new_entries[i].hmac);
+    free(new_entries[i].hmac_salt);
+    free(new_entries[i].salt);
+    free(new_entries[i].iv);
+  }
+  free(new_entries);
+  discard_targets();
+
+  return rc;
 }
 
 const command_t generate = {
-    .need_space = REQUIRED,
+    .need_space = OPTIONAL,
     .need_key = REQUIRED,
     .need_value = DISALLOWED,
     .need_length = OPTIONAL,
+    .generates_passwords = true,
     .access = LOCK_EX,
     .initialize = initialize,
-    .loop_notify = set_loop_notify,
-    .loop_condition = set_loop_condition,
-    .loop_body = set_loop_body,
-    .finalize = set_finalize,
+    .loop_condition = loop_condition,
+    .loop_body = loop_body,
+    .finalize = finalize,
 };
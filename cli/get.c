@@ -1,43 +1,220 @@
 #include "get.h"
+#include "../common/access.h"
 #include "../common/argparse.h"
 #include "../common/streq.h"
 #include "cli.h"
 #include "print.h"
 #include <assert.h>
+#include <errno.h>
 #include <passwand/passwand.h>
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/file.h>
 
-static atomic_bool found;
+// an entry to look up
+typedef struct {
+  char *space;
+  char *key;
+  atomic_bool found;
+  size_t index; ///< index of the matching entry, if found
+  char *value;  ///< value of the matching entry, in secure memory
+} target_t;
 
-static int initialize(const main_t *mainpass __attribute__((unused)),
-                      passwand_entry_t *entries __attribute__((unused)),
-                      size_t entry_len __attribute__((unused))) {
+static target_t *targets;
+static size_t target_len;
+static atomic_size_t found_len;
+
+static _Thread_local size_t current_index;
+
+static const main_t *saved_main;
+static const passwand_entry_t *saved_entries;
+static size_t saved_entry_len;
+
+static void discard_targets(void) {
+  for (size_t i = 0; i < target_len; ++i) {
+    free(targets[i].space);
+    free(targets[i].key);
+    secure_strfree(targets[i].value);
+  }
+  free(targets);
+  targets = NULL;
+  target_len = 0;
+}
+
+static int add_target(const char *space, const char *key) {
+  target_t *ts = realloc(targets, (target_len + 1) * sizeof(targets[0]));
+  if (ts == NULL)
+    return -1;
+  targets = ts;
+
+  target_t *t = &targets[target_len];
+  *t = (target_t){0};
+  t->space = strdup(space);
+  t->key = strdup(key);
+  if (t->space == NULL || t->key == NULL) {
+    free(t->space);
+    free(t->key);
+    return -1;
+  }
+
+  ++target_len;
+  return 0;
+}
+
+/// read further targets from the file given to --keys-from
+///
+/// Each line is either a key in the space given by --space or a space and key
+/// separated by a tab.
+static int read_keys_from(const char *path) {
+
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    eprint("failed to open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  char *line = NULL;
+  size_t size = 0;
+  int rc = 0;
+  for (size_t lineno = 1; getline(&line, &size, f) > 0; ++lineno) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (streq(line, ""))
+      continue;
+
+    const char *space = options.space;
+    char *key = line;
+    char *tab = strchr(line, '\t');
+    if (tab != NULL) {
+      *tab = '\0';
+      space = line;
+      key = tab + 1;
+    }
+    if (space == NULL) {
+      eprint("%s:%zu: no space given for key %s\n", path, lineno, key);
+      rc = -1;
+      break;
+    }
+
+    if (add_target(space, key) != 0) {
+      eprint("out of memory\n");
+      rc = -1;
+      break;
+    }
+  }
+
+  free(line);
+  (void)fclose(f);
+
+  return rc;
+}
+
+static int initialize(const main_t *mainpass, passwand_entry_t *entries,
+                      size_t entry_len) {
+
+  found_len = 0;
+  saved_main = mainpass;
+  saved_entries = entries;
+  saved_entry_len = entry_len;
+
+  // pair up --space and --key, as validated by main()
+  for (size_t i = 0; i < options.key_len; ++i) {
+    assert(options.space_len == 1 || options.space_len == options.key_len);
+    const char *space = options.spaces[options.space_len == 1 ? 0 : i];
+    if (add_target(space, options.keys[i]) != 0) {
+      eprint("out of memory\n");
+      goto fail;
+    }
+  }
+
+  if (options.keys_from != NULL && read_keys_from(options.keys_from) != 0)
+    goto fail;
+
+  if (target_len == 0) {
+    eprint("no entries to look up\n");
+    goto fail;
+  }
 
-  found = false;
   return 0;
+
+fail:
+  discard_targets();
+  return -1;
 }
 
-static bool loop_condition(void) { return !found; }
+static void loop_notify(size_t entry_index) { current_index = entry_index; }
+
+// stop once every target has been found
+static bool loop_condition(void) { return found_len < target_len; }
 
 static void loop_body(const char *space, const char *key, const char *value) {
   assert(space != NULL);
   assert(key != NULL);
   assert(value != NULL);
 
-  if (streq(options.space, space) && streq(options.key, key)) {
-    print("%s\n", value);
-    found = true;
+  // the same entry may have been requested more than once, so check them all
+  for (size_t i = 0; i < target_len; ++i) {
+    target_t *t = &targets[i];
+    if (!streq(t->space, space) || !streq(t->key, key))
+      continue;
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&t->found, &expected, true)) {
+      t->index = current_index;
+      t->value = secure_strdup(value);
+      ++found_len;
+    }
   }
 }
 
 static int finalize(bool failure_pending __attribute__((unused))) {
-  if (!found)
-    eprint("not found\n");
 
-  return found ? 0 : -1;
+  int rc = 0;
+
+  for (size_t i = 0; i < target_len; ++i) {
+    const target_t *t = &targets[i];
+    if (!t->found) {
+      if (target_len == 1) {
+        eprint("not found\n");
+      } else {
+        eprint("not found: %s/%s\n", t->space, t->key);
+      }
+      rc = -1;
+    } else if (t->value == NULL) {
+      eprint("failed to allocate secure memory\n");
+      rc = -1;
+    }
+  }
+
+  // Print results in the order they were requested. If any are missing, print
+  // none so a caller reading them by position cannot be misled.
+  if (rc == 0) {
+    for (size_t i = 0; i < target_len; ++i)
+      print("%s\n", targets[i].value);
+  }
+
+  // Record these look ups to speed up future ones. As in main(), this is not
+  // worthwhile for databases small enough to scan in a single round. Failure
+  // is ignored because the statistics are only a hint.
+  if (saved_entry_len > options.jobs) {
+    bool hit = false;
+    for (size_t i = 0; i < target_len; ++i) {
+      if (!targets[i].found)
+        continue;
+      assert(targets[i].index < saved_entry_len);
+      if (access_hit(&saved_entries[targets[i].index]) == 0)
+        hit = true;
+    }
+    if (hit)
+      (void)access_save(options.db.path, saved_main->main,
+                        options.db.work_factor, saved_entries,
+                        saved_entry_len);
+  }
+
+  discard_targets();
+
+  return rc;
 }
 
 const command_t get = {
@@ -45,8 +222,11 @@ const command_t get = {
     .need_key = REQUIRED,
     .need_value = DISALLOWED,
     .need_length = DISALLOWED,
+    .many_targets = true,
     .access = LOCK_SH,
+    .ordered = true,
     .initialize = initialize,
+    .loop_notify = loop_notify,
     .loop_condition = loop_condition,
     .loop_body = loop_body,
     .finalize = finalize,
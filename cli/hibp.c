@@ -0,0 +1,991 @@
+#include "hibp.h"
+#include "../common/streq.h"
+#include "print.h"
+#include "range-cache.h"
+#include <arpa/inet.h>
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <passwand/passwand.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+enum {
+  CONCURRENCY = 8, ///< maximum connections, and so requests in flight
+  ATTEMPTS = 2,    ///< tries at each request
+  MAX_LINE = 8192, ///< longest HTTP response line accepted
+};
+
+// a hash waiting to be looked up, in secure memory
+typedef struct lookup {
+  char hash[RANGE_HASH_LEN + 1];
+  range_target_t target; ///< `hash`, as matched against the response
+  hibp_done_t done;
+  void *state;
+  struct lookup *next;
+} lookup_t;
+
+// a request for a prefix, and the look ups waiting on its response
+typedef struct fetch {
+  char prefix[RANGE_PREFIX_LEN + 1];
+  lookup_t *waiters;
+  unsigned attempts; ///< number of times this has been sent
+
+  // progress through the response body, once it starts arriving
+  bool scanning;
+  range_scan_t scan;
+  range_record_t *record;
+  lookup_t *late; ///< look ups that arrived after the body started
+
+  struct fetch *next; ///< next request waiting for a connection
+} fetch_t;
+
+// what a connection is doing
+typedef enum {
+  CONNECTING,  ///< waiting for TCP to connect
+  HANDSHAKING, ///< negotiating TLS
+  IDLE,        ///< waiting for a request to send
+  SENDING,     ///< sending a request
+  RECEIVING,   ///< receiving a response
+} phase_t;
+
+// how far through a response a connection is
+typedef enum {
+  STATUS,      ///< expecting the status line
+  HEADER,      ///< expecting a header or the end of the headers
+  BODY,        ///< receiving a body of known length
+  CHUNK_SIZE,  ///< expecting the size line of a chunk
+  CHUNK_DATA,  ///< receiving a chunk
+  CHUNK_END,   ///< expecting the line ending after a chunk
+  TRAILER,     ///< expecting a trailer or the end of the trailers
+  UNTIL_CLOSE, ///< receiving a body delimited by the server closing
+  COMPLETE,    ///< the response has been received
+} parse_t;
+
+typedef struct {
+  bool in_use; ///< is this slot a connection?
+  int fd;
+  SSL *ssl;
+  phase_t phase;
+  short events;                   ///< what to wait for before progressing
+  const struct addrinfo *address; ///< server address being connected to
+  bool reused;                    ///< has a request completed on this before?
+
+  fetch_t *fetch; ///< request being made
+
+  char *request;
+  size_t request_len;
+  size_t sent;
+
+  parse_t parse;
+  char line[MAX_LINE]; ///< partial line received
+  size_t line_len;
+  bool received; ///< has any of the response been received?
+  bool keep_alive;
+  bool chunked;
+  bool have_length;
+  size_t remaining; ///< bytes left in the current body or chunk
+} connection_t;
+
+// the server to query
+static char *host;
+static char *port;
+static char *host_header; ///< value of the Host header, “host[:port]”
+
+static SSL_CTX *ctx;
+
+// The state below, up to the submission queue, is only accessed from the
+// background thread.
+
+// the server’s DNS records, looked up on first use
+static struct addrinfo *dns_info;
+static bool dns_looked_up;
+static int dns_error;
+
+// the most recent TLS session, for resuming on new connections
+static SSL_SESSION *session;
+
+static connection_t connections[CONCURRENCY];
+
+// requests waiting for a connection
+static fetch_t *queue_head;
+static fetch_t *queue_tail;
+
+// Look ups handed to the background thread but not yet picked up, newest
+// first, and whether it should finish once they are done. Access is protected
+// by submit_lock. Writing to the `wake` pipe interrupts the thread’s wait.
+static pthread_mutex_t submit_lock = PTHREAD_MUTEX_INITIALIZER;
+static lookup_t *submitted;
+static bool closing;
+static int wake[2] = {-1, -1};
+
+static pthread_t thread;
+static bool started;
+
+static const char *get_ssl_error(const SSL *ssl, int ret) {
+  switch (SSL_get_error(ssl, ret)) {
+  case SSL_ERROR_ZERO_RETURN:
+    return "SSL_ERROR_ZERO_RETURN (see man SSL_get_error)";
+  case SSL_ERROR_WANT_READ:
+    return "SSL_ERROR_WANT_READ (see man SSL_get_error)";
+  case SSL_ERROR_WANT_WRITE:
+    return "SSL_ERROR_WANT_WRITE (see man SSL_get_error)";
+  case SSL_ERROR_WANT_CONNECT:
+    return "SSL_ERROR_WANT_CONNECT (see man SSL_get_error)";
+  case SSL_ERROR_WANT_ACCEPT:
+    return "SSL_ERROR_WANT_ACCEPT (see man SSL_get_error)";
+  case SSL_ERROR_WANT_X509_LOOKUP:
+    return "SSL_ERROR_WANT_X509_LOOKUP (see man SSL_get_error)";
+  case SSL_ERROR_SYSCALL:
+    return "SSL_ERROR_SYSCALL (see man SSL_get_error)";
+  case SSL_ERROR_SSL:
+    return "SSL_ERROR_SSL (see man SSL_get_error)";
+  default:
+    return "unknown";
+  }
+}
+
+/// split “host”, “host:port” or “[host]:port” into its parts
+///
+/// @return 0 on success
+static int parse_server(const char *server) {
+
+  const char *colon = strchr(server, ':');
+  if (server[0] == '[') {
+    const char *close = strchr(server, ']');
+    if (close == NULL || (close[1] != '\0' && close[1] != ':'))
+      return -1;
+    host = strndup(server + 1, (size_t)(close - server - 1));
+    if (close[1] == ':')
+      port = strdup(close + 2);
+  } else if (colon != NULL && strchr(colon + 1, ':') == NULL) {
+    host = strndup(server, (size_t)(colon - server));
+    port = strdup(colon + 1);
+  } else {
+    // no port, or an IPv6 address without one
+    host = strdup(server);
+  }
+  if (port == NULL)
+    port = strdup("https");
+  host_header = strdup(server);
+
+  if (host == NULL || port == NULL || host_header == NULL)
+    return -1;
+  if (streq(host, "") || streq(port, ""))
+    return -1;
+
+  return 0;
+}
+
+/// remember a new TLS session, called by OpenSSL
+static int new_session(SSL *ssl __attribute__((unused)), SSL_SESSION *s) {
+  if (session != NULL)
+    SSL_SESSION_free(session);
+  session = s;
+  return 1; // we have taken ownership of `s`
+}
+
+/// is this an IP address, rather than a host name?
+static bool is_address(const char *name) {
+  struct in6_addr a;
+  return inet_pton(AF_INET, name, &a) == 1 ||
+         inet_pton(AF_INET6, name, &a) == 1;
+}
+
+/// make a file descriptor non-blocking and not inherited by children
+///
+/// @return 0 on success
+static int set_flags(int fd) {
+  const int flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    return -1;
+  if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0)
+    return -1;
+  return 0;
+}
+
+static void route(lookup_t *l);
+
+/// pass on the result of a look up and release it
+static void answer(lookup_t *l, const range_result_t *result,
+                   const char *error) {
+  l->done(l->state, l->hash, result, error);
+  passwand_secure_free(l, sizeof(*l));
+}
+
+/// finish a request, passing its result to everyone waiting on it
+///
+/// @param f Request to finish
+/// @param error Reason for failure, or NULL if the response was received
+static void complete(fetch_t *f, const char *error) {
+
+  if (error == NULL)
+    range_scan_finish(&f->scan);
+  range_cache_end(f->record, error == NULL);
+  if (error != NULL)
+    range_cache_fail(f->prefix, error);
+
+  while (f->waiters != NULL) {
+    lookup_t *l = f->waiters;
+    f->waiters = l->next;
+    answer(l, error == NULL ? &l->target.result : NULL, error);
+  }
+
+  // Look ups that missed the start of the response try again, and will find it
+  // in the cache now that it has been recorded.
+  lookup_t *late = f->late;
+  free(f);
+  while (late != NULL) {
+    lookup_t *l = late;
+    late = l->next;
+    route(l);
+  }
+}
+
+static void close_connection(connection_t *c) {
+  assert(c->fetch == NULL);
+  if (c->ssl != NULL) {
+    if (SSL_is_init_finished(c->ssl))
+      (void)SSL_shutdown(c->ssl);
+    SSL_free(c->ssl);
+  }
+  if (c->fd >= 0)
+    (void)close(c->fd);
+  free(c->request);
+  memset(c, 0, sizeof(*c));
+  c->fd = -1;
+}
+
+/// give up on a connection, retrying or failing its request
+static void fail(connection_t *c, const char *error) {
+
+  fetch_t *f = c->fetch;
+  c->fetch = NULL;
+
+  // The server may have closed a connection while it was idle, in which case
+  // the request is worth retrying on another.
+  const bool retry =
+      f != NULL && c->reused && !c->received && f->attempts < ATTEMPTS;
+
+  close_connection(c);
+
+  if (f == NULL)
+    return;
+
+  if (retry) {
+    f->next = queue_head;
+    queue_head = f;
+    if (queue_tail == NULL)
+      queue_tail = f;
+    return;
+  }
+
+  complete(f, error);
+}
+
+/// did an SSL operation only fail for want of I/O?
+///
+/// If so, this notes what to wait for before trying again.
+static bool would_block(connection_t *c, int ret) {
+  switch (SSL_get_error(c->ssl, ret)) {
+  case SSL_ERROR_WANT_READ:
+    c->events = POLLIN;
+    return true;
+  case SSL_ERROR_WANT_WRITE:
+    c->events = POLLOUT;
+    return true;
+  default:
+    return false;
+  }
+}
+
+/// start connecting to the next address of the server
+///
+/// @return 0 if a connection is underway
+static int connect_next(connection_t *c) {
+  for (; c->address != NULL; c->address = c->address->ai_next) {
+    const struct addrinfo *a = c->address;
+
+    c->fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (c->fd < 0)
+      continue;
+
+    if (set_flags(c->fd) != 0 ||
+        (connect(c->fd, a->ai_addr, a->ai_addrlen) != 0 &&
+         errno != EINPROGRESS)) {
+      (void)close(c->fd);
+      c->fd = -1;
+      continue;
+    }
+
+    // completion, successful or not, is signalled by the socket being writable
+    c->phase = CONNECTING;
+    c->events = POLLOUT;
+    return 0;
+  }
+
+  return -1;
+}
+
+/// attach an SSL connection to a connected socket
+///
+/// @return 0 on success
+static int start_tls(connection_t *c) {
+
+  c->ssl = SSL_new(ctx);
+  if (c->ssl == NULL) {
+    fail(c, "creating SSL object failed");
+    return -1;
+  }
+  if (SSL_set_fd(c->ssl, c->fd) != 1) {
+    fail(c, "associating SSL object with socket file descriptor failed");
+    return -1;
+  }
+
+  // tell the server which site we want, which is only allowed for names
+  if (!is_address(host))
+    (void)SSL_set_tlsext_host_name(c->ssl, host);
+
+  // offer to resume an earlier session, saving a round trip
+  if (session != NULL)
+    (void)SSL_set_session(c->ssl, session);
+
+  c->phase = HANDSHAKING;
+  return 0;
+}
+
+/// start matching the response body as it arrives
+static void start_body(connection_t *c) {
+
+  fetch_t *f = c->fetch;
+  assert(!f->scanning);
+
+  range_target_t *targets = NULL;
+  for (lookup_t *l = f->waiters; l != NULL; l = l->next) {
+    l->target.next = targets;
+    targets = &l->target;
+  }
+  range_scan_start(&f->scan, targets);
+  f->record = range_cache_record(f->prefix);
+  f->scanning = true;
+}
+
+/// handle a complete line of a response, without its line ending
+///
+/// @return 0 on success
+static int parse_line(connection_t *c, char *line, const char **error) {
+  switch (c->parse) {
+
+  case STATUS: {
+    // skip over the HTTP version
+    const bool http10 = strncmp(line, "HTTP/1.0 ", strlen("HTTP/1.0 ")) == 0;
+    const char *code = strchr(line, ' ');
+    if (code == NULL || strncmp(code + 1, "200", strlen("200")) != 0 ||
+        (code[4] != ' ' && code[4] != '\0')) {
+      *error = "HTTP response was not 200 OK";
+      return -1;
+    }
+    c->keep_alive = !http10;
+    c->parse = HEADER;
+    return 0;
+  }
+
+  case HEADER: {
+    // the end of the headers tells us how the body is delimited
+    if (streq(line, "")) {
+      start_body(c);
+      if (c->chunked) {
+        c->parse = CHUNK_SIZE;
+      } else if (c->have_length) {
+        c->parse = c->remaining == 0 ? COMPLETE : BODY;
+      } else {
+        c->keep_alive = false;
+        c->parse = UNTIL_CLOSE;
+      }
+      return 0;
+    }
+
+    char *colon = strchr(line, ':');
+    if (colon == NULL)
+      return 0;
+    *colon = '\0';
+    const char *value = colon + 1;
+    while (*value == ' ' || *value == '\t')
+      ++value;
+
+    if (strcasecmp(line, "Content-Length") == 0) {
+      char *end;
+      c->remaining = strtoull(value, &end, 10);
+      c->have_length = end != value;
+    } else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+      c->chunked = strcasestr(value, "chunked") != NULL;
+    } else if (strcasecmp(line, "Connection") == 0) {
+      if (strcasestr(value, "close") != NULL)
+        c->keep_alive = false;
+      if (strcasestr(value, "keep-alive") != NULL)
+        c->keep_alive = true;
+    }
+    return 0;
+  }
+
+  case CHUNK_SIZE: {
+    char *end;
+    c->remaining = strtoull(line, &end, 16);
+    if (end == line) {
+      *error = "malformed chunked HTTP response";
+      return -1;
+    }
+    c->parse = c->remaining == 0 ? TRAILER : CHUNK_DATA;
+    return 0;
+  }
+
+  case CHUNK_END:
+    // each chunk is followed by a line ending
+    c->parse = CHUNK_SIZE;
+    return 0;
+
+  case TRAILER:
+    if (streq(line, ""))
+      c->parse = COMPLETE;
+    return 0;
+
+  default:
+    assert(!"unreachable");
+    return -1;
+  }
+}
+
+/// consume data received on a connection
+///
+/// @return 0 on success
+static int parse(connection_t *c, const char *data, size_t len,
+                 const char **error) {
+
+  while (len > 0 && c->parse != COMPLETE) {
+
+    if (c->parse == BODY || c->parse == CHUNK_DATA ||
+        c->parse == UNTIL_CLOSE) {
+      size_t n = len;
+      if (c->parse != UNTIL_CLOSE && n > c->remaining)
+        n = c->remaining;
+      range_scan(&c->fetch->scan, data, n);
+      range_cache_write(c->fetch->record, data, n);
+      data += n;
+      len -= n;
+      if (c->parse != UNTIL_CLOSE) {
+        c->remaining -= n;
+        if (c->remaining == 0)
+          c->parse = c->parse == BODY ? COMPLETE : CHUNK_END;
+      }
+      continue;
+    }
+
+    // accumulate a line
+    const char *nl = memchr(data, '\n', len);
+    const size_t n = nl == NULL ? len : (size_t)(nl - data);
+    if (c->line_len + n >= sizeof(c->line)) {
+      *error = "HTTP response line too long";
+      return -1;
+    }
+    memcpy(&c->line[c->line_len], data, n);
+    c->line_len += n;
+    if (nl == NULL)
+      break;
+    data += n + 1;
+    len -= n + 1;
+
+    if (c->line_len > 0 && c->line[c->line_len - 1] == '\r')
+      --c->line_len;
+    c->line[c->line_len] = '\0';
+    c->line_len = 0;
+    if (parse_line(c, c->line, error) != 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+/// the response on a connection has been received
+static void finish(connection_t *c) {
+
+  fetch_t *f = c->fetch;
+  c->fetch = NULL;
+  complete(f, NULL);
+
+  if (c->keep_alive) {
+    c->reused = true;
+    c->phase = IDLE;
+  } else {
+    close_connection(c);
+  }
+}
+
+/// make as much progress on a connection as possible without blocking
+static void advance(connection_t *c) {
+  while (c->in_use) {
+    ERR_clear_error();
+    switch (c->phase) {
+
+    case CONNECTING: {
+      int err = 0;
+      socklen_t len = sizeof(err);
+      if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+        err = errno;
+      if (err != 0) {
+        // try the server’s next address
+        (void)close(c->fd);
+        c->fd = -1;
+        c->address = c->address->ai_next;
+        if (connect_next(c) != 0)
+          fail(c, "failed to find a reachable IP address for the server");
+        return;
+      }
+      (void)start_tls(c);
+      break;
+    }
+
+    case HANDSHAKING: {
+      const int r = SSL_connect(c->ssl);
+      if (r != 1) {
+        if (!would_block(c, r))
+          fail(c, "SSL negotiation failed");
+        return;
+      }
+      c->phase = c->fetch == NULL ? IDLE : SENDING;
+      break;
+    }
+
+    case IDLE: {
+      // Nothing is expected, but TLS may still deliver, e.g., session tickets.
+      // Anything else means the server has hung up or is misbehaving.
+      char b;
+      const int r = SSL_read(c->ssl, &b, sizeof(b));
+      if (r <= 0 && would_block(c, r))
+        return;
+      close_connection(c);
+      return;
+    }
+
+    case SENDING: {
+      const int r = SSL_write(c->ssl, &c->request[c->sent],
+                              (int)(c->request_len - c->sent));
+      if (r <= 0) {
+        if (!would_block(c, r))
+          fail(c, get_ssl_error(c->ssl, r));
+        return;
+      }
+      c->sent += (size_t)r;
+      if (c->sent == c->request_len)
+        c->phase = RECEIVING;
+      break;
+    }
+
+    case RECEIVING: {
+      char buffer[BUFSIZ];
+      const int r = SSL_read(c->ssl, buffer, sizeof(buffer));
+      if (r <= 0) {
+        if (would_block(c, r))
+          return;
+        if (c->parse == UNTIL_CLOSE) {
+          finish(c);
+        } else {
+          fail(c, get_ssl_error(c->ssl, r));
+        }
+        return;
+      }
+      c->received = true;
+      const char *error = NULL;
+      if (parse(c, buffer, (size_t)r, &error) != 0) {
+        fail(c, error);
+        return;
+      }
+      if (c->parse == COMPLETE)
+        finish(c);
+      break;
+    }
+    }
+  }
+}
+
+/// start a request on a connection
+static void send_request(connection_t *c, fetch_t *f) {
+
+  assert(c->fetch == NULL);
+
+  ++f->attempts;
+  c->fetch = f;
+
+  free(c->request);
+  c->request = NULL;
+  if (asprintf(&c->request,
+               "GET /range/%s HTTP/1.1\r\n"
+               "Host: %s\r\n"
+               "User-Agent: passwand <https://github.com/Smattr/passwand>\r\n"
+               "\r\n",
+               f->prefix, host_header) < 0) {
+    c->request = NULL;
+    fail(c, "out of memory");
+    return;
+  }
+  c->request_len = strlen(c->request);
+  c->sent = 0;
+
+  c->parse = STATUS;
+  c->line_len = 0;
+  c->received = false;
+  c->keep_alive = false;
+  c->chunked = false;
+  c->have_length = false;
+  c->remaining = 0;
+
+  // if the connection is still being set up, the request follows that
+  if (c->phase == IDLE) {
+    c->phase = SENDING;
+    advance(c);
+  }
+}
+
+/// open a new connection to make a request on
+static void open_connection(connection_t *c, fetch_t *f) {
+
+  assert(!c->in_use);
+
+  // look up the server’s IP address(es), once
+  if (!dns_looked_up) {
+    assert(dns_info == NULL);
+    const struct addrinfo hints = {.ai_family = AF_UNSPEC,
+                                   .ai_socktype = SOCK_STREAM,
+                                   .ai_protocol = IPPROTO_TCP};
+    dns_error = getaddrinfo(host, port, &hints, &dns_info);
+    dns_looked_up = true;
+  }
+  if (dns_error != 0) {
+    complete(f, gai_strerror(dns_error));
+    return;
+  }
+
+  c->in_use = true;
+  c->address = dns_info;
+
+  if (connect_next(c) != 0) {
+    close_connection(c);
+    complete(f, "failed to find a reachable IP address for the server");
+    return;
+  }
+
+  send_request(c, f);
+}
+
+/// find a connection to make a request on, within the concurrency limit
+static connection_t *available(void) {
+
+  // prefer a connection that is already open
+  for (size_t i = 0; i < CONCURRENCY; ++i) {
+    connection_t *c = &connections[i];
+    if (c->in_use && c->phase == IDLE && c->fetch == NULL)
+      return c;
+  }
+
+  for (size_t i = 0; i < CONCURRENCY; ++i) {
+    if (!connections[i].in_use)
+      return &connections[i];
+  }
+
+  return NULL;
+}
+
+/// start waiting requests, as far as connections allow
+static void dispatch(void) {
+  while (queue_head != NULL) {
+    connection_t *c = available();
+    if (c == NULL)
+      return;
+
+    fetch_t *f = queue_head;
+    queue_head = f->next;
+    if (queue_head == NULL)
+      queue_tail = NULL;
+    f->next = NULL;
+
+    if (c->in_use) {
+      send_request(c, f);
+    } else {
+      open_connection(c, f);
+    }
+  }
+}
+
+/// answer a look up from the cache, or attach it to a request
+static void route(lookup_t *l) {
+
+  // do we already know the result?
+  range_result_t result;
+  const char *error = NULL;
+  if (range_cache_find(l->hash, &result, &error)) {
+    answer(l, error == NULL ? &result : NULL, error);
+    return;
+  }
+
+  // is there already a request for this prefix?
+  fetch_t *f = NULL;
+  for (size_t i = 0; i < CONCURRENCY && f == NULL; ++i) {
+    fetch_t *g = connections[i].fetch;
+    if (g != NULL && strncmp(g->prefix, l->hash, RANGE_PREFIX_LEN) == 0)
+      f = g;
+  }
+  for (fetch_t *g = queue_head; g != NULL && f == NULL; g = g->next) {
+    if (strncmp(g->prefix, l->hash, RANGE_PREFIX_LEN) == 0)
+      f = g;
+  }
+
+  // if not, make one
+  if (f == NULL) {
+    f = calloc(1, sizeof(*f));
+    if (f == NULL) {
+      answer(l, NULL, "out of memory");
+      return;
+    }
+    memcpy(f->prefix, l->hash, RANGE_PREFIX_LEN);
+    if (queue_tail == NULL) {
+      queue_head = f;
+    } else {
+      queue_tail->next = f;
+    }
+    queue_tail = f;
+  }
+
+  // a look up can only be matched against a response from its start
+  if (f->scanning) {
+    l->next = f->late;
+    f->late = l;
+  } else {
+    l->next = f->waiters;
+    f->waiters = l;
+  }
+}
+
+/// are any requests waiting or in flight?
+static bool busy(void) {
+  if (queue_head != NULL)
+    return true;
+  for (size_t i = 0; i < CONCURRENCY; ++i) {
+    if (connections[i].fetch != NULL)
+      return true;
+  }
+  return false;
+}
+
+static void *io_thread(void *arg __attribute__((unused))) {
+
+  for (;;) {
+
+    // pick up new look ups
+    (void)pthread_mutex_lock(&submit_lock);
+    lookup_t *newest = submitted;
+    submitted = NULL;
+    const bool stop = closing;
+    (void)pthread_mutex_unlock(&submit_lock);
+
+    // take them in the order they were submitted
+    lookup_t *oldest = NULL;
+    while (newest != NULL) {
+      lookup_t *l = newest;
+      newest = l->next;
+      l->next = oldest;
+      oldest = l;
+    }
+    while (oldest != NULL) {
+      lookup_t *l = oldest;
+      oldest = l->next;
+      route(l);
+    }
+
+    dispatch();
+
+    if (stop && !busy())
+      break;
+
+    // wait for something to happen
+    struct pollfd fds[CONCURRENCY + 1];
+    connection_t *owners[CONCURRENCY + 1];
+    size_t n = 0;
+    fds[n++] = (struct pollfd){.fd = wake[0], .events = POLLIN};
+    for (size_t i = 0; i < CONCURRENCY; ++i) {
+      if (!connections[i].in_use)
+        continue;
+      owners[n] = &connections[i];
+      fds[n++] = (struct pollfd){.fd = connections[i].fd,
+                                 .events = connections[i].events};
+    }
+    if (poll(fds, (nfds_t)n, -1) < 0)
+      continue;
+
+    if (fds[0].revents != 0) {
+      char drain[64];
+      while (read(wake[0], drain, sizeof(drain)) > 0)
+        ;
+    }
+
+    for (size_t i = 1; i < n; ++i) {
+      if (fds[i].revents != 0)
+        advance(owners[i]);
+    }
+  }
+
+  for (size_t i = 0; i < CONCURRENCY; ++i) {
+    if (connections[i].in_use)
+      close_connection(&connections[i]);
+  }
+
+  return NULL;
+}
+
+/// interrupt the background thread’s wait
+static void notify(void) {
+  // if the pipe is full, a wake up is already pending
+  const ssize_t r = write(wake[1], "", 1);
+  (void)r;
+}
+
+int hibp_init(const char *server) {
+
+  assert(server != NULL);
+
+  // writing to a connection the server has closed should fail, not kill us
+  (void)signal(SIGPIPE, SIG_IGN);
+
+  // initialize OpenSSL
+  SSL_load_error_strings();
+  SSL_library_init();
+
+  for (size_t i = 0; i < CONCURRENCY; ++i)
+    connections[i].fd = -1;
+  closing = false;
+
+  if (parse_server(server) != 0) {
+    eprint("invalid server %s\n", server);
+    goto fail;
+  }
+
+  ctx = SSL_CTX_new(SSLv23_client_method());
+  if (ctx == NULL) {
+    eprint("creation of SSL context failed\n");
+    goto fail;
+  }
+
+  // a write that would block is retried later, maybe only in part
+  (void)SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                                  SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+  // keep sessions ourselves, to resume them on later connections
+  (void)SSL_CTX_set_session_cache_mode(
+      ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, new_session);
+
+  if (pipe(wake) != 0) {
+    eprint("failed to create pipe: %s\n", strerror(errno));
+    wake[0] = wake[1] = -1;
+    goto fail;
+  }
+  if (set_flags(wake[0]) != 0 || set_flags(wake[1]) != 0) {
+    eprint("failed to configure pipe: %s\n", strerror(errno));
+    goto fail;
+  }
+
+  const int r = pthread_create(&thread, NULL, io_thread, NULL);
+  if (r != 0) {
+    eprint("failed to create thread: %s\n", strerror(r));
+    goto fail;
+  }
+  started = true;
+
+  return 0;
+
+fail:
+  hibp_close();
+  return -1;
+}
+
+int hibp_lookup(const char *hash, hibp_done_t done, void *state) {
+
+  assert(hash != NULL);
+  assert(strlen(hash) == RANGE_HASH_LEN && "not a SHA-1 hash in hex");
+  assert(isxdigit(hash[0]) && isxdigit(hash[1]) && isxdigit(hash[2]) &&
+         isxdigit(hash[3]) && isxdigit(hash[4]) && "non hex prefix");
+  assert(done != NULL);
+
+  if (!started)
+    return -1;
+
+  lookup_t *l = passwand_secure_malloc(sizeof(*l));
+  if (l == NULL)
+    return -1;
+  *l = (lookup_t){0};
+  memcpy(l->hash, hash, RANGE_HASH_LEN);
+  l->target.hash = l->hash;
+  l->done = done;
+  l->state = state;
+
+  (void)pthread_mutex_lock(&submit_lock);
+  l->next = submitted;
+  submitted = l;
+  (void)pthread_mutex_unlock(&submit_lock);
+
+  notify();
+
+  return 0;
+}
+
+void hibp_close(void) {
+
+  if (started) {
+    (void)pthread_mutex_lock(&submit_lock);
+    closing = true;
+    (void)pthread_mutex_unlock(&submit_lock);
+    notify();
+
+    (void)pthread_join(thread, NULL);
+    started = false;
+  }
+
+  for (size_t i = 0; i < sizeof(wake) / sizeof(wake[0]); ++i) {
+    if (wake[i] >= 0)
+      (void)close(wake[i]);
+    wake[i] = -1;
+  }
+
+  if (session != NULL)
+    SSL_SESSION_free(session);
+  session = NULL;
+
+  if (ctx != NULL)
+    SSL_CTX_free(ctx);
+  ctx = NULL;
+
+  if (dns_info != NULL)
+    freeaddrinfo(dns_info);
+  dns_info = NULL;
+  dns_looked_up = false;
+
+  free(host);
+  host = NULL;
+  free(port);
+  port = NULL;
+  free(host_header);
+  host_header = NULL;
+}
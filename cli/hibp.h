@@ -0,0 +1,53 @@
+#pragma once
+
+#include "range.h"
+
+// A client for Have I Been Pwned’s range API. Queries are made by a single
+// background thread, so that threads decrypting passwords never wait on the
+// network. The thread drives several connections at once without blocking,
+// bounding how many requests are in flight, and hands each result on as its
+// response completes.
+//
+// Setting up a TLS connection costs several round trips, so connections are
+// kept alive and reused across queries. When a connection has to be made
+// afresh, e.g. because the server closed one that was idle, the TLS session of
+// an earlier connection is resumed to shorten the handshake. Responses are
+// matched against the hashes waiting on them as they arrive, and recorded so
+// that later look ups with the same prefix need not fetch them again. Hashes
+// are only held in secure memory, and are erased once answered.
+
+// server to query if --hibp-server is not given
+#define HIBP_DEFAULT_SERVER "api.pwnedpasswords.com"
+
+/** Prepare to query a server, starting the background thread
+ *
+ * @param server “host” or “host:port” of the server, port defaulting to 443
+ * @return 0 on success
+ */
+int hibp_init(const char *server);
+
+/** Callback for a completed look up, called on the background thread
+ *
+ * @param state State passed to hibp_lookup
+ * @param hash SHA-1 hash that was looked up, in hex
+ * @param result What the server said about the hash, or NULL on failure
+ * @param error Reason for failure, if this failed
+ */
+typedef void (*hibp_done_t)(void *state, const char *hash,
+                            const range_result_t *result, const char *error);
+
+/** Queue a look up of a hash
+ *
+ * This may be called concurrently from multiple threads. It does not wait for
+ * the look up to complete.
+ *
+ * @param hash SHA-1 hash to look up, in hex
+ * @param done Function to call when the look up completes
+ * @param state State to pass to `done`
+ * @return 0 if the look up was queued, in which case `done` will be called
+ */
+int hibp_lookup(const char *hash, hibp_done_t done, void *state);
+
+/// complete all queued look ups, then close all connections and release
+/// resources
+void hibp_close(void);
@@ -1,6 +1,10 @@
+#include "../common/access.h"
 #include "../common/argparse.h"
+#include "../common/jobs-cache.h"
 #include "../common/privilege.h"
 #include "../common/streq.h"
+#include "batch.h"
+#include "breach.h"
 #include "change-main.h"
 #include "check.h"
 #include "cli.h"
@@ -11,12 +15,12 @@
 #include "list.h"
 #include "print.h"
 #include "set.h"
+#include "stats.h"
 #include "update.h"
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <passwand/passwand.h>
-#include <pthread.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -30,6 +34,7 @@ static const struct {
   const char *name;
   const command_t *action;
 } COMMANDS[] = {
+    {"batch", &batch},
     {"change-main", &change_main},
     {"check", &check},
     {"delete", &delete},
@@ -48,7 +53,7 @@ static const command_t *command_for(const char *name) {
   return NULL;
 }
 
-main_t *getpassword(const char *prompt) {
+static main_t *read_password(const char *prompt) {
 
   static const size_t EXPECTED_PAGE_SIZE = 4096;
 
@@ -165,6 +170,13 @@ main_t *getpassword(const char *prompt) {
   return mainpass;
 }
 
+main_t *getpassword(const char *prompt) {
+  const passwand_time_t start = phase_start();
+  main_t *m = read_password(prompt);
+  phase_end(PHASE_PROMPT, start);
+  return m;
+}
+
 void discard_main(main_t **m) {
   assert(m != NULL);
   if (*m == NULL)
@@ -174,6 +186,19 @@ void discard_main(main_t **m) {
   *m = NULL;
 }
 
+char *secure_strdup(const char *s) {
+  assert(s != NULL);
+  char *copy = passwand_secure_malloc(strlen(s) + 1);
+  if (copy != NULL)
+    strcpy(copy, s);
+  return copy;
+}
+
+void secure_strfree(char *s) {
+  if (s != NULL)
+    passwand_secure_free(s, strlen(s) + 1);
+}
+
 static void discard_entries(passwand_entry_t **entries, size_t *entry_len) {
   for (size_t i = 0; i < *entry_len; i++) {
     free((*entries)[i].space);
@@ -190,57 +215,67 @@ static void discard_entries(passwand_entry_t **entries, size_t *entry_len) {
   *entry_len = 0;
 }
 
-// juggle the calling convention to a function for processing an entry that does
-// not need the state parameter
-static void entry_trampoline(void *state, const char *space, const char *key,
-                             const char *value) {
-  const command_t *const cmd = state;
-  cmd->loop_body(space, key, value);
-}
-
 typedef struct {
-  atomic_size_t *index;
-  passwand_entry_t *entries;
-  size_t entry_len;
-  const char *main;
-
+  passwand_pool_t *pool;
   const command_t *command;
+  size_t offset;      ///< index of the first entry scanned
+  atomic_bool failed; ///< did any entry fail?
+} scan_t;
+
+/// run the command on one decrypted entry, as an action for
+/// `passwand_entries_do`
+static void scan_entry(void *state, size_t index, const char *space,
+                       const char *key, const char *value) {
+  assert(state != NULL);
+
+  scan_t *scan = state;
+  index += scan->offset;
+  const command_t *command = scan->command;
+  assert(command != NULL);
+
+  if (command->loop_notify != NULL)
+    command->loop_notify(index);
+
+  if (command->loop_condition != NULL && !command->loop_condition()) {
+    passwand_pool_cancel(scan->pool);
+    return;
+  }
 
-  bool created;
+  if (command->loop_body != NULL)
+    command->loop_body(space, key, value);
 
-} thread_state_t;
+  // if this entry satisfied the command, do not start any more
+  if (command->loop_condition != NULL && !command->loop_condition())
+    passwand_pool_cancel(scan->pool);
+}
 
-static void *thread_loop(void *arg) {
-  assert(arg != NULL);
+/// decide whether to start another key derivation, as a check for
+/// `passwand_entries_do`
+static bool scan_proceed(void *state) {
+  assert(state != NULL);
 
-  thread_state_t *ts = arg;
-  assert(ts->command != NULL);
-  void *ret = NULL;
-  const command_t *command = ts->command;
+  const scan_t *scan = state;
+  const command_t *command = scan->command;
+  assert(command != NULL);
 
-  for (;;) {
+  return command->loop_condition == NULL || command->loop_condition();
+}
 
-    size_t index = atomic_fetch_add(ts->index, 1);
-    if (index >= ts->entry_len)
-      break;
+/// report an entry that could not be decrypted, as an error handler for
+/// `passwand_entries_do`
+static passwand_error_t scan_error(void *state, size_t index,
+                                   passwand_error_t err) {
+  assert(state != NULL);
 
-    if (command->loop_notify != NULL)
-      command->loop_notify(index);
+  scan_t *scan = state;
 
-    if (command->loop_condition != NULL && !command->loop_condition())
-      break;
+  // Report this, but keep going. Other entries may still be usable, e.g. in a
+  // database with entries encrypted under differing passwords.
+  eprint("failed to handle entry %zu: %s\n", index + scan->offset,
+         passwand_error(err));
+  scan->failed = true;
 
-    if (command->loop_body != NULL) {
-      passwand_error_t err =
-          passwand_entry_do(ts->main, &ts->entries[index], entry_trampoline,
-                            (command_t *)command);
-      if (err != PW_OK) {
-        eprint("failed to handle entry %zu: %s\n", index, passwand_error(err));
-        ret = (void *)-1;
-      }
-    }
-  }
-  return ret;
+  return PW_OK;
 }
 
 /** Take a password entry from a chained database and consider it now the new
@@ -274,8 +309,61 @@ static void process_chain_link(void *state,
   }
 }
 
+/// summarise where time went in decrypting entries to stderr
+static void print_pipeline_stats(const passwand_pipeline_stats_t *s) {
+  assert(s != NULL);
+
+  // total thread time available, for computing utilisation
+  const double available = (double)s->wall_ns * (double)s->threads;
+#define SECONDS(ns) ((double)(ns) / 1e9)
+#define SHARE(ns) (available == 0 ? 0.0 : 100.0 * (double)(ns) / available)
+
+  eprint("pipeline statistics:\n"
+         "  threads: %zu\n"
+         "  entries decrypted: %zu\n"
+         "  elapsed: %.3fs\n"
+         "  throughput: %.2f entries/s\n"
+         "  MAC stage: %.3fs (%.1f%% utilisation)\n"
+         "  key stage: %.3fs (%.1f%% utilisation)\n"
+         "  decrypt stage: %.3fs (%.1f%% utilisation)\n"
+         "  stalled: %.3fs (%.1f%%)\n",
+         s->threads, s->entries, SECONDS(s->wall_ns),
+         s->wall_ns == 0 ? 0.0 : (double)s->entries / SECONDS(s->wall_ns),
+         SECONDS(s->mac_ns), SHARE(s->mac_ns), SECONDS(s->key_ns),
+         SHARE(s->key_ns), SECONDS(s->decrypt_ns), SHARE(s->decrypt_ns),
+         SECONDS(s->stall_ns), SHARE(s->stall_ns));
+  if (s->tuned != 0)
+    eprint("  threads chosen: %zu\n", s->tuned);
+
+#undef SHARE
+#undef SECONDS
+}
+
+/// summarise the secure heap’s behaviour to stderr
+static void print_heap_stats(void) {
+  const passwand_secure_heap_stats_t s = passwand_secure_heap_stats();
+  eprint("secure heap statistics:\n"
+         "  bytes in use: %zu\n"
+         "  high watermark: %zu bytes\n"
+         "  chunks: %zu\n"
+         "  mlocked: %zu bytes\n"
+         "  allocations: %zu\n"
+         "  frees: %zu\n"
+         "  failed allocations: %zu\n"
+         "  average scan length: %.1f\n"
+         "  maximum scan length: %zu\n"
+         "  lock contentions: %zu\n"
+         "  lock spins: %zu\n",
+         s.in_use, s.high_water, s.chunks, s.locked, s.allocations, s.frees,
+         s.failed_allocations,
+         s.allocations == 0 ? 0.0 : (double)s.scan_total / s.allocations,
+         s.scan_max, s.lock_contentions, s.lock_spins);
+}
+
 int main(int argc, char **argv) {
 
+  const passwand_time_t run_start = phase_start();
+
   // we need to make a network call if we are checking a password
   bool need_network = argc >= 2 && streq(argv[1], "check");
 
@@ -291,11 +379,13 @@ int main(int argc, char **argv) {
   passwand_entry_t *entries = NULL;
   size_t entry_len = 0;
   const command_t *command = NULL;
+  bool command_prepared = false;
   bool command_initialized = false;
-  thread_state_t *tses = NULL;
-  pthread_t *threads = NULL;
+  size_t *order = NULL;
+  passwand_pool_t *pool = NULL;
+  passwand_pipeline_stats_t stats = {0};
+  bool scanned = false;
   int ret = EXIT_FAILURE;
-  unsigned errors = 0;
 
   // figure out which command to run
   command = command_for(argv[1]);
@@ -307,10 +397,18 @@ int main(int argc, char **argv) {
   if (parse(argc - 1, argv + 1) != 0)
     goto done;
 
-  // validate flags
-#define HANDLE(field)                                                          \
+  if (!command->many_targets && options.keys_from != NULL) {
+    eprint("irrelevant argument --keys-from\n");
+    goto done;
+  }
+
+  // validate flags, where --keys-from can stand in for --space and --key on
+  // commands that operate on many entries
+  const bool keys_from = command->many_targets && options.keys_from != NULL;
+#define HANDLE(field, stand_in)                                                \
   do {                                                                         \
-    if (command->need_##field == REQUIRED && options.field == NULL) {          \
+    if (command->need_##field == REQUIRED && options.field == NULL &&          \
+        !(stand_in)) {                                                         \
       eprint("missing required argument --" #field "\n");                      \
       goto done;                                                               \
     } else if (command->need_##field == DISALLOWED && options.field != NULL) { \
@@ -318,10 +416,93 @@ int main(int argc, char **argv) {
       goto done;                                                               \
     }                                                                          \
   } while (0)
-  HANDLE(space);
-  HANDLE(key);
-  HANDLE(value);
+  HANDLE(space, keys_from);
+  HANDLE(key, keys_from);
+  HANDLE(value, false);
 #undef HANDLE
+  if (command->many_targets) {
+    // a single --space applies to every --key, otherwise they pair up
+    if (options.key_len > 0 && options.space_len == 0) {
+      eprint("missing required argument --space\n");
+      goto done;
+    }
+    if (options.space_len > 1 && options.space_len != options.key_len) {
+      eprint("--space must be given once or as many times as --key\n");
+      goto done;
+    }
+  } else {
+    if (options.space_len > 1) {
+      eprint("--space given more than once\n");
+      goto done;
+    }
+    if (options.key_len > 1) {
+      eprint("--key given more than once\n");
+      goto done;
+    }
+  }
+  if (!command->checks_passwords && options.dictionary != NULL) {
+    eprint("irrelevant argument --dictionary\n");
+    goto done;
+  }
+  if (!command->checks_passwords && options.breach_db != NULL) {
+    eprint("irrelevant argument --breach-db\n");
+    goto done;
+  }
+  if (!command->checks_passwords && options.hibp_cache_ttl != 0) {
+    eprint("irrelevant argument --hibp-cache\n");
+    goto done;
+  }
+  if (!command->checks_passwords && options.hibp_server != NULL) {
+    eprint("irrelevant argument --hibp-server\n");
+    goto done;
+  }
+  if (!command->checks_passwords && options.reuse) {
+    eprint("irrelevant argument --reuse\n");
+    goto done;
+  }
+  if (!command->checks_passwords && options.build_index) {
+    eprint("irrelevant argument --build-index\n");
+    goto done;
+  }
+  if (options.build_index && options.breach_db == NULL) {
+    eprint("missing required argument --breach-db\n");
+    goto done;
+  }
+  if (command->generates_passwords) {
+    // --space-prefix names the spaces of several generated entries instead
+    if (options.space == NULL && options.space_prefix == NULL) {
+      eprint("missing required argument --space\n");
+      goto done;
+    }
+    if (options.space != NULL && options.space_prefix != NULL) {
+      eprint("--space and --space-prefix cannot be given together\n");
+      goto done;
+    }
+    if (options.count > 1 && options.space_prefix == NULL) {
+      eprint("--count greater than 1 requires --space-prefix\n");
+      goto done;
+    }
+  }
+  if (!command->generates_passwords && options.charset != NULL) {
+    eprint("irrelevant argument --charset\n");
+    goto done;
+  }
+  if (!command->generates_passwords && options.count != 0) {
+    eprint("irrelevant argument --count\n");
+    goto done;
+  }
+  if (!command->generates_passwords && options.no_ambiguous) {
+    eprint("irrelevant argument --no-ambiguous\n");
+    goto done;
+  }
+  if (!command->generates_passwords && options.require != 0) {
+    eprint("irrelevant argument --require\n");
+    goto done;
+  }
+  if (!command->generates_passwords && options.space_prefix != NULL) {
+    eprint("irrelevant argument --space-prefix\n");
+    goto done;
+  }
   if (command->need_length == REQUIRED && options.length == 0) {
     eprint("missing required argument --length\n");
     goto done;
@@ -330,6 +511,21 @@ int main(int argc, char **argv) {
     goto done;
   }
 
+  // indexing a breach list needs no database, so is done without unlocking one
+  if (options.build_index) {
+    if (breach_build(options.breach_db) == 0)
+      ret = EXIT_SUCCESS;
+    goto done;
+  }
+
+  int lock_mode = command->access;
+  if (command->prepare != NULL) {
+    lock_mode = command->prepare();
+    if (lock_mode < 0)
+      goto done;
+    command_prepared = true;
+  }
+
   // process any chained databases
   for (size_t i = 0; i < options.chain_len; ++i) {
 
@@ -341,7 +537,10 @@ int main(int argc, char **argv) {
         eprint("failed to open database\n");
         goto done;
       }
-      if (flock(fd, LOCK_SH | LOCK_NB) != 0) {
+      const passwand_time_t start = phase_start();
+      const int r = flock(fd, LOCK_SH | LOCK_NB);
+      phase_end(PHASE_LOCK, start);
+      if (r != 0) {
         eprint("failed to lock database: %s\n", strerror(errno));
         goto done;
       }
@@ -349,8 +548,10 @@ int main(int argc, char **argv) {
 
     // import the database
     {
+      const passwand_time_t start = phase_start();
       passwand_error_t err =
           passwand_import(options.chain[i].path, &entries, &entry_len);
+      phase_end(PHASE_IMPORT, start);
       if (err != PW_OK) {
         eprint("failed to import database: %s\n", passwand_error(err));
         goto done;
@@ -409,7 +610,10 @@ int main(int argc, char **argv) {
   if (access(options.db.path, R_OK) == 0) {
     int fd = open(options.db.path, O_RDONLY);
     if (fd >= 0) {
-      if (flock(fd, command->access | LOCK_NB) != 0) {
+      const passwand_time_t start = phase_start();
+      const int r = flock(fd, lock_mode | LOCK_NB);
+      phase_end(PHASE_LOCK, start);
+      if (r != 0) {
         eprint("failed to lock database: %s\n", strerror(errno));
         goto done;
       }
@@ -417,8 +621,10 @@ int main(int argc, char **argv) {
   }
 
   if (access(options.db.path, F_OK) == 0) {
+    const passwand_time_t start = phase_start();
     passwand_error_t err =
         passwand_import(options.db.path, &entries, &entry_len);
+    phase_end(PHASE_IMPORT, start);
     if (err != PW_OK) {
       eprint("failed to load database: %s\n", passwand_error(err));
       goto done;
@@ -440,6 +646,18 @@ int main(int argc, char **argv) {
     assert(mainpass->main != NULL);
   }
 
+  // If the command can stop early, visit the entries most likely to be sought
+  // first. When every entry is visited in the first round of jobs anyway, this
+  // would not help, so skip the cost of decrypting the access statistics.
+  if (command->ordered && entry_len > options.jobs) {
+    if (access_load(options.db.path, mainpass->main, options.db.work_factor) !=
+        0) {
+      eprint("out of memory\n");
+      goto done;
+    }
+    order = access_order(entries, entry_len);
+  }
+
   // setup command
   assert(command->initialize != NULL);
   int r = command->initialize(mainpass, entries, entry_len);
@@ -447,83 +665,87 @@ int main(int argc, char **argv) {
     goto done;
   command_initialized = true;
 
-  // allocate thread data
-  tses = calloc(options.jobs, sizeof(tses[0]));
-  if (tses == NULL) {
-    eprint("out of memory\n");
-    goto done;
-  }
+  {
+    passwand_error_t err = passwand_pool_create(&pool, options.jobs);
+    if (err != PW_OK) {
+      eprint("failed to create threads: %s\n", passwand_error(err));
+      goto done;
+    }
 
-  // setup thread data
-  atomic_size_t index = 0;
-  for (size_t i = 0; i < options.jobs; i++) {
-    tses[i].index = &index;
-    tses[i].entries = entries;
-    tses[i].entry_len = entry_len;
-    tses[i].main = mainpass->main;
-    tses[i].command = command;
-    tses[i].created = false;
-  }
+    // misplaced threads only cost performance, so this is not fatal
+    err = passwand_pool_set_affinity(pool, options.affinity);
+    if (err != PW_OK)
+      eprint("failed to set thread affinity: %s\n", passwand_error(err));
 
-  // allocate threads
-  assert(options.jobs >= 1);
-  threads = calloc(options.jobs - 1, sizeof(threads[0]));
-  if (options.jobs > 1 && threads == NULL) {
-    eprint("out of memory\n");
-    goto done;
+    passwand_pool_set_adaptive(pool, options.adaptive);
   }
 
-  // start threads
-  for (size_t i = 1; i < options.jobs; i++) {
-    r = pthread_create(&threads[i - 1], NULL, thread_loop, &tses[i]);
-    if (r == 0) {
-      tses[i].created = true;
-    } else {
-      eprint("warning: failed to create thread %zu\n", i);
+  {
+    scan_t scan = {.pool = pool, .command = command};
+    if (command->skip != NULL) {
+      scan.offset = command->skip();
+      assert(scan.offset <= entry_len);
+      assert((scan.offset == 0 || order == NULL) &&
+             "skipping entries of an ordered command");
     }
-  }
-
-  // join the other threads
-  r = (int)(intptr_t)thread_loop(&tses[0]);
-  if (r != 0)
-    errors++;
-
-  // collect the secondary threads
-  for (size_t i = 1; i < options.jobs; i++) {
-    if (tses[i].created) {
-      void *retu;
-      r = pthread_join(threads[i - 1], &retu);
-      if (r != 0) {
-        eprint("failed to join thread %zu\n", i);
-        errors++;
-      } else {
-        if ((int)(intptr_t)retu != 0)
-          errors++;
-      }
+    const passwand_entry_t *remaining =
+        scan.offset == 0 ? entries : &entries[scan.offset];
+    passwand_error_t err = passwand_entries_do(
+        pool, mainpass->main, remaining, entry_len - scan.offset, order,
+        scan_entry, scan_error, scan_proceed, &scan, &stats);
+    scanned = true;
+    if (err == PW_OK) {
+      if (!scan.failed)
+        ret = EXIT_SUCCESS;
+    } else {
+      eprint("failed to handle entries: %s\n", passwand_error(err));
     }
+    if (stats.tuned != 0)
+      jobs_cache_save(options.db.work_factor, stats.tuned);
+    if (options.pipeline_stats)
+      print_pipeline_stats(&stats);
   }
 
-  ret = errors > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
-
 done:
-  free(threads);
-  free(tses);
-  if (command_initialized && command->finalize != NULL) {
+  passwand_pool_destroy(pool);
+  free(order);
+  if ((command_prepared || command_initialized) && command->finalize != NULL) {
     r = command->finalize(ret != EXIT_SUCCESS);
     if (r != 0)
       ret = EXIT_FAILURE;
   }
   discard_main(&mainpass);
   discard_entries(&entries, &entry_len);
+  access_reset();
 
   free(options.db.path);
   free(options.space);
   free(options.key);
   free(options.value);
+  for (size_t i = 0; i < options.space_len; ++i)
+    free(options.spaces[i]);
+  free(options.spaces);
+  for (size_t i = 0; i < options.key_len; ++i)
+    free(options.keys[i]);
+  free(options.keys);
+  free(options.keys_from);
+  free(options.dictionary);
+  free(options.breach_db);
+  free(options.hibp_server);
+  free(options.charset);
+  free(options.space_prefix);
   for (size_t i = 0; i < options.chain_len; ++i)
     free(options.chain[i].path);
   free(options.chain);
 
+  if (options.heap_stats)
+    print_heap_stats();
+
+  if (options.stats != STATS_NONE)
+    stats_print(run_start, scanned ? &stats : NULL,
+                options.stats == STATS_JSON);
+  passwand_pipeline_stats_free(&stats);
+
   // reset the state of the allocator, freeing memory back to the operating
   // system, to pacify tools like Valgrind
   {
@@ -0,0 +1,397 @@
+#include "range-cache.h"
+#include "../common/getenv.h"
+#include "range.h"
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <passwand/passwand.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// number of hash table buckets
+enum { BUCKETS = 256 };
+
+// hex digits of a hash listed in a response
+enum { SUFFIX_LEN = RANGE_HASH_LEN - RANGE_PREFIX_LEN };
+
+// a hash listed in a response, without the prefix it shares with the others
+typedef struct {
+  unsigned char suffix[(SUFFIX_LEN + 1) / 2]; ///< hex digits, two to a byte
+  unsigned long count;
+} listed_t;
+
+// what we know about the response for a prefix
+typedef struct prefix {
+  char prefix[RANGE_PREFIX_LEN + 1];
+  const char *error; ///< if non-NULL, why the response could not be retrieved
+  listed_t *listed;  ///< hashes in the response, sorted
+  size_t listed_len;
+  size_t candidates; ///< lines in the response
+  struct prefix *next;
+} prefix_t;
+
+// responses seen this run, bucketed by prefix
+static prefix_t *buckets[BUCKETS];
+
+// on-disk cache, if enabled
+static unsigned long ttl;
+static char *directory;
+
+// a response being parsed
+typedef struct {
+  prefix_t *prefix;
+  size_t listed_cap;
+  bool ok; ///< has every hash been recorded successfully?
+  range_scan_t scan;
+} parse_t;
+
+struct range_record {
+  parse_t parse;
+
+  // saving to disk, if enabled
+  FILE *f;
+  char *path;
+  char *tmp;
+  bool saved; ///< has everything been written successfully?
+};
+
+void range_cache_init(unsigned long seconds) {
+
+  ttl = seconds;
+  directory = NULL;
+  if (ttl == 0)
+    return;
+
+  // the base directory must be absolute, according to the XDG specification
+  const char *xdg = getenv_("XDG_CACHE_HOME");
+  const char *home = getenv_("HOME");
+  int r = -1;
+  if (xdg != NULL && xdg[0] == '/') {
+    r = asprintf(&directory, "%s/passwand/hibp", xdg);
+  } else if (home != NULL) {
+    r = asprintf(&directory, "%s/.cache/passwand/hibp", home);
+  }
+  if (r < 0)
+    directory = NULL; // run without the on-disk cache
+}
+
+static size_t bucket_of(const char *hash) {
+  size_t h = 0;
+  for (size_t i = 0; i < RANGE_PREFIX_LEN; ++i)
+    h = h * 31 + (unsigned char)hash[i];
+  return h % BUCKETS;
+}
+
+static void insert(prefix_t *p) {
+  const size_t b = bucket_of(p->prefix);
+  p->next = buckets[b];
+  buckets[b] = p;
+}
+
+static void free_prefix(prefix_t *p) {
+  if (p == NULL)
+    return;
+  free(p->listed);
+  free(p);
+}
+
+/// pack hex digits two to a byte
+///
+/// @return 0 if every digit was valid
+static int pack(const char *hex, unsigned char suffix[(SUFFIX_LEN + 1) / 2]) {
+  memset(suffix, 0, (SUFFIX_LEN + 1) / 2);
+  for (size_t i = 0; i < SUFFIX_LEN; ++i) {
+    const int c = toupper((unsigned char)hex[i]);
+    unsigned nibble;
+    if (c >= '0' && c <= '9') {
+      nibble = (unsigned)(c - '0');
+    } else if (c >= 'A' && c <= 'F') {
+      nibble = (unsigned)(c - 'A' + 10);
+    } else {
+      return -1;
+    }
+    suffix[i / 2] |= (unsigned char)(i % 2 == 0 ? nibble << 4 : nibble);
+  }
+  return 0;
+}
+
+static int compare(const void *a, const void *b) {
+  const listed_t *x = a;
+  const listed_t *y = b;
+  return memcmp(x->suffix, y->suffix, sizeof(x->suffix));
+}
+
+/// record a hash listed in a response, as a callback for range_scan
+static void listed(void *state, const char *suffix, unsigned long count) {
+
+  parse_t *p = state;
+  if (!p->ok)
+    return;
+
+  listed_t l = {.count = count};
+  if (pack(suffix, l.suffix) != 0)
+    return;
+
+  prefix_t *const r = p->prefix;
+  if (r->listed_len == p->listed_cap) {
+    // a response typically lists around 1000 hashes
+    const size_t cap = p->listed_cap == 0 ? 1024 : p->listed_cap * 2;
+    listed_t *ls = realloc(r->listed, cap * sizeof(ls[0]));
+    if (ls == NULL) {
+      p->ok = false;
+      return;
+    }
+    r->listed = ls;
+    p->listed_cap = cap;
+  }
+  r->listed[r->listed_len++] = l;
+}
+
+/// start parsing a response
+///
+/// @return 0 on success
+static int parse_start(parse_t *p, const char *prefix) {
+  *p = (parse_t){0};
+  p->prefix = calloc(1, sizeof(*p->prefix));
+  if (p->prefix == NULL)
+    return -1;
+  memcpy(p->prefix->prefix, prefix, RANGE_PREFIX_LEN);
+  p->ok = true;
+  range_scan_start(&p->scan, NULL);
+  p->scan.listed = listed;
+  p->scan.listed_state = p;
+  return 0;
+}
+
+/// finish parsing a response, keeping it if it was complete
+///
+/// @return The parsed response, or NULL if it was not kept
+static prefix_t *parse_end(parse_t *p, bool complete) {
+  // the last line may still be waiting to be recorded
+  if (complete)
+    range_scan_finish(&p->scan);
+
+  prefix_t *const r = p->prefix;
+  p->prefix = NULL;
+  if (!complete || !p->ok) {
+    free_prefix(r);
+    return NULL;
+  }
+  r->candidates = p->scan.candidates;
+  if (r->listed_len > 0)
+    qsort(r->listed, r->listed_len, sizeof(r->listed[0]), compare);
+  insert(r);
+  return r;
+}
+
+/// parse a response on disk, if it has not expired
+///
+/// @return The parsed response, or NULL if there was none
+static const prefix_t *load(const char *hash) {
+
+  char *path = NULL;
+  if (asprintf(&path, "%s/%.5s", directory, hash) < 0)
+    return NULL;
+
+  const prefix_t *r = NULL;
+  parse_t p = {0};
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+    goto done;
+
+  struct stat st;
+  if (fstat(fileno(f), &st) != 0)
+    goto done;
+  const time_t now = time(NULL);
+  if (st.st_mtime > now || (unsigned long)(now - st.st_mtime) >= ttl)
+    goto done;
+
+  if (parse_start(&p, hash) != 0)
+    goto done;
+  char buffer[BUFSIZ];
+  for (;;) {
+    const size_t n = fread(buffer, 1, sizeof(buffer), f);
+    range_scan(&p.scan, buffer, n);
+    if (n < sizeof(buffer))
+      break;
+  }
+  r = parse_end(&p, !ferror(f));
+
+done:
+  if (f != NULL)
+    (void)fclose(f);
+  free(path);
+
+  return r;
+}
+
+/// create a directory and its parents, if they do not exist
+static int mkdirs(char *path) {
+  for (char *p = path + 1; *p != '\0'; ++p) {
+    if (*p != '/')
+      continue;
+    *p = '\0';
+    const int r = mkdir(path, 0700);
+    *p = '/';
+    if (r != 0 && errno != EEXIST)
+      return -1;
+  }
+  if (mkdir(path, 0700) != 0 && errno != EEXIST)
+    return -1;
+  return 0;
+}
+
+bool range_cache_find(const char *hash, range_result_t *result,
+                      const char **error) {
+
+  assert(hash != NULL);
+  assert(strlen(hash) == RANGE_HASH_LEN);
+  assert(result != NULL);
+  assert(error != NULL);
+
+  // have we seen, or failed to retrieve, the response for this prefix this
+  // run?
+  const prefix_t *p = buckets[bucket_of(hash)];
+  while (p != NULL && strncmp(p->prefix, hash, RANGE_PREFIX_LEN) != 0)
+    p = p->next;
+
+  // if not, try an earlier run’s response
+  if (p == NULL && directory != NULL)
+    p = load(hash);
+
+  if (p == NULL)
+    return false;
+
+  if (p->error != NULL) {
+    *error = p->error;
+    return true;
+  }
+
+  *result = (range_result_t){.candidates = p->candidates};
+  listed_t key;
+  if (p->listed_len > 0 && pack(&hash[RANGE_PREFIX_LEN], key.suffix) == 0) {
+    const listed_t *l =
+        bsearch(&key, p->listed, p->listed_len, sizeof(p->listed[0]), compare);
+    if (l != NULL) {
+      result->found = true;
+      result->count = l->count;
+    }
+  }
+  (void)passwand_erase(&key, sizeof(key));
+  *error = NULL;
+  return true;
+}
+
+void range_cache_fail(const char *prefix, const char *error) {
+  assert(prefix != NULL);
+  assert(strlen(prefix) >= RANGE_PREFIX_LEN);
+  assert(error != NULL);
+
+  // A failure is remembered, so that, e.g., running without network access
+  // does not retry for every entry.
+  prefix_t *p = calloc(1, sizeof(*p));
+  if (p == NULL)
+    return;
+  memcpy(p->prefix, prefix, RANGE_PREFIX_LEN);
+  p->error = error;
+  insert(p);
+}
+
+range_record_t *range_cache_record(const char *prefix) {
+
+  assert(prefix != NULL);
+  assert(strlen(prefix) >= RANGE_PREFIX_LEN);
+
+  range_record_t *r = calloc(1, sizeof(*r));
+  if (r == NULL)
+    return NULL;
+
+  if (parse_start(&r->parse, prefix) != 0) {
+    free(r);
+    return NULL;
+  }
+
+  if (directory == NULL)
+    return r;
+
+  // failing to save to disk still leaves the response recorded in memory
+  if (asprintf(&r->path, "%s/%.5s", directory, prefix) < 0) {
+    r->path = NULL;
+    goto no_disk;
+  }
+  if (asprintf(&r->tmp, "%s.XXXXXX", r->path) < 0) {
+    r->tmp = NULL;
+    goto no_disk;
+  }
+
+  if (mkdirs(directory) != 0)
+    goto no_disk;
+
+  const int fd = mkstemp(r->tmp);
+  if (fd < 0)
+    goto no_disk;
+  r->f = fdopen(fd, "w");
+  if (r->f == NULL) {
+    (void)close(fd);
+    (void)unlink(r->tmp);
+    goto no_disk;
+  }
+
+  r->saved = true;
+  return r;
+
+no_disk:
+  free(r->tmp);
+  r->tmp = NULL;
+  free(r->path);
+  r->path = NULL;
+  return r;
+}
+
+void range_cache_write(range_record_t *record, const char *data, size_t len) {
+  if (record == NULL)
+    return;
+  range_scan(&record->parse.scan, data, len);
+  if (record->f == NULL || !record->saved)
+    return;
+  if (fwrite(data, 1, len, record->f) != len)
+    record->saved = false;
+}
+
+void range_cache_end(range_record_t *record, bool complete) {
+
+  if (record == NULL)
+    return;
+
+  (void)parse_end(&record->parse, complete);
+
+  if (record->f != NULL) {
+    bool ok = record->saved && complete;
+    if (fclose(record->f) != 0)
+      ok = false;
+    if (!ok || rename(record->tmp, record->path) != 0)
+      (void)unlink(record->tmp);
+  }
+
+  free(record->tmp);
+  free(record->path);
+  free(record);
+}
+
+void range_cache_close(void) {
+  for (size_t i = 0; i < BUCKETS; ++i) {
+    while (buckets[i] != NULL) {
+      prefix_t *p = buckets[i];
+      buckets[i] = p->next;
+      free_prefix(p);
+    }
+  }
+  free(directory);
+  directory = NULL;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "range.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// A cache of what Have I Been Pwned’s range API said. Within a run, each
+// response is recorded in memory as it arrives, as the list of hashes it
+// contains, so that other hashes with the same prefix are answered without
+// fetching it again. Optionally, responses are also kept on disk, under
+// $XDG_CACHE_HOME/passwand/hibp, for later runs to use until they expire.
+// Responses are written to disk as they arrive, never being held in memory as
+// text.
+//
+// Responses are public data, listing every breached hash with a given prefix,
+// so caching them does not reveal any password hashes. The hashes being looked
+// up are never stored. The names of the cached responses do reveal which
+// prefixes were looked up, as the query itself does to the server.
+//
+// The cache is not thread-safe. It is only used from the thread making queries.
+
+// a response being recorded
+typedef struct range_record range_record_t;
+
+/** Prepare the cache
+ *
+ * @param ttl Seconds to keep responses on disk for, or 0 to not use the disk
+ */
+void range_cache_init(unsigned long ttl);
+
+/** Look up the result for a hash, in memory or on disk
+ *
+ * @param hash SHA-1 hash to look up, in hex
+ * @param result [out] The result, if one was found
+ * @param error [out] Reason the response for the hash’s prefix could not be
+ *   retrieved, or NULL if a result was found
+ * @return True if a result or failure was found
+ */
+bool range_cache_find(const char *hash, range_result_t *result,
+                      const char **error);
+
+/** Remember that the response for a prefix could not be retrieved
+ *
+ * @param prefix First 5 hex digits of the SHA-1 hash queried
+ * @param error Reason for the failure
+ */
+void range_cache_fail(const char *prefix, const char *error);
+
+/** Start recording the response for a prefix, in memory and, if enabled, on
+ * disk
+ *
+ * @param prefix First 5 hex digits of the SHA-1 hash queried
+ * @return A handle to write the response to, or NULL if it cannot be recorded
+ */
+range_record_t *range_cache_record(const char *prefix);
+
+/** Record the next piece of a response
+ *
+ * Failure is ignored, as it only means retrieving the response again later.
+ *
+ * @param record Handle from range_cache_record, or NULL
+ * @param data Piece of the response
+ * @param len Length of `data` in bytes
+ */
+void range_cache_write(range_record_t *record, const char *data, size_t len);
+
+/** Finish recording a response
+ *
+ * @param record Handle from range_cache_record, or NULL
+ * @param complete Whether the whole response was received, and so should be
+ *   kept
+ */
+void range_cache_end(range_record_t *record, bool complete);
+
+/// discard all responses from memory
+void range_cache_close(void);
@@ -0,0 +1,151 @@
+#include "range.h"
+#include <assert.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// hex digits of a hash listed in a response
+enum { SUFFIX_LEN = RANGE_HASH_LEN - RANGE_PREFIX_LEN };
+
+/// compare hex digits, ignoring case
+///
+/// This compares 8 digits at a time. Setting bit 5 of each byte maps 'A'–'F'
+/// to 'a'–'f' and leaves '0'–'9' unchanged, so the comparison ignores case
+/// without branching on each byte.
+static bool hex_eq(const char *a, const char *b, size_t len) {
+
+  const uint64_t fold = UINT64_C(0x2020202020202020);
+
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+    uint64_t x, y;
+    memcpy(&x, &a[i], sizeof(x));
+    memcpy(&y, &b[i], sizeof(y));
+    if ((x | fold) != (y | fold))
+      return false;
+  }
+
+  for (; i < len; ++i) {
+    if ((a[i] | 0x20) != (b[i] | 0x20))
+      return false;
+  }
+
+  return true;
+}
+
+/// parse the count following a listed hash
+static unsigned long parse_count(const char *s, size_t len) {
+  unsigned long count = 0;
+  for (size_t i = 0; i < len && isdigit((unsigned char)s[i]); ++i) {
+    const unsigned long digit = (unsigned long)(s[i] - '0');
+    if (count > (ULONG_MAX - digit) / 10)
+      return ULONG_MAX;
+    count = count * 10 + digit;
+  }
+  return count;
+}
+
+/// match a complete line, without its line ending
+static void match(range_scan_t *scan, const char *line, size_t len) {
+
+  if (len > 0 && line[len - 1] == '\r')
+    --len;
+  if (len == 0)
+    return;
+
+  ++scan->candidates;
+
+  // once every target is found, the remaining lines only need counting, unless
+  // they are being recorded
+  if (scan->unfound == 0 && scan->listed == NULL)
+    return;
+
+  if (len <= SUFFIX_LEN || line[SUFFIX_LEN] != ':')
+    return;
+
+  if (scan->listed != NULL)
+    scan->listed(scan->listed_state, line,
+                 parse_count(&line[SUFFIX_LEN + 1], len - SUFFIX_LEN - 1));
+
+  for (range_target_t *t = scan->targets; t != NULL; t = t->next) {
+    if (t->result.found)
+      continue;
+    if (!hex_eq(line, &t->hash[RANGE_PREFIX_LEN], SUFFIX_LEN))
+      continue;
+    t->result.found = true;
+    t->result.count = parse_count(&line[SUFFIX_LEN + 1], len - SUFFIX_LEN - 1);
+    --scan->unfound;
+  }
+}
+
+/// match a line that was split across pieces
+static void finish_partial(range_scan_t *scan) {
+  if (scan->overlong) {
+    // too long to be a listed hash, so only counted
+    ++scan->candidates;
+  } else {
+    match(scan, scan->partial, scan->partial_len);
+  }
+  scan->partial_len = 0;
+  scan->overlong = false;
+}
+
+void range_scan_start(range_scan_t *scan, range_target_t *targets) {
+
+  assert(scan != NULL);
+
+  memset(scan, 0, sizeof(*scan));
+  scan->targets = targets;
+  for (range_target_t *t = targets; t != NULL; t = t->next) {
+    assert(t->hash != NULL);
+    assert(strlen(t->hash) == RANGE_HASH_LEN);
+    assert(strncmp(t->hash, targets->hash, RANGE_PREFIX_LEN) == 0 &&
+           "targets do not share a prefix");
+    t->result = (range_result_t){0};
+    ++scan->unfound;
+  }
+}
+
+void range_scan(range_scan_t *scan, const char *data, size_t len) {
+
+  assert(scan != NULL);
+  assert(data != NULL || len == 0);
+
+  while (len > 0) {
+    const char *nl = memchr(data, '\n', len);
+    const size_t n = nl == NULL ? len : (size_t)(nl - data);
+
+    if (scan->partial_len > 0 || scan->overlong || nl == NULL) {
+      // this line started in an earlier piece or ends in a later one
+      if (scan->partial_len + n > sizeof(scan->partial)) {
+        scan->overlong = true;
+      } else {
+        memcpy(&scan->partial[scan->partial_len], data, n);
+        scan->partial_len += n;
+      }
+      if (nl == NULL)
+        return;
+      finish_partial(scan);
+    } else {
+      match(scan, data, n);
+    }
+
+    data += n + 1;
+    len -= n + 1;
+  }
+}
+
+void range_scan_finish(range_scan_t *scan) {
+
+  assert(scan != NULL);
+
+  // the last line may lack a line ending
+  if (scan->partial_len > 0 || scan->overlong)
+    finish_partial(scan);
+
+  for (range_target_t *t = scan->targets; t != NULL; t = t->next)
+    t->result.candidates = scan->candidates;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Matching of password hashes against a response from Have I Been Pwned’s
+// range API. A response lists, one per line, the last 35 hex digits of each
+// breached hash with the requested prefix and how often it was seen, e.g.
+// “0018A45C4D1DEF81644B54AB7F969B88D65:10”. Rather than collecting the whole
+// response and then searching it, the response is matched a piece at a time
+// as it arrives, and only the line straddling two pieces is copied.
+
+// hex digits in a SHA-1 hash
+#define RANGE_HASH_LEN 40
+
+// hex digits of a hash sent to the server
+#define RANGE_PREFIX_LEN 5
+
+// result of looking for a hash in a response
+typedef struct {
+  bool found;          ///< was the hash listed?
+  unsigned long count; ///< times the password was seen in breaches, if found
+  size_t candidates;   ///< number of hashes listed
+} range_result_t;
+
+// a hash being looked for
+typedef struct range_target {
+  const char *hash; ///< SHA-1 hash in hex
+  range_result_t result;
+  struct range_target *next;
+} range_target_t;
+
+// progress through a response
+typedef struct {
+  range_target_t *targets;
+  size_t unfound; ///< number of targets not yet found
+  size_t candidates;
+
+  // Optional callback for each hash listed, passed its last 35 hex digits and
+  // count, e.g. to record the response. Set after range_scan_start.
+  void (*listed)(void *state, const char *suffix, unsigned long count);
+  void *listed_state;
+
+  // a line split across pieces of the response
+  char partial[64];
+  size_t partial_len;
+  bool overlong; ///< did the split line not fit in `partial`?
+} range_scan_t;
+
+/** Start matching a response
+ *
+ * @param scan State to initialize
+ * @param targets Hashes to look for, all sharing a prefix
+ */
+void range_scan_start(range_scan_t *scan, range_target_t *targets);
+
+/** Match the next piece of a response
+ *
+ * @param scan State of the match
+ * @param data Piece of the response
+ * @param len Length of `data` in bytes
+ */
+void range_scan(range_scan_t *scan, const char *data, size_t len);
+
+/** Finish matching a response, filling in each target’s result
+ *
+ * @param scan State of the match
+ */
+void range_scan_finish(range_scan_t *scan);
@@ -0,0 +1,236 @@
+#include "reuse.h"
+#include "cli.h"
+#include "print.h"
+#include <assert.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+#include <passwand/passwand.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// bytes of key for the keyed hash
+enum { KEY_LEN = 32 };
+
+// Secure allocations cannot exceed a page, so the table is split into blocks
+// of this many slots.
+enum { BLOCK_SLOTS = 64 };
+
+// progress of filling in a slot
+enum {
+  EMPTY,   ///< unused
+  CLAIMED, ///< being filled in by a thread
+  READY,   ///< filled in
+};
+
+// an entry using a password
+typedef struct member {
+  char *space;
+  char *key;
+  struct member *next;
+} member_t;
+
+typedef struct {
+  atomic_int state;
+  unsigned char digest[SHA256_DIGEST_LENGTH]; ///< valid once READY
+  _Atomic(member_t *) members;                ///< entries with this password
+} slot_t;
+
+static unsigned char *hmac_key;
+
+static slot_t **blocks;
+static size_t block_len;
+static size_t mask; ///< number of slots, less one
+
+int reuse_init(size_t entries) {
+
+  assert(hmac_key == NULL && "repeated reuse_init");
+
+  // keep the table at most half full, so probe sequences stay short
+  if (entries > SIZE_MAX / 4)
+    return -1;
+  size_t slots = BLOCK_SLOTS;
+  while (slots < entries * 2)
+    slots *= 2;
+
+  hmac_key = passwand_secure_malloc(KEY_LEN);
+  if (hmac_key == NULL)
+    goto fail;
+  if (passwand_random_bytes(hmac_key, KEY_LEN) != PW_OK)
+    goto fail;
+
+  blocks = calloc(slots / BLOCK_SLOTS, sizeof(blocks[0]));
+  if (blocks == NULL)
+    goto fail;
+  for (block_len = 0; block_len < slots / BLOCK_SLOTS; ++block_len) {
+    slot_t *b = passwand_secure_malloc(sizeof(*b) * BLOCK_SLOTS);
+    if (b == NULL)
+      goto fail;
+    for (size_t i = 0; i < BLOCK_SLOTS; ++i) {
+      atomic_init(&b[i].state, EMPTY);
+      memset(b[i].digest, 0, sizeof(b[i].digest));
+      atomic_init(&b[i].members, NULL);
+    }
+    blocks[block_len] = b;
+  }
+  mask = slots - 1;
+
+  return 0;
+
+fail:
+  reuse_close();
+  return -1;
+}
+
+static void free_member(member_t *m) {
+  if (m == NULL)
+    return;
+  secure_strfree(m->key);
+  secure_strfree(m->space);
+  passwand_secure_free(m, sizeof(*m));
+}
+
+int reuse_add(const char *space, const char *key, const char *value) {
+
+  assert(space != NULL);
+  assert(key != NULL);
+  assert(value != NULL);
+  assert(hmac_key != NULL && "reuse_add before reuse_init");
+
+  int rc = -1;
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+
+  member_t *m = passwand_secure_malloc(sizeof(*m));
+  if (m == NULL)
+    goto done;
+  m->space = secure_strdup(space);
+  m->key = secure_strdup(key);
+  m->next = NULL;
+  if (m->space == NULL || m->key == NULL)
+    goto done;
+
+  unsigned digest_len = sizeof(digest);
+  if (HMAC(EVP_sha256(), hmac_key, KEY_LEN, (const unsigned char *)value,
+           strlen(value), digest, &digest_len) == NULL)
+    goto done;
+
+  // probe from the slot the hash selects
+  uint64_t h;
+  memcpy(&h, digest, sizeof(h));
+  for (size_t i = (size_t)h & mask;; i = (i + 1) & mask) {
+    slot_t *s = &blocks[i / BLOCK_SLOTS][i % BLOCK_SLOTS];
+
+    // try to take an unused slot for this password
+    int state = EMPTY;
+    if (atomic_compare_exchange_strong(&s->state, &state, CLAIMED)) {
+      memcpy(s->digest, digest, sizeof(digest));
+      atomic_store_explicit(&s->members, m, memory_order_relaxed);
+      atomic_store_explicit(&s->state, READY, memory_order_release);
+      break;
+    }
+
+    // otherwise, wait for its hash to be available and compare
+    while (state == CLAIMED) {
+      sched_yield();
+      state = atomic_load_explicit(&s->state, memory_order_acquire);
+    }
+    if (memcmp(s->digest, digest, sizeof(digest)) != 0)
+      continue;
+
+    // the password has been seen before, so join its group
+    m->next = atomic_load_explicit(&s->members, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak(&s->members, &m->next, m))
+      ;
+    break;
+  }
+
+  m = NULL;
+  rc = 0;
+
+done:
+  (void)passwand_erase(digest, sizeof(digest));
+  free_member(m);
+
+  return rc;
+}
+
+/// order entries by space, then key
+static int by_name(const void *a, const void *b) {
+  const member_t *const *x = a;
+  const member_t *const *y = b;
+  const int r = strcmp((*x)->space, (*y)->space);
+  if (r != 0)
+    return r;
+  return strcmp((*x)->key, (*y)->key);
+}
+
+size_t reuse_report(void) {
+
+  size_t groups = 0;
+
+  for (size_t i = 0; i < block_len * BLOCK_SLOTS; ++i) {
+    const slot_t *s = &blocks[i / BLOCK_SLOTS][i % BLOCK_SLOTS];
+    if (atomic_load(&s->state) != READY)
+      continue;
+
+    // a password used by only one entry is fine
+    member_t *head = atomic_load(&s->members);
+    if (head->next == NULL)
+      continue;
+
+    size_t n = 0;
+    for (const member_t *m = head; m != NULL; m = m->next)
+      ++n;
+
+    // list the group in a stable order, if we have the memory to sort it
+    member_t **sorted = calloc(n, sizeof(sorted[0]));
+    if (sorted != NULL) {
+      size_t j = 0;
+      for (member_t *m = head; m != NULL; m = m->next)
+        sorted[j++] = m;
+      qsort(sorted, n, sizeof(sorted[0]), by_name);
+    }
+
+    const member_t *m = head;
+    for (size_t j = 0; j < n; ++j) {
+      if (sorted != NULL)
+        m = sorted[j];
+      print("%s%s/%s", j == 0 ? "" : ", ", m->space, m->key);
+      m = m->next;
+    }
+    print(": weak password (shared by %zu entries)\n", n);
+
+    free(sorted);
+    ++groups;
+  }
+
+  return groups;
+}
+
+void reuse_close(void) {
+
+  for (size_t i = 0; i < block_len; ++i) {
+    for (size_t j = 0; j < BLOCK_SLOTS; ++j) {
+      member_t *m = atomic_load(&blocks[i][j].members);
+      while (m != NULL) {
+        member_t *next = m->next;
+        free_member(m);
+        m = next;
+      }
+    }
+    passwand_secure_free(blocks[i], sizeof(blocks[i][0]) * BLOCK_SLOTS);
+  }
+  free(blocks);
+  blocks = NULL;
+  block_len = 0;
+  mask = 0;
+
+  if (hmac_key != NULL)
+    passwand_secure_free(hmac_key, KEY_LEN);
+  hmac_key = NULL;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+
+// Detection of passwords shared by more than one entry, as entries are
+// decrypted. Each password is reduced to a keyed hash, HMAC-SHA256 under a key
+// generated afresh for the run, so the table never holds anything that could
+// be checked against guesses once the run is over. The hashes are gathered in
+// an open-addressed hash table in secure memory, which threads decrypting
+// entries insert into concurrently without locking. Finding every group of
+// entries sharing a password is then a single pass over the table.
+
+/** Prepare to gather passwords
+ *
+ * @param entries Maximum number of entries that will be added
+ * @return 0 on success
+ */
+int reuse_init(size_t entries);
+
+/** Add an entry’s password
+ *
+ * This may be called concurrently from multiple threads.
+ *
+ * @param space Space of the entry
+ * @param key Key of the entry
+ * @param value Password of the entry
+ * @return 0 on success
+ */
+int reuse_add(const char *space, const char *key, const char *value);
+
+/** Print each group of entries that share a password
+ *
+ * @return The number of groups printed
+ */
+size_t reuse_report(void);
+
+/// erase and release the gathered passwords
+void reuse_close(void);
@@ -3,6 +3,7 @@
 #include "../common/streq.h"
 #include "cli.h"
 #include "print.h"
+#include "stats.h"
 #include <assert.h>
 #include <limits.h>
 #include <passwand/passwand.h>
@@ -96,7 +97,7 @@ int set_finalize(bool failure_pending) {
     new_entries[index + 1] = saved_entries[index];
   }
 
-  err = passwand_export(options.db.path, new_entries, new_entry_len);
+  err = export_entries(options.db.path, new_entries, new_entry_len);
   free(new_entries);
   free(e.space);
   free(e.key);
@@ -0,0 +1,149 @@
+#include "stats.h"
+#include "print.h"
+#include <assert.h>
+#include <inttypes.h>
+#include <passwand/passwand.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+static const char *const PHASE_NAMES[] = {
+    [PHASE_LOCK] = "lock wait",
+    [PHASE_IMPORT] = "import",
+    [PHASE_PROMPT] = "password prompt",
+    [PHASE_EXPORT] = "export",
+};
+
+static const char *const PHASE_KEYS[] = {
+    [PHASE_LOCK] = "lock",
+    [PHASE_IMPORT] = "import",
+    [PHASE_PROMPT] = "prompt",
+    [PHASE_EXPORT] = "export",
+};
+
+static atomic_uint_least64_t wall_ns[PHASE_COUNT];
+static atomic_uint_least64_t cpu_ns[PHASE_COUNT];
+
+static uint64_t clock_ns(clockid_t clock) {
+  struct timespec ts;
+  (void)clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+passwand_time_t phase_start(void) {
+  return (passwand_time_t){.wall_ns = clock_ns(CLOCK_MONOTONIC),
+                           .cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID)};
+}
+
+void phase_end(phase_t phase, passwand_time_t start) {
+  assert(phase < PHASE_COUNT);
+  const passwand_time_t end = phase_start();
+  wall_ns[phase] += end.wall_ns - start.wall_ns;
+  cpu_ns[phase] += end.cpu_ns - start.cpu_ns;
+}
+
+passwand_error_t export_entries(const char *path, passwand_entry_t *entries,
+                                size_t entry_len) {
+  const passwand_time_t start = phase_start();
+  const passwand_error_t err = passwand_export(path, entries, entry_len);
+  phase_end(PHASE_EXPORT, start);
+  return err;
+}
+
+#define SECONDS(ns) ((double)(ns) / 1e9)
+
+static void print_text(const passwand_pipeline_stats_t *pipeline,
+                       const passwand_time_t *total, size_t high_water) {
+
+  eprint("run statistics:\n"
+         "  total: %.3fs wall, %.3fs CPU\n",
+         SECONDS(total->wall_ns), SECONDS(total->cpu_ns));
+
+  for (size_t i = 0; i < PHASE_COUNT; ++i) {
+    // decryption happens between prompting and exporting
+    if (i == PHASE_EXPORT && pipeline != NULL) {
+      const struct {
+        const char *name;
+        passwand_time_t time;
+      } stages[] = {
+          {"key derivation", pipeline->kdf},
+          {"HMAC", pipeline->hmac},
+          {"AES", pipeline->aes},
+          {"callback", pipeline->action},
+      };
+      for (size_t j = 0; j < sizeof(stages) / sizeof(stages[0]); ++j)
+        eprint("  %s: %.3fs thread time, %.3fs CPU\n", stages[j].name,
+               SECONDS(stages[j].time.wall_ns),
+               SECONDS(stages[j].time.cpu_ns));
+    }
+    eprint("  %s: %.3fs wall, %.3fs CPU\n", PHASE_NAMES[i],
+           SECONDS(wall_ns[i]), SECONDS(cpu_ns[i]));
+  }
+
+  if (pipeline != NULL && pipeline->per_thread != NULL) {
+    for (size_t i = 0; i < pipeline->threads; ++i) {
+      const passwand_thread_stats_t *t = &pipeline->per_thread[i];
+      eprint("  thread %zu: %zu entries, %.1f%% utilisation\n", i, t->entries,
+             pipeline->wall_ns == 0
+                 ? 0.0
+                 : 100.0 * (double)t->busy_ns / (double)pipeline->wall_ns);
+    }
+  }
+
+  eprint("  secure heap high water: %zu bytes\n", high_water);
+}
+
+static void print_json(const passwand_pipeline_stats_t *pipeline,
+                       const passwand_time_t *total, size_t high_water) {
+
+#define TIME "{\"wall_ns\":%" PRIu64 ",\"cpu_ns\":%" PRIu64 "}"
+
+  eprint("{\"total\":" TIME ",\"phases\":{", total->wall_ns,
+         total->cpu_ns);
+  for (size_t i = 0; i < PHASE_COUNT; ++i)
+    eprint("%s\"%s\":" TIME, i == 0 ? "" : ",", PHASE_KEYS[i],
+           (uint64_t)wall_ns[i], (uint64_t)cpu_ns[i]);
+  if (pipeline != NULL) {
+    eprint(",\"kdf\":" TIME ",\"hmac\":" TIME ",\"aes\":" TIME
+           ",\"callback\":" TIME,
+           pipeline->kdf.wall_ns, pipeline->kdf.cpu_ns, pipeline->hmac.wall_ns,
+           pipeline->hmac.cpu_ns, pipeline->aes.wall_ns, pipeline->aes.cpu_ns,
+           pipeline->action.wall_ns, pipeline->action.cpu_ns);
+  }
+  eprint("},\"threads\":[");
+  if (pipeline != NULL && pipeline->per_thread != NULL) {
+    for (size_t i = 0; i < pipeline->threads; ++i) {
+      const passwand_thread_stats_t *t = &pipeline->per_thread[i];
+      eprint("%s{\"entries\":%zu,\"busy_ns\":%" PRIu64
+             ",\"utilisation\":%.3f}",
+             i == 0 ? "" : ",", t->entries, t->busy_ns,
+             pipeline->wall_ns == 0
+                 ? 0.0
+                 : (double)t->busy_ns / (double)pipeline->wall_ns);
+    }
+  }
+  eprint("],\"secure_heap_high_water\":%zu}\n", high_water);
+
+#undef TIME
+}
+
+#undef SECONDS
+
+void stats_print(passwand_time_t start,
+                 const passwand_pipeline_stats_t *pipeline, bool json) {
+
+  // the whole run, for comparison with its phases
+  const passwand_time_t total = {
+      .wall_ns = clock_ns(CLOCK_MONOTONIC) - start.wall_ns,
+      .cpu_ns = clock_ns(CLOCK_PROCESS_CPUTIME_ID)};
+
+  const size_t high_water = passwand_secure_heap_stats().high_water;
+
+  if (json) {
+    print_json(pipeline, &total, high_water);
+  } else {
+    print_text(pipeline, &total, high_water);
+  }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <passwand/passwand.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Timing of the phases of a run, reported by --stats. Phases run by the
+// library’s pipeline are taken from its statistics, while those below are
+// timed here.
+
+typedef enum {
+  PHASE_LOCK,   ///< waiting for database locks
+  PHASE_IMPORT, ///< reading databases
+  PHASE_PROMPT, ///< prompting for passwords
+  PHASE_EXPORT, ///< writing the database
+  PHASE_COUNT,
+} phase_t;
+
+/** Start timing a phase
+ *
+ * @return A mark to pass to phase_end
+ */
+passwand_time_t phase_start(void);
+
+/** Finish timing a phase, adding to its total
+ *
+ * This may be called concurrently from multiple threads.
+ *
+ * @param phase Phase that was being timed
+ * @param start Mark returned by phase_start
+ */
+void phase_end(phase_t phase, passwand_time_t start);
+
+/** Write the database, timed as PHASE_EXPORT
+ *
+ * @param path Path to write to
+ * @param entries Entries to write
+ * @param entry_len Number of entries
+ * @return PW_OK on success
+ */
+passwand_error_t export_entries(const char *path, passwand_entry_t *entries,
+                                size_t entry_len);
+
+/** Print a report of where time went to stderr
+ *
+ * @param start Mark returned by phase_start at the beginning of the run
+ * @param pipeline Statistics of decrypting entries, or NULL if there were none
+ * @param json Whether to print JSON rather than text
+ */
+void stats_print(passwand_time_t start,
+                 const passwand_pipeline_stats_t *pipeline, bool json);
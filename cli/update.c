@@ -3,6 +3,7 @@
 #include "../common/streq.h"
 #include "cli.h"
 #include "print.h"
+#include "stats.h"
 #include <assert.h>
 #include <limits.h>
 #include <passwand/passwand.h>
@@ -105,7 +106,7 @@ static int finalize(bool failure_pending) {
   saved_entries[0] = e;
 
   passwand_error_t err =
-      passwand_export(options.db.path, saved_entries, saved_entry_len);
+      export_entries(options.db.path, saved_entries, saved_entry_len);
   if (err != PW_OK) {
     print("failed to export entries: %s\n", passwand_error(err));
     return -1;
@@ -120,6 +121,7 @@ const command_t update = {
     .need_value = REQUIRED,
     .need_length = DISALLOWED,
     .access = LOCK_EX,
+    .ordered = true,
     .initialize = initialize,
     .loop_notify = loop_notify,
     .loop_condition = loop_condition,
@@ -0,0 +1,455 @@
+#include "access.h"
+#include "streq.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <passwand/passwand.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <time.h>
+#include <unistd.h>
+
+// fields of the single entry stored in the sidecar
+static const char SPACE[] = "passwand";
+static const char KEY[] = "access";
+
+// Upper bound on the serialised statistics. Secure allocations are limited to
+// a page, so the decrypted sidecar needs to fit comfortably within one. When
+// there are more statistics than fit, the least likely entries are dropped.
+enum { MAX_SERIALISED = 2048 };
+
+// time over which the weight of a look up halves
+static const double HALF_LIFE = 30 * 24 * 60 * 60;
+
+// Saving the statistics costs two key derivations, which can outweigh the
+// scanning it saves, so not every look up is saved. One that changes the scan
+// order always is. Otherwise, the statistics are saved with probability
+// 1/SAVE_INTERVAL, crediting each pending look up with SAVE_INTERVAL hits, so
+// hit counts stay correct on average.
+enum { SAVE_INTERVAL = 8 };
+
+typedef struct {
+  uint64_t id;           ///< prefix of the entry’s HMAC
+  unsigned long hits;    ///< number of look ups
+  long long last;        ///< time of the most recent look up
+  unsigned long pending; ///< look ups since loading, not yet counted in `hits`
+} record_t;
+
+static record_t *records;
+static size_t records_len;
+
+// have the statistics changed since being loaded?
+static bool dirty;
+
+/// derive an identifier for an entry
+///
+/// The HMAC of an entry is unique and stable until the entry is changed, so we
+/// use a prefix of it to recognise entries without decrypting them.
+static int id_of(const passwand_entry_t *entry, uint64_t *id) {
+  if (entry->hmac == NULL || entry->hmac_len < sizeof(*id))
+    return -1;
+  memcpy(id, entry->hmac, sizeof(*id));
+  return 0;
+}
+
+static record_t *find(uint64_t id) {
+  for (size_t i = 0; i < records_len; ++i) {
+    if (records[i].id == id)
+      return &records[i];
+  }
+  return NULL;
+}
+
+/// predicted likelihood of a look up, in arbitrary units
+static double score(const record_t *r, long long now) {
+  double s = (double)r->hits;
+  if (now <= r->last)
+    return s;
+  double age = (double)(now - r->last) / HALF_LIFE;
+  for (; age >= 1 && s > 0; --age)
+    s /= 2;
+  // approximate decay over the remaining fraction of a half-life linearly
+  return s * (1 - age / 2);
+}
+
+static char *sidecar_path(const char *db) {
+  char *path = NULL;
+  if (asprintf(&path, "%s.access", db) < 0)
+    return NULL;
+  return path;
+}
+
+static void discard_entry(passwand_entry_t *e) {
+  free(e->space);
+  free(e->key);
+  free(e->value);
+  free(e->hmac);
+  free(e->hmac_salt);
+  free(e->salt);
+  free(e->iv);
+}
+
+/// deserialise statistics from the decrypted sidecar
+///
+/// @param state Pointer to an int result that is set to 0 on success, -1 if
+///   the sidecar is malformed, or ENOMEM
+static void parse(void *state, const char *space, const char *key,
+                  const char *value) {
+
+  int *rc = state;
+  assert(rc != NULL);
+
+  if (!streq(space, SPACE) || !streq(key, KEY)) {
+    *rc = -1;
+    return;
+  }
+
+  // one record per line
+  size_t lines = 0;
+  for (const char *p = value; *p != '\0'; ++p) {
+    if (*p == '\n')
+      ++lines;
+  }
+  if (lines == 0) {
+    *rc = 0;
+    return;
+  }
+
+  records = calloc(lines, sizeof(records[0]));
+  if (records == NULL) {
+    *rc = ENOMEM;
+    return;
+  }
+
+  for (const char *p = value; *p != '\0'; ++p) {
+    record_t r = {0};
+    int n;
+    if (sscanf(p, "%" SCNx64 " %lu %lld%n", &r.id, &r.hits, &r.last, &n) != 3)
+      break;
+    p += n;
+    if (*p != '\n')
+      break;
+    records[records_len++] = r;
+  }
+
+  *rc = records_len == lines ? 0 : -1;
+}
+
+int access_load(const char *db, const char *mainpass, unsigned work_factor) {
+
+  assert(db != NULL);
+  assert(mainpass != NULL);
+
+  access_reset();
+
+  char *path = sidecar_path(db);
+  if (path == NULL)
+    return -1;
+
+  passwand_entry_t *entries = NULL;
+  size_t entry_len = 0;
+  int rc = 0;
+
+  // no statistics yet?
+  if (access(path, R_OK) != 0)
+    goto done;
+
+  if (passwand_import(path, &entries, &entry_len) != PW_OK || entry_len != 1)
+    goto done;
+
+  entries[0].work_factor = work_factor;
+  int parsed = -1;
+  passwand_error_t err =
+      passwand_entry_do(mainpass, &entries[0], parse, &parsed);
+  if (err == PW_NO_MEM || parsed == ENOMEM)
+    rc = -1;
+  if (err != PW_OK || parsed != 0)
+    access_reset();
+
+done:
+  for (size_t i = 0; i < entry_len; ++i)
+    discard_entry(&entries[i]);
+  free(entries);
+  free(path);
+
+  return rc;
+}
+
+typedef struct {
+  double score;
+  size_t index;
+} ranked_t;
+
+/// qsort comparator for descending score, then ascending index
+static int cmp_ranked(const void *a, const void *b) {
+  const ranked_t *x = a;
+  const ranked_t *y = b;
+  if (x->score > y->score)
+    return -1;
+  if (x->score < y->score)
+    return 1;
+  if (x->index < y->index)
+    return -1;
+  if (x->index > y->index)
+    return 1;
+  return 0;
+}
+
+size_t *access_order(const passwand_entry_t *entries, size_t entry_len) {
+
+  assert(entries != NULL || entry_len == 0);
+
+  if (records_len == 0 || entry_len == 0)
+    return NULL;
+
+  size_t *order = NULL;
+  ranked_t *ranked = calloc(entry_len, sizeof(ranked[0]));
+  if (ranked == NULL)
+    goto done;
+
+  const long long now = (long long)time(NULL);
+  for (size_t i = 0; i < entry_len; ++i) {
+    ranked[i].index = i;
+    uint64_t id;
+    if (id_of(&entries[i], &id) == 0) {
+      const record_t *r = find(id);
+      if (r != NULL)
+        ranked[i].score = score(r, now);
+    }
+  }
+
+  qsort(ranked, entry_len, sizeof(ranked[0]), cmp_ranked);
+
+  order = calloc(entry_len, sizeof(order[0]));
+  if (order == NULL)
+    goto done;
+  for (size_t i = 0; i < entry_len; ++i)
+    order[i] = ranked[i].index;
+
+done:
+  free(ranked);
+
+  return order;
+}
+
+int access_hit(const passwand_entry_t *entry) {
+
+  assert(entry != NULL);
+
+  uint64_t id;
+  if (id_of(entry, &id) != 0)
+    return -1;
+
+  record_t *r = find(id);
+  if (r == NULL) {
+    record_t *rs = realloc(records, (records_len + 1) * sizeof(records[0]));
+    if (rs == NULL)
+      return -1;
+    records = rs;
+    r = &records[records_len++];
+    *r = (record_t){.id = id};
+  }
+
+  if (r->pending < ULONG_MAX)
+    ++r->pending;
+  dirty = true;
+
+  return 0;
+}
+
+/// count pending look ups
+///
+/// @param weight Hits to credit for each pending look up
+static void apply(unsigned long weight, long long now) {
+  for (size_t i = 0; i < records_len; ++i) {
+    record_t *r = &records[i];
+    if (r->pending == 0)
+      continue;
+    const unsigned long room = ULONG_MAX - r->hits;
+    r->hits += r->pending > room / weight ? room : r->pending * weight;
+    r->last = now;
+  }
+}
+
+/// would counting pending look ups once change the order entries are scanned?
+///
+/// @return 0 if not, 1 if so, or -1 if out of memory
+static int reorders(const passwand_entry_t *entries, size_t entry_len,
+                    long long now) {
+
+  int rc = -1;
+  record_t *counted = NULL;
+  size_t *before = NULL;
+  size_t *after = NULL;
+
+  // entries with no statistics are not ordered, so gaining some is a change
+  for (size_t i = 0; i < records_len; ++i) {
+    if (records[i].pending > 0 && records[i].hits == 0)
+      return 1;
+  }
+
+  counted = calloc(records_len, sizeof(counted[0]));
+  if (counted == NULL)
+    goto done;
+  memcpy(counted, records, records_len * sizeof(records[0]));
+
+  before = access_order(entries, entry_len);
+  record_t *const original = records;
+  records = counted;
+  apply(1, now);
+  after = access_order(entries, entry_len);
+  records = original;
+  if (before == NULL || after == NULL)
+    goto done;
+
+  rc = memcmp(before, after, entry_len * sizeof(before[0])) != 0;
+
+done:
+  free(after);
+  free(before);
+  free(counted);
+
+  return rc;
+}
+
+static long long sort_now;
+
+/// qsort comparator for descending record score
+static int cmp_record(const void *a, const void *b) {
+  const double x = score(a, sort_now);
+  const double y = score(b, sort_now);
+  if (x > y)
+    return -1;
+  if (x < y)
+    return 1;
+  return 0;
+}
+
+int access_save(const char *db, const char *mainpass, unsigned work_factor,
+                const passwand_entry_t *entries, size_t entry_len) {
+
+  assert(db != NULL);
+  assert(mainpass != NULL);
+  assert(entries != NULL || entry_len == 0);
+
+  if (!dirty)
+    return 0;
+
+  // decide whether this save is worth making
+  const long long now = (long long)time(NULL);
+  unsigned long weight = 1;
+  {
+    const int r = reorders(entries, entry_len, now);
+    if (r < 0)
+      return -1;
+    if (r == 0) {
+      uint8_t roll;
+      if (passwand_random_bytes(&roll, sizeof(roll)) != PW_OK)
+        return -1;
+      if (roll % SAVE_INTERVAL != 0) {
+        for (size_t i = 0; i < records_len; ++i)
+          records[i].pending = 0;
+        dirty = false;
+        return 0;
+      }
+      weight = SAVE_INTERVAL;
+    }
+  }
+  apply(weight, now);
+
+  char *path = sidecar_path(db);
+  if (path == NULL)
+    return -1;
+
+  int fd = -1;
+  passwand_entry_t e = {0};
+  bool e_created = false;
+  int rc = -1;
+
+  // discard statistics for entries that have since been deleted or changed
+  {
+    size_t live = 0;
+    for (size_t i = 0; i < records_len; ++i) {
+      for (size_t j = 0; j < entry_len; ++j) {
+        uint64_t id;
+        if (id_of(&entries[j], &id) == 0 && id == records[i].id) {
+          records[live++] = records[i];
+          break;
+        }
+      }
+    }
+    records_len = live;
+  }
+
+  // If the sidecar exists, lock it to exclude other writers. It does not
+  // matter if we lose this race; the statistics are only a hint.
+  if (access(path, F_OK) == 0) {
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      goto done;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+      rc = 0;
+      goto done;
+    }
+  }
+
+  if (records_len == 0) {
+    if (fd >= 0 && unlink(path) != 0)
+      goto done;
+    rc = 0;
+    goto done;
+  }
+
+  // serialise the most likely entries, as many as fit
+  sort_now = now;
+  qsort(records, records_len, sizeof(records[0]), cmp_record);
+  char value[MAX_SERIALISED];
+  size_t offset = 0;
+  for (size_t i = 0; i < records_len; ++i) {
+    int n = snprintf(value + offset, sizeof(value) - offset,
+                     "%016" PRIx64 " %lu %lld\n", records[i].id,
+                     records[i].hits, records[i].last);
+    if (n < 0 || (size_t)n >= sizeof(value) - offset) {
+      value[offset] = '\0';
+      break;
+    }
+    offset += (size_t)n;
+  }
+
+  if (passwand_entry_new(&e, mainpass, SPACE, KEY, value, (int)work_factor) !=
+      PW_OK)
+    goto done;
+  e_created = true;
+
+  if (passwand_export(path, &e, 1) != PW_OK)
+    goto done;
+
+  rc = 0;
+
+done:
+  for (size_t i = 0; i < records_len; ++i)
+    records[i].pending = 0;
+  dirty = false;
+  if (e_created)
+    discard_entry(&e);
+  if (fd >= 0) {
+    (void)flock(fd, LOCK_UN);
+    (void)close(fd);
+  }
+  free(path);
+
+  return rc;
+}
+
+void access_reset(void) {
+  free(records);
+  records = NULL;
+  records_len = 0;
+  dirty = false;
+}
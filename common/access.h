@@ -0,0 +1,65 @@
+#pragma once
+
+#include <passwand/passwand.h>
+#include <stddef.h>
+
+// Access statistics record how often and how recently each database entry was
+// looked up. They are used to scan entries most-likely-first, so successful
+// look ups terminate early. The statistics are stored in an encrypted sidecar
+// file next to the database (<database>.access), so the database itself does
+// not need to be rewritten to reflect usage.
+
+/** Load access statistics for a database
+ *
+ * A missing, corrupted or undecryptable sidecar is not an error. It is treated
+ * as having no statistics and will be replaced the next time they are saved.
+ *
+ * @param db Path to the database whose statistics to load
+ * @param mainpass Main password of the database
+ * @param work_factor Scrypt work factor of the database
+ * @return 0 on success
+ */
+int access_load(const char *db, const char *mainpass, unsigned work_factor);
+
+/** Compute the order in which to scan entries
+ *
+ * Entries are ordered by their predicted chance of being looked up, derived
+ * from their hit counts decayed by the time since they were last accessed.
+ * Entries with no statistics follow in their original order.
+ *
+ * @param entries Entries to order
+ * @param entry_len Number of entries
+ * @return A permutation of entry indices to be freed by the caller, or NULL if
+ *   out of memory or there are no statistics to order by
+ */
+size_t *access_order(const passwand_entry_t *entries, size_t entry_len);
+
+/** Record a look up of an entry
+ *
+ * The look up is not counted until the statistics are next saved.
+ *
+ * @param entry Entry that was looked up
+ * @return 0 on success
+ */
+int access_hit(const passwand_entry_t *entry);
+
+/** Save access statistics for a database
+ *
+ * Statistics for entries no longer in the database are discarded. If another
+ * process is concurrently saving statistics, this is skipped. Saving costs
+ * as much as decrypting an entry, so look ups that do not change the order
+ * entries are scanned in are only saved some of the time, each then counting
+ * for several.
+ *
+ * @param db Path to the database whose statistics to save
+ * @param mainpass Main password of the database
+ * @param work_factor Scrypt work factor of the database
+ * @param entries Current entries of the database
+ * @param entry_len Number of entries
+ * @return 0 on success
+ */
+int access_save(const char *db, const char *mainpass, unsigned work_factor,
+                const passwand_entry_t *entries, size_t entry_len);
+
+/// discard any loaded access statistics
+void access_reset(void);
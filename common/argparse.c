@@ -1,6 +1,9 @@
 #include "argparse.h"
 #include "getenv.h"
+#include "jobs-cache.h"
+#include "streq.h"
 #include <assert.h>
+#include <ctype.h>
 #include <getopt.h>
 #include <limits.h>
 #include <stdbool.h>
@@ -28,6 +31,267 @@ static void blank_arguments(int argc, char **argv) {
   }
 }
 
+/// read a single numeric limit from a file
+///
+/// @param path File to read
+/// @return The value, or 0 if it was unavailable or unlimited
+static size_t read_limit(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+    return 0;
+  unsigned long long value = 0;
+  if (fscanf(f, "%llu", &value) != 1)
+    value = 0; // e.g. “max”
+  (void)fclose(f);
+  // cgroups v1 represents “unlimited” as a very large page-aligned number
+  if (value >= (unsigned long long)SIZE_MAX / 2)
+    return 0;
+  return (size_t)value;
+}
+
+/// find the memory limit imposed by our cgroup, if any
+static size_t cgroup_limit(void) {
+  FILE *f = fopen("/proc/self/cgroup", "r");
+  if (f == NULL)
+    return 0;
+
+  size_t limit = 0;
+  char *line = NULL;
+  size_t size = 0;
+  while (limit == 0 && getline(&line, &size, f) > 0) {
+    line[strcspn(line, "\n")] = '\0';
+
+    // cgroups v2 lines look like “0::<path>”, while cgroups v1 lines for the
+    // memory controller look like “<id>:memory:<path>”
+    const char *file = NULL;
+    const char *prefix = NULL;
+    const char *cgroup = NULL;
+    if (strncmp(line, "0::", strlen("0::")) == 0) {
+      prefix = "/sys/fs/cgroup";
+      file = "memory.max";
+      cgroup = line + strlen("0::");
+    } else if (strstr(line, ":memory:") != NULL) {
+      prefix = "/sys/fs/cgroup/memory";
+      file = "memory.limit_in_bytes";
+      cgroup = strstr(line, ":memory:") + strlen(":memory:");
+    } else {
+      continue;
+    }
+
+    // try our own cgroup, then the root of the (possibly namespaced) hierarchy
+    char *path = NULL;
+    if (asprintf(&path, "%s%s/%s", prefix, cgroup, file) >= 0) {
+      limit = read_limit(path);
+      free(path);
+    }
+    if (limit == 0 && asprintf(&path, "%s/%s", prefix, file) >= 0) {
+      limit = read_limit(path);
+      free(path);
+    }
+  }
+
+  free(line);
+  (void)fclose(f);
+  return limit;
+}
+
+/// find how much memory the system has available, if known
+static size_t available_memory(void) {
+  FILE *f = fopen("/proc/meminfo", "r");
+  if (f == NULL)
+    return 0;
+
+  size_t available = 0;
+  char *line = NULL;
+  size_t size = 0;
+  while (getline(&line, &size, f) > 0) {
+    unsigned long long kb;
+    if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1) {
+      if (kb <= SIZE_MAX / 1024)
+        available = (size_t)kb * 1024;
+      break;
+    }
+  }
+
+  free(line);
+  (void)fclose(f);
+  return available;
+}
+
+/// parse a size with an optional K, M, or G suffix
+static int parse_size(const char *s, size_t *size) {
+  char *endptr;
+  unsigned long long value = strtoull(s, &endptr, 10);
+  if (endptr == s || value == ULLONG_MAX)
+    return -1;
+  unsigned long long scale = 1;
+  switch (*endptr) {
+  case 'k':
+  case 'K':
+    scale = 1024;
+    ++endptr;
+    break;
+  case 'm':
+  case 'M':
+    scale = 1024 * 1024;
+    ++endptr;
+    break;
+  case 'g':
+  case 'G':
+    scale = 1024 * 1024 * 1024;
+    ++endptr;
+    break;
+  }
+  if (*endptr != '\0')
+    return -1;
+  if (value > SIZE_MAX / scale)
+    return -1;
+  *size = (size_t)(value * scale);
+  return 0;
+}
+
+/// parse a duration with an optional s, m, h, or d suffix, in seconds
+static int parse_duration(const char *s, unsigned long *seconds) {
+  char *endptr;
+  unsigned long value = strtoul(s, &endptr, 10);
+  if (endptr == s || value == ULONG_MAX)
+    return -1;
+  unsigned long scale = 1;
+  switch (*endptr) {
+  case 's':
+    ++endptr;
+    break;
+  case 'm':
+    scale = 60;
+    ++endptr;
+    break;
+  case 'h':
+    scale = 60 * 60;
+    ++endptr;
+    break;
+  case 'd':
+    scale = 24 * 60 * 60;
+    ++endptr;
+    break;
+  }
+  if (*endptr != '\0')
+    return -1;
+  if (value > ULONG_MAX / scale)
+    return -1;
+  *seconds = value * scale;
+  return 0;
+}
+
+/// how much memory a single Scrypt key derivation needs at the given work
+/// factor
+static size_t kdf_memory(unsigned work_factor) {
+  // Scrypt uses 128 × r × N bytes, and we use r = 8
+  if (work_factor >= sizeof(size_t) * 8 - 10)
+    return SIZE_MAX;
+  return (size_t)1024 << work_factor;
+}
+
+/// add a copy of an argument to a list
+static int append(char ***list, size_t *len, const char *arg) {
+  char **l = realloc(*list, (*len + 1) * sizeof((*list)[0]));
+  if (l == NULL) {
+    fprintf(stderr, "out of memory while processing arguments\n");
+    return -1;
+  }
+  *list = l;
+  l[*len] = strdup(arg);
+  if (l[*len] == NULL) {
+    fprintf(stderr, "out of memory while processing arguments\n");
+    return -1;
+  }
+  ++*len;
+  return 0;
+}
+
+/// expand a --charset argument, where “a-z” denotes a range of characters
+///
+/// @param s Argument to expand
+/// @param[out] charset Each character given, once and in ascending order
+/// @return 0 on success
+static int parse_charset(const char *s, char **charset) {
+
+  bool chosen[UCHAR_MAX + 1] = {false};
+  for (const char *p = s; *p != '\0'; ++p) {
+    const unsigned char lo = (unsigned char)*p;
+    unsigned char hi = lo;
+    // a ‘-’ at the start or end stands for itself
+    if (p[1] == '-' && p[2] != '\0') {
+      hi = (unsigned char)p[2];
+      p += 2;
+    }
+    if (hi < lo)
+      return -1;
+    for (unsigned c = lo; c <= hi; ++c) {
+      // only allow characters that can be typed and seen
+      if (!isgraph((int)c) || c > SCHAR_MAX)
+        return -1;
+      chosen[c] = true;
+    }
+  }
+
+  size_t len = 0;
+  for (size_t c = 0; c < sizeof(chosen); ++c)
+    len += chosen[c];
+  if (len == 0)
+    return -1;
+
+  char *set = malloc(len + 1);
+  if (set == NULL)
+    return -1;
+  len = 0;
+  for (size_t c = 0; c < sizeof(chosen); ++c) {
+    if (chosen[c])
+      set[len++] = (char)c;
+  }
+  set[len] = '\0';
+
+  free(*charset);
+  *charset = set;
+  return 0;
+}
+
+/// parse a comma-separated list of character classes for --require
+///
+/// @param s Argument to parse
+/// @param[out] require CLASS_* of each class listed
+/// @return 0 on success
+static int parse_classes(const char *s, unsigned *require) {
+  static const struct {
+    const char *name;
+    unsigned class;
+  } CLASSES[] = {
+      {"lower", CLASS_LOWER},
+      {"upper", CLASS_UPPER},
+      {"digit", CLASS_DIGIT},
+      {"symbol", CLASS_SYMBOL},
+  };
+
+  unsigned r = 0;
+  while (true) {
+    const size_t len = strcspn(s, ",");
+    size_t i = 0;
+    for (; i < sizeof(CLASSES) / sizeof(CLASSES[0]); ++i) {
+      if (strlen(CLASSES[i].name) == len &&
+          strncmp(s, CLASSES[i].name, len) == 0)
+        break;
+    }
+    if (i == sizeof(CLASSES) / sizeof(CLASSES[0]))
+      return -1;
+    r |= CLASSES[i].class;
+    if (s[len] == '\0')
+      break;
+    s += len + 1;
+  }
+
+  *require |= r;
+  return 0;
+}
+
 int parse(int argc, char **argv) {
 
   options.db.work_factor = DEFAULT_WORK_FACTOR;
@@ -35,12 +299,29 @@ int parse(int argc, char **argv) {
 
   while (true) {
     struct option opts[] = {
+        {"affinity", required_argument, 0, 'A'},
+        {"breach-db", required_argument, 0, 'B'},
+        {"build-index", no_argument, 0, 'I'},
         {"chain", required_argument, 0, 'c'},
+        {"charset", required_argument, 0, 'a'},
+        {"count", required_argument, 0, 'n'},
         {"data", required_argument, 0, 'd'},
+        {"dictionary", required_argument, 0, 'D'},
+        {"heap-stats", no_argument, 0, 'H'},
+        {"hibp-cache", required_argument, 0, 'C'},
+        {"hibp-server", required_argument, 0, 'W'},
         {"jobs", required_argument, 0, 'j'},
         {"length", required_argument, 0, 'l'},
+        {"memory-budget", required_argument, 0, 'M'},
+        {"no-ambiguous", no_argument, 0, 'U'},
+        {"pipeline-stats", no_argument, 0, 'P'},
+        {"require", required_argument, 0, 'r'},
+        {"reuse", no_argument, 0, 'R'},
+        {"stats", optional_argument, 0, 'S'},
         {"space", required_argument, 0, 's'},
+        {"space-prefix", required_argument, 0, 'p'},
         {"key", required_argument, 0, 'k'},
+        {"keys-from", required_argument, 0, 'K'},
         {"value", required_argument, 0, 'v'},
         {"work-factor", required_argument, 0, 'N'},
         {0, 0, 0, 0},
@@ -64,6 +345,36 @@ int parse(int argc, char **argv) {
     }                                                                          \
   } while (0)
 
+    case 'A':
+      if (streq(optarg, "none")) {
+        options.affinity = PW_AFFINITY_NONE;
+      } else if (streq(optarg, "compact")) {
+        options.affinity = PW_AFFINITY_COMPACT;
+      } else if (streq(optarg, "scatter")) {
+        options.affinity = PW_AFFINITY_SCATTER;
+      } else if (streq(optarg, "numa")) {
+        options.affinity = PW_AFFINITY_NUMA;
+      } else {
+        fprintf(stderr, "invalid argument to --affinity\n");
+        return -1;
+      }
+      break;
+
+    case 'a':
+      if (parse_charset(optarg, &options.charset) != 0) {
+        fprintf(stderr, "invalid argument to --charset\n");
+        return -1;
+      }
+      break;
+
+    case 'B':
+      HANDLE_ARG(breach_db);
+      break;
+
+    case 'I':
+      options.build_index = true;
+      break;
+
     case 'c':
       ++options.chain_len;
       options.chain =
@@ -81,7 +392,40 @@ int parse(int argc, char **argv) {
       HANDLE_ARG(db.path);
       break;
 
+    case 'H':
+      options.heap_stats = true;
+      break;
+
+    case 'C':
+      if (parse_duration(optarg, &options.hibp_cache_ttl) != 0 ||
+          options.hibp_cache_ttl == 0) {
+        fprintf(stderr, "invalid argument to --hibp-cache\n");
+        return -1;
+      }
+      break;
+
+    case 'W':
+      HANDLE_ARG(hibp_server);
+      break;
+
+    case 'S':
+      if (optarg == NULL || streq(optarg, "text")) {
+        options.stats = STATS_TEXT;
+      } else if (streq(optarg, "json")) {
+        options.stats = STATS_JSON;
+      } else {
+        fprintf(stderr, "invalid argument to --stats\n");
+        return -1;
+      }
+      break;
+
     case 'j': {
+      if (streq(optarg, "auto")) {
+        options.jobs = 0;
+        options.adaptive = true;
+        break;
+      }
+      options.adaptive = false;
       char *endptr;
       unsigned long jobs = strtoul(optarg, &endptr, 10);
       if (endptr == optarg || *endptr != '\0' || jobs == ULONG_MAX) {
@@ -104,18 +448,73 @@ int parse(int argc, char **argv) {
       break;
     }
 
+    case 'M':
+      if (parse_size(optarg, &options.memory_budget) != 0 ||
+          options.memory_budget == 0) {
+        fprintf(stderr, "invalid argument to --memory-budget\n");
+        return -1;
+      }
+      break;
+
+    case 'n': {
+      char *endptr;
+      unsigned long count = strtoul(optarg, &endptr, 10);
+      if (endptr == optarg || *endptr != '\0' || count == 0 ||
+          count == ULONG_MAX || count > SIZE_MAX) {
+        fprintf(stderr, "invalid argument to --count\n");
+        return -1;
+      }
+      options.count = count;
+      break;
+    }
+
+    case 'P':
+      options.pipeline_stats = true;
+      break;
+
+    case 'p':
+      HANDLE_ARG(space_prefix);
+      break;
+
+    case 'r':
+      if (parse_classes(optarg, &options.require) != 0) {
+        fprintf(stderr, "invalid argument to --require\n");
+        return -1;
+      }
+      break;
+
+    case 'R':
+      options.reuse = true;
+      break;
+
+    case 'U':
+      options.no_ambiguous = true;
+      break;
+
     case 's':
       HANDLE_ARG(space);
+      if (append(&options.spaces, &options.space_len, optarg) != 0)
+        return -1;
       break;
 
     case 'k':
       HANDLE_ARG(key);
+      if (append(&options.keys, &options.key_len, optarg) != 0)
+        return -1;
       break;
 
     case 'v':
       HANDLE_ARG(value);
       break;
 
+    case 'K':
+      HANDLE_ARG(keys_from);
+      break;
+
+    case 'D':
+      HANDLE_ARG(dictionary);
+      break;
+
 #undef HANDLE_ARG
 
     case 'N': {
@@ -183,12 +582,48 @@ int parse(int argc, char **argv) {
     options.db.path = target;
   }
 
+  // If asked to choose the number of jobs adaptively, reuse the last choice
+  // made on this machine if there was one.
+  if (options.adaptive) {
+    const unsigned long cached = jobs_cache_load(options.db.work_factor);
+    if (cached != 0) {
+      options.jobs = cached;
+      options.adaptive = false;
+    }
+  }
+
   if (options.jobs == 0) { // automatic
     long cpus = sysconf(_SC_NPROCESSORS_ONLN);
     assert(cpus >= 1);
     options.jobs = (unsigned long)cpus;
   }
 
+  // If we were not given a memory budget, use the tighter of our cgroup’s
+  // limit and the system’s available memory. Either may be unknown.
+  if (options.memory_budget == 0) {
+    const size_t cgroup = cgroup_limit();
+    const size_t available = available_memory();
+    if (cgroup != 0 && (available == 0 || cgroup < available)) {
+      options.memory_budget = cgroup;
+    } else {
+      options.memory_budget = available;
+    }
+  }
+
+  // Each job runs at most one key derivation at a time, so limit the number of
+  // jobs to the number of key derivations that fit in our memory budget.
+  if (options.memory_budget != 0) {
+    unsigned work_factor = options.db.work_factor;
+    for (size_t i = 0; i < options.chain_len; ++i) {
+      if (options.chain[i].work_factor > work_factor)
+        work_factor = options.chain[i].work_factor;
+    }
+    const size_t per_job = kdf_memory(work_factor);
+    const size_t max_jobs = options.memory_budget / per_job;
+    if (max_jobs < options.jobs)
+      options.jobs = max_jobs == 0 ? 1 : max_jobs;
+  }
+
   blank_arguments(argc, argv);
 
   return 0;
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <passwand/passwand.h>
+#include <stdbool.h>
 #include <stddef.h>
 
 typedef struct {
@@ -7,14 +9,70 @@ typedef struct {
   unsigned work_factor;
 } database_t;
 
+// how to report --stats
+typedef enum {
+  STATS_NONE,
+  STATS_TEXT,
+  STATS_JSON,
+} stats_format_t;
+
+// classes of characters a generated password can be required to contain
+enum {
+  CLASS_LOWER = 1 << 0,
+  CLASS_UPPER = 1 << 1,
+  CLASS_DIGIT = 1 << 2,
+  CLASS_SYMBOL = 1 << 3,
+};
+
 typedef struct {
   database_t db;
   char *space;
   char *key;
   char *value;
+
+  // every --space and --key given, in order, for commands that look up more
+  // than one entry (`space` and `key` above are the last of each)
+  char **spaces;
+  size_t space_len;
+  char **keys;
+  size_t key_len;
+
+  // file listing further entries to look up
+  char *keys_from;
+
+  // word list to check passwords against
+  char *dictionary;
+
+  // local copy of the Have I Been Pwned password list
+  char *breach_db;
+  bool build_index; ///< index `breach_db` instead of running the command?
+
+  // “host[:port]” of the Have I Been Pwned API server
+  char *hibp_server;
+  unsigned long hibp_cache_ttl; ///< seconds to cache responses on disk, or 0
+
+  bool reuse; ///< report passwords shared by more than one entry?
+
   unsigned long jobs;
+  bool adaptive; ///< tune the number of jobs while running?
+  passwand_affinity_t affinity;
   size_t length;
 
+  // policy for generated passwords
+  char *charset;     ///< characters to choose from, or NULL for the default
+  unsigned require;  ///< CLASS_* of which each password must contain one
+  bool no_ambiguous; ///< leave out characters that are easily confused?
+
+  // entries to generate, in the spaces <space_prefix>1, <space_prefix>2, …
+  size_t count;
+  char *space_prefix;
+
+  // bytes of memory concurrent jobs may use (0 if unknown or unlimited)
+  size_t memory_budget;
+  bool heap_stats;
+  bool pipeline_stats;
+  stats_format_t stats;
+
   // extra indirect databases to go through to get the main password for the
   // primary database above
   database_t *chain;
@@ -0,0 +1,129 @@
+#include "jobs-cache.h"
+#include "getenv.h"
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/// find the path of the cache
+static char *cache_path(void) {
+  const char *home = getenv_("HOME");
+  if (home == NULL)
+    return NULL;
+  char *path = NULL;
+  if (asprintf(&path, "%s/.passwand.jobs", home) < 0)
+    return NULL;
+  return path;
+}
+
+/// describe this host, as the start of a cache line
+static char *host_key(unsigned work_factor) {
+  char host[256] = {0};
+  if (gethostname(host, sizeof(host) - 1) != 0)
+    return NULL;
+  const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  char *key = NULL;
+  if (asprintf(&key, "%s %ld %u ", host, cpus, work_factor) < 0)
+    return NULL;
+  return key;
+}
+
+unsigned long jobs_cache_load(unsigned work_factor) {
+
+  char *path = cache_path();
+  char *key = host_key(work_factor);
+  FILE *f = NULL;
+  char *line = NULL;
+  size_t size = 0;
+  unsigned long jobs = 0;
+
+  if (path == NULL || key == NULL)
+    goto done;
+
+  f = fopen(path, "r");
+  if (f == NULL)
+    goto done;
+
+  while (getline(&line, &size, f) > 0) {
+    if (strncmp(line, key, strlen(key)) != 0)
+      continue;
+    char *end;
+    const unsigned long j = strtoul(line + strlen(key), &end, 10);
+    if (end != line + strlen(key) && (*end == '\n' || *end == '\0') &&
+        j != ULONG_MAX)
+      jobs = j;
+  }
+
+done:
+  free(line);
+  if (f != NULL)
+    (void)fclose(f);
+  free(key);
+  free(path);
+
+  return jobs;
+}
+
+void jobs_cache_save(unsigned work_factor, unsigned long jobs) {
+
+  char *path = cache_path();
+  char *key = host_key(work_factor);
+  char *tmp = NULL;
+  FILE *in = NULL;
+  FILE *out = NULL;
+  char *line = NULL;
+  size_t size = 0;
+  bool ok = false;
+
+  if (path == NULL || key == NULL)
+    goto done;
+
+  // write the new cache alongside the old, then move it into place
+  if (asprintf(&tmp, "%s.XXXXXX", path) < 0) {
+    tmp = NULL;
+    goto done;
+  }
+  const int fd = mkstemp(tmp);
+  if (fd < 0) {
+    free(tmp);
+    tmp = NULL;
+    goto done;
+  }
+  out = fdopen(fd, "w");
+  if (out == NULL) {
+    (void)close(fd);
+    goto done;
+  }
+
+  // keep records for other hosts and configurations
+  in = fopen(path, "r");
+  if (in != NULL) {
+    while (getline(&line, &size, in) > 0) {
+      if (strncmp(line, key, strlen(key)) == 0)
+        continue;
+      if (fputs(line, out) < 0)
+        goto done;
+    }
+  }
+
+  if (fprintf(out, "%s%lu\n", key, jobs) < 0)
+    goto done;
+
+  ok = true;
+
+done:
+  free(line);
+  if (in != NULL)
+    (void)fclose(in);
+  if (out != NULL && fclose(out) != 0)
+    ok = false;
+  if (tmp != NULL) {
+    if (!ok || rename(tmp, path) != 0)
+      (void)unlink(tmp);
+    free(tmp);
+  }
+  free(key);
+  free(path);
+}
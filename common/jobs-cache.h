@@ -0,0 +1,26 @@
+#pragma once
+
+// The number of threads chosen by `--jobs auto` depends on the machine, not the
+// database, so it is cached per host in ~/.passwand.jobs to spare later runs
+// from measuring it again. Each line of this file records one choice:
+//
+//   <hostname> <CPUs> <work factor> <jobs>
+//
+// The CPU count and work factor are included because the best number of
+// threads changes with either.
+
+/** Look up the number of threads previously chosen on this host
+ *
+ * @param work_factor Scrypt work factor of the database
+ * @return The number of threads, or 0 if there is no record
+ */
+unsigned long jobs_cache_load(unsigned work_factor);
+
+/** Record the number of threads chosen on this host
+ *
+ * Failure is not reported because the cache is only a hint.
+ *
+ * @param work_factor Scrypt work factor of the database
+ * @param jobs Number of threads chosen
+ */
+void jobs_cache_save(unsigned work_factor, unsigned long jobs);
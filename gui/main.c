@@ -1,11 +1,12 @@
+#include "../common/access.h"
 #include "../common/argparse.h"
+#include "../common/jobs-cache.h"
 #include "../common/streq.h"
 #include "gui.h"
 #include <assert.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <passwand/passwand.h>
-#include <pthread.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -40,9 +41,9 @@
   } while (0)
 
 static atomic_bool done;
-static atomic_size_t entry_index;
 static passwand_entry_t *entries;
 static size_t entry_len;
+static size_t *order;
 static char *mainpass;
 static char *found_value;
 static size_t found_index;
@@ -61,10 +62,24 @@ static void cleanup(void) {
   for (size_t i = 0; i < entry_len; i++)
     cleanup_entry(&entries[i]);
   free(entries);
+  free(order);
+  access_reset();
   free(options.db.path);
   free(options.space);
   free(options.key);
   free(options.value);
+  for (size_t i = 0; i < options.space_len; ++i)
+    free(options.spaces[i]);
+  free(options.spaces);
+  for (size_t i = 0; i < options.key_len; ++i)
+    free(options.keys[i]);
+  free(options.keys);
+  free(options.keys_from);
+  free(options.dictionary);
+  free(options.breach_db);
+  free(options.hibp_server);
+  free(options.charset);
+  free(options.space_prefix);
   for (size_t i = 0; i < options.chain_len; ++i)
     free(options.chain[i].path);
   free(options.chain);
@@ -86,43 +101,26 @@ static void check(void *state, const char *space, const char *key,
   }
 }
 
-static void *search(void *arg __attribute__((unused))) {
+/// check one decrypted entry, as an action for `passwand_entries_do`
+static void search(void *state, size_t index, const char *space,
+                   const char *key, const char *value) {
+  passwand_pool_t *pool = state;
+  assert(pool != NULL);
 
   char *v = NULL;
-
-  for (;;) {
-
-    if (done)
-      break;
-
-    // get the next entry to check
-    size_t i = atomic_fetch_add(&entry_index, 1);
-    if (i >= entry_len)
-      break;
-
-    passwand_error_t err = passwand_entry_do(mainpass, &entries[i], check, &v);
-    if (err != PW_OK) {
-      char *msg;
-      if (asprintf(&msg, "error: %s", passwand_error(err)) >= 0)
-        return msg;
-      return NULL;
-    }
-
-    if (v != NULL) {
-      // We found it!
-      bool expected = false;
-      if (atomic_compare_exchange_strong(&done, &expected, true)) {
-        found_index = i;
-        found_value = v;
-        return NULL;
-      } else {
-        passwand_secure_free(v, strlen(v) + 1);
-      }
-      return NULL;
+  check(&v, space, key, value);
+
+  if (v != NULL) {
+    // We found it!
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&done, &expected, true)) {
+      found_index = index;
+      found_value = v;
+    } else {
+      passwand_secure_free(v, strlen(v) + 1);
     }
+    passwand_pool_cancel(pool);
   }
-
-  return NULL;
 }
 
 /** Take a password entry from a chained database and consider it now the new
@@ -170,6 +168,15 @@ int main(int argc, char **argv) {
   if (options.length != 0)
     DIE("--length is not accepted by pw-gui");
 
+  if (options.charset != NULL || options.require != 0 ||
+      options.no_ambiguous || options.count != 0 ||
+      options.space_prefix != NULL)
+    DIE("pw-gui does not generate passwords");
+
+  if (options.space_len > 1 || options.key_len > 1 ||
+      options.keys_from != NULL)
+    DIE("pw-gui can only look up a single entry");
+
   if (options.space == NULL)
     options.space = get_text("Passwand", "Name space?", NULL, false);
   if (options.space == NULL) {
@@ -266,7 +273,7 @@ int main(int argc, char **argv) {
     int fd = open(options.db.path, O_RDONLY);
     if (fd < 0)
       DIE("failed to open database");
-    if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+    if (flock(fd, LOCK_SH | LOCK_NB) != 0)
       DIE("failed to lock database: %s", strerror(errno));
   }
 
@@ -278,72 +285,78 @@ int main(int argc, char **argv) {
   for (size_t i = 0; i < entry_len; i++)
     entries[i].work_factor = options.db.work_factor;
 
+  // Visit the entries most likely to be sought first. If every entry is visited
+  // in the first round of threads anyway, skip the cost of decrypting the
+  // access statistics.
+  const bool use_access = entry_len > options.jobs;
+  if (use_access) {
+    if (access_load(options.db.path, mainpass, options.db.work_factor) != 0)
+      DIE("out of memory");
+    order = access_order(entries, entry_len);
+  }
+
   // we now are ready to search for the entry, but let us parallelise it across
   // as many cores as we have to speed it up
 
   assert(options.jobs >= 1);
 
-  pthread_t *threads = calloc(options.jobs - 1, sizeof(pthread_t));
-  if (threads == NULL)
-    DIE("out of memory");
+  passwand_pool_t *pool = NULL;
+  err = passwand_pool_create(&pool, options.jobs);
+  if (err != PW_OK)
+    DIE("failed to create threads: %s", passwand_error(err));
 
-  // initialise and start threads
-  for (size_t i = 0; i < options.jobs; i++) {
+  // misplaced threads only cost performance, so ignore failure
+  (void)passwand_pool_set_affinity(pool, options.affinity);
 
-    if (i < options.jobs - 1) {
-      int r = pthread_create(&threads[i], NULL, search, NULL);
-      if (r != 0)
-        DIE("failed to create thread %ld", i + 1);
-    }
-  }
+  passwand_pool_set_adaptive(pool, options.adaptive);
 
   bool shown_error = false;
 
-  // join the other threads in searching
-  void *ret = search(NULL);
-  if (ret != NULL) {
-    show_error(ret);
-    free(ret);
-    shown_error = true;
-  }
-
-  // collect threads
-  for (size_t i = 0; i < options.jobs - 1; i++) {
-    int r = pthread_join(threads[i], &ret);
-    if (r != 0) {
-      if (!shown_error) {
-        char *msg;
-        if (asprintf(&msg, "failed to join thread %ld", i + 1) >= 0) {
-          show_error(msg);
-          free(msg);
-        }
-      }
-      shown_error = true;
-    } else if (ret != NULL) {
-      if (!shown_error)
-        show_error(ret);
-      shown_error = true;
-      free(ret);
+  passwand_pipeline_stats_t stats;
+  err = passwand_entries_do(pool, mainpass, entries, entry_len, order, search,
+                            NULL, NULL, pool, &stats);
+  passwand_pool_destroy(pool);
+  if (stats.tuned != 0)
+    jobs_cache_save(options.db.work_factor, stats.tuned);
+  passwand_pipeline_stats_free(&stats);
+  if (err != PW_OK) {
+    char *msg;
+    if (asprintf(&msg, "error: %s", passwand_error(err)) >= 0) {
+      show_error(msg);
+      free(msg);
     }
+    shown_error = true;
   }
 
-  // we do not need the main password anymore
-  assert(mainpass != NULL);
-  passwand_secure_free(mainpass, strlen(mainpass) + 1);
-  mainpass = NULL;
-
-  free(threads);
-
   if (found_value == NULL && !shown_error)
     DIE("failed to find matching entry");
 
   if (shown_error) {
     if (found_value != NULL)
       passwand_secure_free(found_value, strlen(found_value) + 1);
+    passwand_secure_free(mainpass, strlen(mainpass) + 1);
+    mainpass = NULL;
     cleanup();
     return FAILURE_CODE;
   }
 
+  // Record the entry we just retrieved in the access statistics to make future
+  // look ups for it faster. This is done before displaying it, so the main
+  // password need not be kept around while the user is at the window. Note,
+  // we ignore failures here because this is not critical.
+  assert(found_index != SIZE_MAX);
+  assert(found_index < entry_len);
+  if (use_access) {
+    if (access_hit(&entries[found_index]) == 0)
+      (void)access_save(options.db.path, mainpass, options.db.work_factor,
+                        entries, entry_len);
+  }
+
+  // we do not need the main password anymore
+  assert(mainpass != NULL);
+  passwand_secure_free(mainpass, strlen(mainpass) + 1);
+  mainpass = NULL;
+
   for (size_t i = 0; i < strlen(found_value); i++) {
     if (!(supported_upper(found_value[i]) || supported_lower(found_value[i]))) {
       passwand_secure_free(found_value, strlen(found_value) + 1);
@@ -359,20 +372,6 @@ int main(int argc, char **argv) {
     return FAILURE_CODE;
   }
 
-  // Move the entry we just retrieved to the front of the list of entries to
-  // make future look ups for it faster. The idea is that over time this will
-  // result in something like a MRU ordering of entries. Note, we ignore
-  // failures during exporting because this is not critical.
-  assert(found_index != SIZE_MAX);
-  assert(found_index < entry_len);
-  if (found_index != 0) {
-    passwand_entry_t found = entries[found_index];
-    for (size_t i = found_index; i > 0; i--)
-      entries[i] = entries[i - 1];
-    entries[0] = found;
-    (void)passwand_export(options.db.path, entries, entry_len);
-  }
-
   // cleanup to make us Valgrind-free in successful runs
   cleanup();
 
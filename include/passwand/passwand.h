@@ -49,6 +49,7 @@ typedef enum {
   PW_BAD_PADDING,     // data was incorrectly padded
   PW_BAD_JSON,        // imported data did not conform to expected schema
   PW_BAD_HMAC,        // message failed authentication
+  PW_UNSUPPORTED,     // operation not supported on this platform
 } passwand_error_t;
 
 /** Translate an error code into a string
@@ -123,6 +124,24 @@ passwand_entry_do(const char *mainpass, const passwand_entry_t *e,
  */
 passwand_error_t passwand_erase(void *s, size_t len);
 
+// a region of memory
+typedef struct {
+  void *base;
+  size_t length;
+} passwand_span_t;
+
+/** Securely erase a batch of memory regions.
+ *
+ * This is equivalent to calling passwand_erase on each region, but cheaper
+ * when erasing many regions at once. NULL regions are skipped.
+ *
+ * @param spans Regions to erase
+ * @param count Number of regions
+ * @return PW_OK on success
+ */
+passwand_error_t passwand_erase_bulk(const passwand_span_t *spans,
+                                     size_t count);
+
 /** Export a list of password entries to a file.
  *
  * @param path File to export to
@@ -173,6 +192,92 @@ void passwand_secure_free(void *p, size_t size);
  */
 int passwand_secure_malloc_reset(void);
 
+/** Begin a secure arena on the calling thread.
+ *
+ * Until the matching call to passwand_secure_arena_end, secure allocations made
+ * by this thread are bump-allocated from memory owned by the arena. Freeing
+ * such an allocation with passwand_secure_free erases it, but its memory is
+ * not reused. Instead, all of the arena’s memory is erased and released
+ * together when the arena ends. Arena allocations must not be freed by another
+ * thread or used after the arena ends.
+ *
+ * Arenas can be nested, in which case the inner arena shares the memory of the
+ * outer and nothing is released until the outermost arena ends.
+ *
+ * @param size_hint Expected total size of allocations made within the arena
+ * @return 0 on success, -1 if the arena’s initial memory could not be acquired
+ */
+int passwand_secure_arena_begin(size_t size_hint);
+
+/** End a secure arena begun by passwand_secure_arena_begin, erasing and
+ * releasing its memory.
+ */
+void passwand_secure_arena_end(void);
+
+/** Reserve backing memory for the secure heap in advance.
+ *
+ * The allocator grows its backing memory in multi-page extents, each of which
+ * is locked into memory with a single system call. If you know roughly how much
+ * secure memory you will need, calling this up front avoids incremental growth.
+ * If the full amount cannot be locked at once (e.g. because of
+ * RLIMIT_MEMLOCK), smaller extents will be used. Reserved memory is retained
+ * even while it is unused, until passwand_secure_heap_trim or
+ * passwand_secure_malloc_reset is called.
+ *
+ * @param size Number of bytes to reserve
+ * @return 0 on success, -1 if the memory could not be acquired
+ */
+int passwand_secure_malloc_reserve(size_t size);
+
+/** Return unused secure heap memory to the operating system.
+ *
+ * The allocator releases backing memory incrementally as it becomes free, but
+ * retains some spare capacity to serve future allocations. This function
+ * releases all backing memory that is not currently in use, regardless of this
+ * policy. Unlike passwand_secure_malloc_reset, it can be called while
+ * allocations are outstanding.
+ *
+ * @return Number of bytes released
+ */
+size_t passwand_secure_heap_trim(void);
+
+/** Set how much spare memory the secure heap retains
+ *
+ * When a region of the secure heap’s backing memory becomes entirely free, it
+ * is released to the operating system only if at least this many free
+ * page-sized chunks would remain afterwards. Passing 0 releases memory as
+ * eagerly as possible, while SIZE_MAX disables incremental release. Memory
+ * reserved by passwand_secure_malloc_reserve is never released this way.
+ *
+ * @param chunks Number of free chunks to retain
+ * @return       The previous number of free chunks retained
+ */
+size_t passwand_secure_heap_set_spare(size_t chunks);
+
+// counters describing the behaviour of the secure heap
+typedef struct {
+  size_t in_use;             // bytes currently allocated
+  size_t high_water;         // maximum bytes ever allocated at once
+  size_t chunks;             // number of page-sized chunks backing the heap
+  size_t locked;             // bytes of backing memory currently mlocked
+  size_t allocations;        // number of successful allocations
+  size_t frees;              // number of frees
+  size_t failed_allocations; // number of allocations that returned NULL
+  size_t scan_total;         // bitmap entries examined across allocations
+  size_t scan_max;           // most bitmap entries examined in one allocation
+  size_t lock_contentions;   // lock acquisitions that had to wait
+  size_t lock_spins;         // iterations spent waiting for the lock
+} passwand_secure_heap_stats_t;
+
+/** Retrieve statistics about the secure heap
+ *
+ * The average bitmap scan length of an allocation can be derived as
+ * `scan_total / allocations`.
+ *
+ * @return A snapshot of the heap’s counters
+ */
+passwand_secure_heap_stats_t passwand_secure_heap_stats(void);
+
 /** Print the current secure heap layout
  *
  * Only implemented for debugging purposes.
@@ -188,3 +293,196 @@ void passwand_secure_heap_print(FILE *f);
  * @return            PW_OK on success
  */
 passwand_error_t passwand_random_bytes(void *buffer, uint8_t buffer_len);
+
+/** Generate an arbitrary amount of random bytes
+ *
+ * Small requests are served from a per-thread buffer in secure memory that is
+ * refilled from the operating system in larger reads, so generating several
+ * salts and IVs in a row costs a single system call.
+ *
+ * @param[out] buffer Random data
+ * @param buffer_len  Number of bytes requested
+ * @return            PW_OK on success
+ */
+passwand_error_t passwand_random_bytes_ex(void *buffer, size_t buffer_len);
+
+// a pool of worker threads
+typedef struct passwand_pool passwand_pool_t;
+
+/** Create a pool of worker threads
+ *
+ * The calling thread counts towards the pool’s size, as it participates in
+ * work run on the pool. If not all of the requested threads can be created,
+ * the pool is created with as many as could be.
+ *
+ * @param[out] pool Created pool
+ * @param jobs      Desired number of threads, including the caller
+ * @return          PW_OK on success
+ */
+passwand_error_t passwand_pool_create(passwand_pool_t **pool, size_t jobs);
+
+/** Get the number of threads in a pool, including the caller
+ *
+ * @param pool Pool to inspect
+ * @return     Number of threads
+ */
+size_t passwand_pool_size(const passwand_pool_t *pool);
+
+/** Run an action for each of a range of indices, in parallel
+ *
+ * Indices are handed out to threads in increasing order. If the action returns
+ * an error, no further indices are started and the first error is returned.
+ * Indices already in progress on other threads run to completion. The calling
+ * thread blocks until all work has finished. The action must not itself use the
+ * pool.
+ *
+ * @param pool   Pool to run on
+ * @param count  Number of indices, from 0 to count - 1
+ * @param action Action to run for each index
+ * @param state  State passed to the action
+ * @return       PW_OK if every started action succeeded, else the first error
+ */
+passwand_error_t passwand_pool_for(passwand_pool_t *pool, size_t count,
+                                   passwand_error_t (*action)(void *state,
+                                                              size_t index),
+                                   void *state);
+
+/** Stop a running passwand_pool_for from starting any further indices
+ *
+ * This is typically called from within an action that has found what it was
+ * looking for. It is not an error; passwand_pool_for still returns PW_OK if no
+ * action failed.
+ *
+ * @param pool Pool whose work to cancel
+ */
+void passwand_pool_cancel(passwand_pool_t *pool);
+
+/** Let passwand_entries_do tune how many of a pool’s threads it uses
+ *
+ * Scrypt throughput often stops growing before every CPU is in use, e.g. once
+ * threads start sharing a core or cache, and extra threads beyond that point
+ * only add contention. In adaptive mode, passwand_entries_do measures the rate
+ * at which key derivations complete and parks threads while that does not
+ * reduce it. The number of threads it settles on is reported in its
+ * statistics.
+ *
+ * @param pool     Pool to configure
+ * @param adaptive Whether to tune the number of threads used
+ */
+void passwand_pool_set_adaptive(passwand_pool_t *pool, bool adaptive);
+
+// how to place the threads of a pool on CPUs
+typedef enum {
+  PW_AFFINITY_NONE,    // leave placement to the operating system
+  PW_AFFINITY_COMPACT, // pin to neighbouring CPUs, filling each core first
+  PW_AFFINITY_SCATTER, // pin to CPUs spread across sockets and cores
+  PW_AFFINITY_NUMA,    // confine to NUMA nodes, spread round robin
+} passwand_affinity_t;
+
+/** Pin the threads of a pool to CPUs
+ *
+ * Scrypt is limited by memory bandwidth, so keeping a thread and its scratch
+ * memory on the same NUMA node matters on multi-socket machines. Memory is
+ * allocated on the node of the thread that first touches it, so pinning the
+ * threads also places their key derivation scratch. Only CPUs the calling
+ * thread may run on are used. The calling thread itself is pinned too, as it
+ * takes part in work run on the pool.
+ *
+ * @param pool     Pool whose threads to pin
+ * @param affinity Placement policy
+ * @return         PW_OK on success, or PW_UNSUPPORTED if this platform does not
+ *                 support pinning threads
+ */
+passwand_error_t passwand_pool_set_affinity(passwand_pool_t *pool,
+                                            passwand_affinity_t affinity);
+
+/** Stop the threads of a pool and free it
+ *
+ * @param pool Pool to destroy. If NULL, this is a no-op.
+ */
+void passwand_pool_destroy(passwand_pool_t *pool);
+
+// time spent on one kind of work in passwand_entries_do, summed across threads
+typedef struct {
+  uint64_t wall_ns; // elapsed time
+  uint64_t cpu_ns;  // CPU time consumed
+} passwand_time_t;
+
+// counters for one thread of passwand_entries_do
+typedef struct {
+  size_t entries;   // entries decrypted and passed to the action
+  uint64_t busy_ns; // time spent on tasks, rather than waiting or parked
+} passwand_thread_stats_t;
+
+// counters describing where time went in passwand_entries_do
+typedef struct {
+  size_t threads;      // threads that took part
+  size_t entries;      // entries decrypted and passed to the action
+  uint64_t wall_ns;    // elapsed time
+  uint64_t mac_ns;     // time spent deriving MAC keys and checking MACs
+  uint64_t key_ns;     // time spent deriving encryption keys
+  uint64_t decrypt_ns; // time spent decrypting and running the action
+  uint64_t stall_ns;   // time spent waiting for an entry ahead to complete
+  size_t tuned;        // threads chosen in adaptive mode, or 0 if undecided
+
+  // the above stages broken down by operation
+  passwand_time_t kdf;    // Scrypt key derivation, in either stage
+  passwand_time_t hmac;   // computing and comparing MACs, besides their keys
+  passwand_time_t aes;    // decrypting fields
+  passwand_time_t action; // running the action
+
+  // counters for each of `threads` threads, or NULL if out of memory
+  passwand_thread_stats_t *per_thread;
+} passwand_pipeline_stats_t;
+
+/** Free memory associated with pipeline statistics
+ *
+ * @param stats Statistics filled in by passwand_entries_do
+ */
+void passwand_pipeline_stats_free(passwand_pipeline_stats_t *stats);
+
+/** Perform an action with each of a list of decrypted entries
+ *
+ * This is equivalent to calling passwand_entry_do on each entry, but runs the
+ * two key derivations each entry needs, one to check its MAC and one to
+ * decrypt it, as separate pipeline stages on the pool’s threads. An entry is
+ * only decrypted once its MAC has been checked, but its decryption key can be
+ * derived concurrently with the check. Entries are started in order, and only
+ * a bounded number of them are in flight at once.
+ *
+ * The action may call passwand_pool_cancel to stop further entries from being
+ * started. If `proceed` is given, it is also consulted before each key
+ * derivation is started, and returning false cancels the run in the same way.
+ * This lets a caller whose work is done stop entries already handed to other
+ * threads before they pay for Scrypt, rather than after. When an entry cannot
+ * be decrypted, `on_error` is called with its index and the error. If it
+ * returns PW_OK, the remaining entries are still visited. Otherwise, or if
+ * `on_error` is NULL, no further entries are started and the first error is
+ * returned. All callbacks may be called concurrently from multiple threads.
+ *
+ * Dividing a stage’s time in `stats` by `wall_ns * threads` gives the share of
+ * the available thread time spent in that stage. If `stats` is given, it must
+ * be freed with passwand_pipeline_stats_free.
+ *
+ * @param pool      Pool to run on
+ * @param mainpass  The main passphrase
+ * @param entries   Entries to decrypt
+ * @param entry_len Number of entries
+ * @param order     Order in which to visit entries as a permutation of their
+ *                  indices, or NULL to visit them in order
+ * @param action    The user action to perform, passed the entry’s index
+ * @param on_error  Optional handler for entries that fail
+ * @param proceed   Optional check of whether to keep starting work
+ * @param state     State passed to the user action and both handlers
+ * @param[out] stats Optional counters describing the run
+ * @return          PW_OK on success
+ */
+passwand_error_t passwand_entries_do(
+    passwand_pool_t *pool, const char *mainpass,
+    const passwand_entry_t *entries, size_t entry_len, const size_t *order,
+    void (*action)(void *state, size_t index, const char *space,
+                   const char *key, const char *value),
+    passwand_error_t (*on_error)(void *state, size_t index,
+                                 passwand_error_t err),
+    bool (*proceed)(void *state), void *state,
+    passwand_pipeline_stats_t *stats);
@@ -0,0 +1,208 @@
+// Placement of threads on CPUs, according to the machine’s topology as
+// described by sysfs. This is only supported on Linux.
+
+#include "internal.h"
+#include <assert.h>
+#include <passwand/passwand.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __linux__
+
+#include <dirent.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  int id;
+  int package;      ///< physical socket
+  int core;         ///< core within the socket
+  int node;         ///< NUMA node
+  size_t sibling;   ///< index among the hardware threads of its core
+  size_t core_rank; ///< index of its core among those of its socket
+} cpu_t;
+
+/// read a single integer from a sysfs file
+///
+/// @return The value, or 0 if it could not be read
+static int read_int(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+    return 0;
+  int value = 0;
+  if (fscanf(f, "%d", &value) != 1)
+    value = 0;
+  (void)fclose(f);
+  return value;
+}
+
+/// find the NUMA node of a CPU
+///
+/// @return The node, or 0 if this is not a NUMA system
+static int node_of(int cpu) {
+  char path[64];
+  (void)snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR *d = opendir(path);
+  if (d == NULL)
+    return 0;
+
+  // the CPU’s directory contains a link named for its node
+  int node = 0;
+  for (struct dirent *e = readdir(d); e != NULL; e = readdir(d)) {
+    if (sscanf(e->d_name, "node%d", &node) == 1)
+      break;
+  }
+
+  (void)closedir(d);
+  return node;
+}
+
+/// describe the CPUs the calling thread may run on
+static passwand_error_t discover(cpu_t **cpus, size_t *cpu_len) {
+
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    return PW_IO;
+
+  cpu_t *cs = calloc((size_t)CPU_COUNT(&allowed), sizeof(cs[0]));
+  if (cs == NULL)
+    return PW_NO_MEM;
+
+  size_t len = 0;
+  for (int i = 0; i < CPU_SETSIZE; ++i) {
+    if (!CPU_ISSET(i, &allowed))
+      continue;
+    char path[96];
+    (void)snprintf(path, sizeof(path),
+                   "/sys/devices/system/cpu/cpu%d/topology/physical_package_id",
+                   i);
+    const int package = read_int(path);
+    (void)snprintf(path, sizeof(path),
+                   "/sys/devices/system/cpu/cpu%d/topology/core_id", i);
+    const int core = read_int(path);
+    cs[len++] = (cpu_t){
+        .id = i, .package = package, .core = core, .node = node_of(i)};
+  }
+
+  // rank hardware threads within their core and cores within their socket, in
+  // order of CPU number
+  for (size_t i = 0; i < len; ++i) {
+    bool new_core = true;
+    for (size_t j = 0; j < i; ++j) {
+      if (cs[j].package != cs[i].package)
+        continue;
+      if (cs[j].core == cs[i].core) {
+        ++cs[i].sibling;
+        cs[i].core_rank = cs[j].core_rank;
+        new_core = false;
+      }
+    }
+    if (new_core) {
+      for (size_t j = 0; j < i; ++j) {
+        if (cs[j].package == cs[i].package && cs[j].sibling == 0)
+          ++cs[i].core_rank;
+      }
+    }
+  }
+
+  *cpus = cs;
+  *cpu_len = len;
+  return PW_OK;
+}
+
+/// qsort comparator for filling nodes, then sockets, then cores
+static int cmp_compact(const void *a, const void *b) {
+  const cpu_t *x = a;
+  const cpu_t *y = b;
+  if (x->node != y->node)
+    return x->node < y->node ? -1 : 1;
+  if (x->package != y->package)
+    return x->package < y->package ? -1 : 1;
+  if (x->core != y->core)
+    return x->core < y->core ? -1 : 1;
+  return x->id < y->id ? -1 : x->id > y->id;
+}
+
+/// qsort comparator for using every socket, then every core, before sharing
+static int cmp_scatter(const void *a, const void *b) {
+  const cpu_t *x = a;
+  const cpu_t *y = b;
+  if (x->sibling != y->sibling)
+    return x->sibling < y->sibling ? -1 : 1;
+  if (x->core_rank != y->core_rank)
+    return x->core_rank < y->core_rank ? -1 : 1;
+  if (x->package != y->package)
+    return x->package < y->package ? -1 : 1;
+  return x->id < y->id ? -1 : x->id > y->id;
+}
+
+passwand_error_t pin_threads(const pthread_t *threads, size_t thread_len,
+                             passwand_affinity_t affinity) {
+
+  assert(threads != NULL || thread_len == 0);
+
+  if (affinity == PW_AFFINITY_NONE)
+    return PW_OK;
+
+  cpu_t *cpus = NULL;
+  size_t cpu_len = 0;
+  passwand_error_t rc = discover(&cpus, &cpu_len);
+  if (rc != PW_OK)
+    return rc;
+  if (cpu_len == 0) {
+    rc = PW_IO;
+    goto done;
+  }
+
+  qsort(cpus, cpu_len, sizeof(cpus[0]),
+        affinity == PW_AFFINITY_SCATTER ? cmp_scatter : cmp_compact);
+
+  // the distinct nodes, which are now contiguous
+  size_t node_len = 0;
+  for (size_t i = 0; i < cpu_len; ++i) {
+    if (i == 0 || cpus[i].node != cpus[i - 1].node)
+      ++node_len;
+  }
+
+  for (size_t i = 0; i < thread_len; ++i) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    if (affinity == PW_AFFINITY_NUMA) {
+      // let the thread float within the next node, round robin
+      const size_t target = i % node_len;
+      size_t node = 0;
+      for (size_t j = 0; j < cpu_len; ++j) {
+        if (j > 0 && cpus[j].node != cpus[j - 1].node)
+          ++node;
+        if (node == target)
+          CPU_SET(cpus[j].id, &set);
+      }
+    } else {
+      CPU_SET(cpus[i % cpu_len].id, &set);
+    }
+
+    if (pthread_setaffinity_np(threads[i], sizeof(set), &set) != 0) {
+      rc = PW_IO;
+      goto done;
+    }
+  }
+
+done:
+  free(cpus);
+
+  return rc;
+}
+
+#else
+
+passwand_error_t pin_threads(const pthread_t *threads __attribute__((unused)),
+                             size_t thread_len __attribute__((unused)),
+                             passwand_affinity_t affinity) {
+  return affinity == PW_AFFINITY_NONE ? PW_OK : PW_UNSUPPORTED;
+}
+
+#endif
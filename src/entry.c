@@ -25,6 +25,18 @@ static m_t *make_m_t(const char *mainpass) {
   return m;
 }
 
+/// estimate how much secure memory processing an entry will need
+static size_t arena_hint(size_t mainpass_len, size_t fields_len) {
+  // each field passes through a plain text and a packed copy, with headers and
+  // padding, alongside the main passphrase and derived key
+  const size_t overhead = 512;
+  if (SIZE_MAX / 2 < fields_len)
+    return SIZE_MAX;
+  if (SIZE_MAX - 2 * fields_len - overhead < mainpass_len)
+    return SIZE_MAX;
+  return mainpass_len + 2 * fields_len + overhead;
+}
+
 passwand_error_t passwand_entry_new(passwand_entry_t *e, const char *mainpass,
                                     const char *space, const char *key,
                                     const char *value, int work_factor) {
@@ -37,6 +49,14 @@ passwand_error_t passwand_entry_new(passwand_entry_t *e, const char *mainpass,
 
   *e = (passwand_entry_t){0};
 
+  // scope all our temporary secure allocations to this call
+  {
+    const size_t fields_len = strlen(space) + strlen(key) + strlen(value);
+    if (passwand_secure_arena_begin(
+            arena_hint(strlen(mainpass), fields_len)) != 0)
+      return PW_NO_MEM;
+  }
+
   m_t *m = NULL;
   k_t *k = NULL;
   EVP_CIPHER_CTX *ctx = NULL;
@@ -195,6 +215,7 @@ done:
     passwand_secure_free(m->data, m->length);
     passwand_secure_free(m, sizeof(*m));
   }
+  passwand_secure_arena_end();
 
   return rc;
 }
@@ -316,52 +337,50 @@ passwand_error_t passwand_entry_check_mac(const char *mainpass,
   return r ? PW_OK : PW_BAD_HMAC;
 }
 
-passwand_error_t
-passwand_entry_do(const char *mainpass, const passwand_entry_t *e,
-                  void (*action)(void *state, const char *space,
-                                 const char *key, const char *value),
-                  void *state) {
+size_t entry_arena_hint(const char *mainpass, const passwand_entry_t *e) {
+  const size_t fields_len = e->space_len + e->key_len + e->value_len;
+  return arena_hint(strlen(mainpass), fields_len);
+}
+
+passwand_error_t entry_derive_key(const char *mainpass,
+                                  const passwand_entry_t *e, k_t key) {
 
   assert(mainpass != NULL);
   assert(e != NULL);
-  assert(action != NULL);
-
-  // first check the MAC
-  {
-    passwand_error_t err = passwand_entry_check_mac(mainpass, e);
-    if (err != PW_OK)
-      return err;
-  }
 
-  m_t *m = NULL;
-  k_t *k = NULL;
-  EVP_CIPHER_CTX *ctx = NULL;
-  bool aes_decrypt_init_done = false;
-  char *space = NULL;
-  char *key = NULL;
-  char *value = NULL;
-  passwand_error_t rc = -1;
+  m_t *m = make_m_t(mainpass);
+  if (m == NULL)
+    return PW_NO_MEM;
 
-  // generate the encryption key
-  m = make_m_t(mainpass);
-  if (m == NULL) {
-    rc = PW_NO_MEM;
-    goto done;
-  }
   assert(e->salt != NULL);
   assert(e->salt_len > 0);
   salt_t salt = {
       .data = e->salt,
       .length = e->salt_len,
   };
-  k = passwand_secure_malloc(sizeof(*k));
-  if (k == NULL) {
-    rc = PW_NO_MEM;
-    goto done;
-  }
-  rc = make_key(m, &salt, e->work_factor, *k);
-  if (rc != PW_OK)
-    goto done;
+  passwand_error_t rc = make_key(m, &salt, e->work_factor, key);
+
+  passwand_secure_free(m->data, m->length);
+  passwand_secure_free(m, sizeof(*m));
+
+  return rc;
+}
+
+passwand_error_t
+entry_decrypt(const passwand_entry_t *e, const k_t k,
+              void (*action)(void *state, const char *space, const char *key,
+                             const char *value),
+              void *state) {
+
+  assert(e != NULL);
+  assert(action != NULL);
+
+  EVP_CIPHER_CTX *ctx = NULL;
+  bool aes_decrypt_init_done = false;
+  char *space = NULL;
+  char *key = NULL;
+  char *value = NULL;
+  passwand_error_t rc = -1;
 
   // extract the leading initialisation vector
   if (e->iv_len != PW_IV_LEN) {
@@ -377,7 +396,7 @@ passwand_entry_do(const char *mainpass, const passwand_entry_t *e,
     rc = PW_NO_MEM;
     goto done;
   }
-  rc = aes_decrypt_init(*k, iv, ctx);
+  rc = aes_decrypt_init(k, iv, ctx);
   if (rc != PW_OK)
     goto done;
   aes_decrypt_init_done = true;
@@ -460,7 +479,10 @@ passwand_entry_do(const char *mainpass, const passwand_entry_t *e,
   assert(key != NULL);
   assert(value != NULL);
 
+  // the action’s own secure allocations should outlive our arena
+  arena_pause();
   action(state, space, key, value);
+  arena_resume();
 
   rc = PW_OK;
 
@@ -477,12 +499,48 @@ done:
   }
   if (ctx != NULL)
     EVP_CIPHER_CTX_free(ctx);
+
+  return rc;
+}
+
+passwand_error_t
+passwand_entry_do(const char *mainpass, const passwand_entry_t *e,
+                  void (*action)(void *state, const char *space,
+                                 const char *key, const char *value),
+                  void *state) {
+
+  assert(mainpass != NULL);
+  assert(e != NULL);
+  assert(action != NULL);
+
+  // scope all our temporary secure allocations to this call
+  if (passwand_secure_arena_begin(entry_arena_hint(mainpass, e)) != 0)
+    return PW_NO_MEM;
+
+  k_t *k = NULL;
+  passwand_error_t rc = -1;
+
+  // first check the MAC
+  rc = passwand_entry_check_mac(mainpass, e);
+  if (rc != PW_OK)
+    goto done;
+
+  // generate the encryption key
+  k = passwand_secure_malloc(sizeof(*k));
+  if (k == NULL) {
+    rc = PW_NO_MEM;
+    goto done;
+  }
+  rc = entry_derive_key(mainpass, e, *k);
+  if (rc != PW_OK)
+    goto done;
+
+  rc = entry_decrypt(e, *k, action, state);
+
+done:
   if (k != NULL)
     passwand_secure_free(k, sizeof(*k));
-  if (m != NULL) {
-    passwand_secure_free(m->data, m->length);
-    passwand_secure_free(m, sizeof(*m));
-  }
+  passwand_secure_arena_end();
 
   return rc;
 }
@@ -3,6 +3,16 @@
 #include <stddef.h>
 #include <string.h>
 
+#if defined(__GLIBC__) &&                                                      \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 25))
+#define HAVE_EXPLICIT_BZERO 1
+#elif defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
+#define HAVE_EXPLICIT_BZERO 1
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 202311L
+#define HAVE_MEMSET_EXPLICIT 1
+#endif
+
+#if !defined(HAVE_EXPLICIT_BZERO) && !defined(HAVE_MEMSET_EXPLICIT)
 // Ideally, we would use memset_s for this task. However, it seems most C
 // standard libraries do not implement it :( Instead we need to rely on the
 // compiler not having enough visibility to optimise away the call to memset
@@ -11,13 +21,42 @@
 // A volatile pointer through which memset will be accessed, preventing the
 // compiler optimising its call. Idea borrowed from NetBSD.
 void *(*volatile memset_force)(void *, int, size_t) = memset;
+#endif
+
+/// zero memory in a way the compiler will not elide, without a fence
+static void erase(void *s, size_t len) {
+#if defined(HAVE_EXPLICIT_BZERO)
+  explicit_bzero(s, len);
+#elif defined(HAVE_MEMSET_EXPLICIT)
+  (void)memset_explicit(s, 0, len);
+#else
+  memset_force(s, 0, len);
+#endif
+}
 
 passwand_error_t passwand_erase(void *s, size_t len) {
 
   if (s == NULL)
     return PW_OK;
 
-  memset_force(s, 0, len);
+  erase(s, len);
+  atomic_thread_fence(memory_order_seq_cst);
+
+  return PW_OK;
+}
+
+passwand_error_t passwand_erase_bulk(const passwand_span_t *spans,
+                                     size_t count) {
+
+  if (spans == NULL)
+    return PW_OK;
+
+  for (size_t i = 0; i < count; i++) {
+    if (spans[i].base != NULL)
+      erase(spans[i].base, spans[i].length);
+  }
+
+  // one fence covers every span above
   atomic_thread_fence(memory_order_seq_cst);
 
   return PW_OK;
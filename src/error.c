@@ -32,6 +32,8 @@ const char *passwand_error(passwand_error_t err) {
     return "imported data did not conform to expected schema";
   case PW_BAD_HMAC:
     return "message failed authentication";
+  case PW_UNSUPPORTED:
+    return "operation not supported on this platform";
   }
   return NULL;
 }
@@ -4,9 +4,11 @@
 #include "types.h"
 #include <openssl/evp.h>
 #include <passwand/passwand.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 
 /** Construct a key for use in AES encryption
  *
@@ -21,6 +23,19 @@ passwand_error_t make_key(const m_t *mainkey, const salt_t *salt,
                           int work_factor, k_t key)
     __attribute__((visibility("internal")));
 
+/** Get the time the calling thread has spent in make_key
+ *
+ * @return Cumulative time since the thread started
+ */
+passwand_time_t make_key_time(void) __attribute__((visibility("internal")));
+
+/// read a clock, in nanoseconds
+static inline uint64_t clock_ns(clockid_t clock) {
+  struct timespec ts;
+  (void)clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
 /** Initialise an AES encryption context
  *
  * @param key    Encryption key
@@ -121,3 +136,83 @@ passwand_error_t encode(const uint8_t *s, size_t len, char **e)
 
 passwand_error_t decode(const char *s, uint8_t **d, size_t *len)
     __attribute__((visibility("internal")));
+
+/** Temporarily divert this thread’s secure allocations away from its arena
+ *
+ * Allocations made while paused come from the secure heap and survive the end
+ * of the arena. This is for calling out to user code that may make secure
+ * allocations of its own. Calls may be nested and must be paired with
+ * arena_resume.
+ */
+void arena_pause(void) __attribute__((visibility("internal")));
+
+/** Undo a previous call to arena_pause
+ */
+void arena_resume(void) __attribute__((visibility("internal")));
+
+/** Release the calling thread’s buffer of random bytes, if it has one
+ */
+void random_release(void) __attribute__((visibility("internal")));
+
+/** Estimate the secure memory needed to process an entry
+ *
+ * @param mainpass Main passphrase
+ * @param e        Entry to be processed
+ * @return         Suggested size hint for passwand_secure_arena_begin
+ */
+size_t entry_arena_hint(const char *mainpass, const passwand_entry_t *e)
+    __attribute__((visibility("internal")));
+
+/** Derive the key an entry’s fields are encrypted under
+ *
+ * @param mainpass Main passphrase
+ * @param e        Entry whose key to derive
+ * @param[out] key Derived key
+ * @return         PW_OK on success
+ */
+passwand_error_t entry_derive_key(const char *mainpass,
+                                  const passwand_entry_t *e, k_t key)
+    __attribute__((visibility("internal")));
+
+/** Decrypt an entry and perform an action with its fields
+ *
+ * The caller is responsible for having authenticated the entry first.
+ *
+ * @param e      Entry to decrypt
+ * @param k      Key derived by entry_derive_key
+ * @param action Action to perform
+ * @param state  State passed to the action
+ * @return       PW_OK on success
+ */
+passwand_error_t
+entry_decrypt(const passwand_entry_t *e, const k_t k,
+              void (*action)(void *state, const char *space, const char *key,
+                             const char *value),
+              void *state) __attribute__((visibility("internal")));
+
+/** Has the current work on a pool been cancelled?
+ *
+ * @param pool Pool to inspect
+ * @return     True if passwand_pool_cancel was called or an action failed
+ */
+bool pool_cancelled(passwand_pool_t *pool)
+    __attribute__((visibility("internal")));
+
+/** Should work on a pool tune how many of its threads are used?
+ *
+ * @param pool Pool to inspect
+ * @return     True if passwand_pool_set_adaptive enabled this
+ */
+bool pool_adaptive(const passwand_pool_t *pool)
+    __attribute__((visibility("internal")));
+
+/** Pin threads to CPUs
+ *
+ * @param threads    Threads to pin
+ * @param thread_len Number of threads
+ * @param affinity   Placement policy
+ * @return           PW_OK on success
+ */
+passwand_error_t pin_threads(const pthread_t *threads, size_t thread_len,
+                             passwand_affinity_t affinity)
+    __attribute__((visibility("internal")));
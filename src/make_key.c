@@ -18,6 +18,11 @@ static int scrypt_kdf(const uint8_t *passwd, size_t passwdlen,
 #include <scrypt-kdf.h>
 #endif
 
+// time the current thread has spent deriving keys
+static _Thread_local passwand_time_t spent;
+
+passwand_time_t make_key_time(void) { return spent; }
+
 passwand_error_t make_key(const m_t *mainkey, const salt_t *salt,
                           int work_factor, k_t key) {
 
@@ -34,8 +39,17 @@ passwand_error_t make_key(const m_t *mainkey, const salt_t *salt,
   static const uint32_t r = 8;
   static const uint32_t p = 1;
 
-  if (scrypt_kdf(mainkey->data, mainkey->length, salt->data, salt->length,
-                 ((uint64_t)1) << work_factor, r, p, key, AES_KEY_SIZE) != 0)
+  const uint64_t wall = clock_ns(CLOCK_MONOTONIC);
+  const uint64_t cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
+  const int rc =
+      scrypt_kdf(mainkey->data, mainkey->length, salt->data, salt->length,
+                 ((uint64_t)1) << work_factor, r, p, key, AES_KEY_SIZE);
+
+  spent.wall_ns += clock_ns(CLOCK_MONOTONIC) - wall;
+  spent.cpu_ns += clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu;
+
+  if (rc != 0)
     return PW_CRYPTO;
 
   return PW_OK;
@@ -15,11 +15,14 @@
 //    bytes). You can allocate more than this, but performance and availability
 //    will degrade. In an unprivileged environment, a process’ total secure
 //    allocation will be limited to RLIMIT_MEMLOCK.
-//  - Resource balancing. The backing memory for this allocator can only ever
-//    grow. This can effectively DoS other process activities (mprotect, mlock)
-//    if the caller does not pay attention to the high watermark of their
-//    secure allocation.
-
+//  - Precise resource balancing. Backing memory is only returned to the
+//    operating system a whole extent at a time, once the extent is entirely
+//    free and enough other free memory remains to absorb future allocations
+//    (see `passwand_secure_heap_set_spare`). A fragmented heap can therefore
+//    still hold on to memory close to its high watermark, which can
+//    effectively DoS other process activities (mprotect, mlock).
+
+#include "internal.h"
 #include <assert.h>
 #include <passwand/passwand.h>
 #include <stdatomic.h>
@@ -53,12 +56,20 @@
   } while (0)
 #endif
 
+// counters describing the heap’s behaviour, protected by the lock below
+static passwand_secure_heap_stats_t stats;
+
 // basic no-init-required spinlock implementation
 static atomic_flag l = ATOMIC_FLAG_INIT;
 static void lock(void) {
+  size_t spins = 0;
   while (atomic_flag_test_and_set_explicit(&l, memory_order_acq_rel))
-    ;
+    ++spins;
   atomic_thread_fence(memory_order_acq_rel);
+  if (spins > 0) {
+    ++stats.lock_contentions;
+    stats.lock_spins += spins;
+  }
 }
 static void unlock(void) {
   assert(atomic_flag_test_and_set(&l));
@@ -69,6 +80,12 @@ static void unlock(void) {
 // Expected hardware page size. This is checked at runtime.
 #define EXPECTED_PAGE_SIZE 4096
 
+// Bounds on the size of the regions we request from the operating system. We
+// reserve backing memory in “extents” of multiple pages so that growing the
+// heap by N pages does not cost N mlock calls.
+#define EXTENT_MIN (64 * 1024)
+#define EXTENT_MAX (1024 * 1024)
+
 // We store the allocator’s backing memory as a linked-list of “chunks,” each of
 // `EXPECTED_PAGE_SIZE` bytes. The status of the bytes within each chunk is
 // tracked per “block,” where blocks are `sizeof(long long)`. Each chunk
@@ -79,13 +96,32 @@ static void unlock(void) {
 // The `last_index` member tracks the last index of the bitmap we examined. It
 // is purely an optimisation (to resume searches for new allocations where the
 // last left off) and could be removed to simplify the implementation.
+//
+// The `used` member counts the allocated blocks in the chunk, so we can tell
+// when it becomes empty without scanning its bitmap.
 typedef struct chunk_ {
   void *base;
   uint8_t free[EXPECTED_PAGE_SIZE / sizeof(long long) / 8];
   unsigned last_index;
+  unsigned used;
+  struct extent_ *extent;
   struct chunk_ *next;
 } chunk_t;
 
+// Chunks are carved out of larger “extents” that are mapped and mlocked in a
+// single operation. Each extent owns the metadata for the chunks within it and
+// tracks how many of them are in use, so it can be released once they are all
+// free. Extents acquired by passwand_secure_malloc_reserve are “pinned,” and
+// are only released by an explicit trim or reset.
+typedef struct extent_ {
+  void *base;
+  size_t size;
+  chunk_t *chunks;
+  size_t busy;
+  bool pinned;
+  struct extent_ *next;
+} extent_t;
+
 static bool read_bitmap(chunk_t *c, unsigned index) {
   assert(c != NULL);
   assert(index < sizeof(c->free) * 8);
@@ -103,6 +139,21 @@ static void write_bitmap(chunk_t *c, unsigned index, bool value) {
 
 static chunk_t *freelist;
 
+static extent_t *extents;
+
+// the size of the next extent we will try to reserve
+static size_t extent_size = EXTENT_MIN;
+
+// the largest extent we believe we can lock, lowered when we hit
+// RLIMIT_MEMLOCK
+static size_t extent_limit = EXTENT_MAX;
+
+// number of chunks with no allocated blocks
+static size_t empty_chunks;
+
+// number of empty chunks to retain when an extent becomes free
+static size_t spare_chunks = EXTENT_MIN / EXPECTED_PAGE_SIZE;
+
 // this will only become set if the allocator detects inappropriate (potentially
 // malicious) calls
 static bool disabled;
@@ -117,24 +168,199 @@ static size_t pagesize(void) {
   return size;
 }
 
-static void *morecore(void) {
-  size_t page = pagesize();
-  if (page < EXPECTED_PAGE_SIZE)
+static size_t round_up(size_t size, size_t alignment) {
+  assert(alignment > 0);
+  if (size % alignment == 0)
+    return size;
+  if (SIZE_MAX - size < alignment - size % alignment)
+    return 0;
+  return size + (alignment - size % alignment);
+}
+
+// try to map and lock a single extent of exactly `size` bytes
+static extent_t *map_extent(size_t size) {
+
+  assert(size % EXPECTED_PAGE_SIZE == 0);
+
+  void *const p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
     return NULL;
+  if (mlock(p, size) != 0) {
+    (void)munmap(p, size);
+    return NULL;
+  }
 
-  // allocate a new mlocked page
-  void *const p = aligned_alloc(page, page);
-  if (p == NULL)
+  extent_t *const e = calloc(1, sizeof(*e));
+  if (e == NULL) {
+    int r __attribute__((unused)) = munlock(p, size);
+    assert(r == 0 && "munlock unexpectedly failed");
+    (void)munmap(p, size);
     return NULL;
-  if (mlock(p, EXPECTED_PAGE_SIZE) != 0) {
-    free(p);
+  }
+
+  const size_t chunks = size / EXPECTED_PAGE_SIZE;
+  e->chunks = calloc(chunks, sizeof(e->chunks[0]));
+  if (e->chunks == NULL) {
+    free(e);
+    int r __attribute__((unused)) = munlock(p, size);
+    assert(r == 0 && "munlock unexpectedly failed");
+    (void)munmap(p, size);
     return NULL;
   }
+  e->base = p;
+  e->size = size;
+
+  stats.chunks += chunks;
+  stats.locked += size;
+  empty_chunks += chunks;
 
   // poison the new pool, marking it initially unusable
-  POISON(p, EXPECTED_PAGE_SIZE);
+  POISON(p, size);
 
-  return p;
+  return e;
+}
+
+static void unmap_extent(extent_t *e) {
+  assert(e != NULL);
+  assert(e->busy == 0 && "releasing an extent that is in use");
+  assert(empty_chunks >= e->size / EXPECTED_PAGE_SIZE);
+  empty_chunks -= e->size / EXPECTED_PAGE_SIZE;
+  assert(stats.chunks >= e->size / EXPECTED_PAGE_SIZE);
+  stats.chunks -= e->size / EXPECTED_PAGE_SIZE;
+  assert(stats.locked >= e->size);
+  stats.locked -= e->size;
+  UNPOISON(e->base, e->size);
+  int r __attribute__((unused)) = munlock(e->base, e->size);
+  assert(r == 0 && "munlock unexpectedly failed");
+  (void)munmap(e->base, e->size);
+  free(e->chunks);
+  free(e);
+}
+
+/// acquire new backing memory
+///
+/// If the preferred extent cannot be locked (typically because it would exceed
+/// RLIMIT_MEMLOCK), we retry with progressively smaller extents down to the
+/// minimum.
+///
+/// @param minimum Number of bytes that must be acquired
+/// @param preferred Number of bytes we would like to acquire, or 0 to use the
+///   heap’s own growth policy
+/// @return The new extent, whose chunks have been added to the freelist, or
+///   NULL on failure
+static extent_t *morecore(size_t minimum, size_t preferred) {
+  size_t page = pagesize();
+  if (page < EXPECTED_PAGE_SIZE || page % EXPECTED_PAGE_SIZE != 0)
+    return NULL;
+
+  const size_t target = round_up(minimum, page);
+  if (target == 0)
+    return NULL;
+
+  size_t want = preferred;
+  if (want == 0)
+    want = extent_size < extent_limit ? extent_size : extent_limit;
+  if (want < target)
+    want = target;
+  want = round_up(want, page);
+  if (want == 0)
+    return NULL;
+
+  extent_t *e = NULL;
+  for (;;) {
+    e = map_extent(want);
+    if (e != NULL)
+      break;
+    if (want == target)
+      return NULL;
+    // we could not lock this much, so do not try to go this large again
+    want = round_up(want / 2, page);
+    if (want < target)
+      want = target;
+    if (want < extent_limit)
+      extent_limit = want;
+  }
+
+  // grow the next extent geometrically, up to our maximum
+  if (extent_size < EXTENT_MAX && want >= extent_size)
+    extent_size = want * 2 > EXTENT_MAX ? EXTENT_MAX : want * 2;
+
+  // carve the extent into chunks and make them available
+  const size_t chunks = e->size / EXPECTED_PAGE_SIZE;
+  for (size_t i = chunks; i > 0; i--) {
+    chunk_t *const c = &e->chunks[i - 1];
+    c->base = (char *)e->base + (i - 1) * EXPECTED_PAGE_SIZE;
+    c->extent = e;
+    c->next = freelist;
+    freelist = c;
+  }
+
+  e->next = extents;
+  extents = e;
+
+  return e;
+}
+
+/// return an unused extent to the operating system
+static void release_extent(extent_t *e) {
+  assert(e != NULL);
+  assert(e->busy == 0);
+
+  // remove its chunks from the freelist
+  for (chunk_t **c = &freelist; *c != NULL;) {
+    if ((*c)->extent == e) {
+      *c = (*c)->next;
+    } else {
+      c = &(*c)->next;
+    }
+  }
+
+  // remove it from the extent list
+  for (extent_t **x = &extents; *x != NULL; x = &(*x)->next) {
+    if (*x == e) {
+      *x = e->next;
+      break;
+    }
+  }
+
+  unmap_extent(e);
+}
+
+/// account for `blocks` newly allocated blocks in a chunk
+static void mark_used(chunk_t *c, unsigned blocks) {
+  assert(c != NULL);
+  assert(c->extent != NULL);
+  if (c->used == 0) {
+    assert(empty_chunks > 0);
+    --empty_chunks;
+    ++c->extent->busy;
+  }
+  c->used += blocks;
+}
+
+/// account for `blocks` newly freed blocks in a chunk, releasing its extent if
+/// this leaves us with more spare memory than we need
+static void mark_free(chunk_t *c, unsigned blocks) {
+  assert(c != NULL);
+  assert(c->extent != NULL);
+  assert(c->used >= blocks);
+  c->used -= blocks;
+  if (c->used > 0)
+    return;
+
+  ++empty_chunks;
+  extent_t *const e = c->extent;
+  assert(e->busy > 0);
+  --e->busy;
+  if (e->busy > 0 || e->pinned)
+    return;
+
+  // would we still have enough spare chunks without this extent?
+  const size_t chunks = e->size / EXPECTED_PAGE_SIZE;
+  assert(empty_chunks >= chunks);
+  if (empty_chunks - chunks >= spare_chunks)
+    release_extent(e);
 }
 
 // The following logic prevents other processes attaching to us with
@@ -154,13 +380,24 @@ static int disable_ptrace(void) {
   return r;
 }
 
+// record a successful allocation
+static void note_allocation(size_t rounded, size_t scanned) {
+  ++stats.allocations;
+  stats.in_use += rounded;
+  if (stats.in_use > stats.high_water)
+    stats.high_water = stats.in_use;
+  stats.scan_total += scanned;
+  if (scanned > stats.scan_max)
+    stats.scan_max = scanned;
+}
+
 static size_t round_size(size_t size) {
   if (size % sizeof(long long) == 0)
     return size;
   return size + (sizeof(long long) - size % sizeof(long long));
 }
 
-void *passwand_secure_malloc(size_t size) {
+static void *heap_malloc(size_t size) {
 
   if (size == 0)
     return NULL;
@@ -172,23 +409,32 @@ void *passwand_secure_malloc(size_t size) {
 
   // Do not allow allocations greater than a page. This avoids having to cope
   // with allocations that would span multiple chunks.
-  if (rounded > EXPECTED_PAGE_SIZE)
+  if (rounded > EXPECTED_PAGE_SIZE) {
+    lock();
+    ++stats.failed_allocations;
+    unlock();
     return NULL;
+  }
 
   lock();
 
   if (disabled) {
+    ++stats.failed_allocations;
     unlock();
     return NULL;
   }
 
   if (!ptrace_disabled) {
     if (disable_ptrace() != 0) {
+      ++stats.failed_allocations;
       unlock();
       return NULL;
     }
   }
 
+  // number of bitmap entries we examine while searching
+  size_t scanned = 0;
+
   for (chunk_t *n = freelist; n != NULL; n = n->next) {
 
   retry:;
@@ -198,14 +444,17 @@ void *passwand_secure_malloc(size_t size) {
 
       // look for an unset bit
       while (n->last_index < sizeof(n->free) * 8 &&
-             read_bitmap(n, n->last_index))
+             read_bitmap(n, n->last_index)) {
         n->last_index++;
+        ++scanned;
+      }
 
       // scan for `rounded` unset bits
       unsigned offset;
       for (offset = 0; offset * sizeof(long long) < rounded &&
                        n->last_index + offset < sizeof(n->free) * 8;
            offset++) {
+        ++scanned;
         if (read_bitmap(n, n->last_index + offset))
           break;
       }
@@ -214,8 +463,10 @@ void *passwand_secure_malloc(size_t size) {
         // we found enough contiguous free bits!
         for (unsigned i = 0; i * sizeof(long long) < rounded; i++)
           write_bitmap(n, n->last_index + i, true);
+        mark_used(n, rounded / sizeof(long long));
         void *const p = (char *)n->base + n->last_index * sizeof(long long);
         n->last_index += rounded / sizeof(long long);
+        note_allocation(rounded, scanned);
         unlock();
 
         // mark the memory we are handing out (only the prefix `size` not the
@@ -240,28 +491,21 @@ void *passwand_secure_malloc(size_t size) {
 
   // Did not find anything useful in the freelist. Acquire some more secure
   // memory.
-  void *const q = morecore();
-  if (q == NULL) {
+  const extent_t *const e = morecore(rounded, 0);
+  if (e == NULL) {
+    ++stats.failed_allocations;
     unlock();
     return NULL;
   }
 
-  // fill this allocation using the end of the memory just acquired
-  chunk_t *c = calloc(1, sizeof(*c));
-  if (c == NULL) {
-    int r __attribute__((unused)) = munlock(q, EXPECTED_PAGE_SIZE);
-    assert(r == 0 && "munlock unexpectedly failed");
-    free(q);
-    unlock();
-    return NULL;
-  }
-  c->base = q;
-  c->next = freelist;
-  freelist = c;
+  // fill this allocation using the end of the first chunk just acquired
+  chunk_t *const c = &e->chunks[0];
   for (unsigned index = (EXPECTED_PAGE_SIZE - rounded) / sizeof(long long);
        index < EXPECTED_PAGE_SIZE / sizeof(long long); index++)
     write_bitmap(c, index, true);
+  mark_used(c, rounded / sizeof(long long));
   void *const p = (char *)c->base + EXPECTED_PAGE_SIZE - rounded;
+  note_allocation(rounded, scanned);
 
   unlock();
 
@@ -272,7 +516,12 @@ void *passwand_secure_malloc(size_t size) {
   return p;
 }
 
-void passwand_secure_free(void *p, size_t size) {
+/// return memory to the heap
+///
+/// @param p Address of memory to free
+/// @param size Number of bytes to free
+/// @param erased Whether the caller has already securely erased this memory
+static void heap_free(void *p, size_t size, bool erased) {
 
   assert((uintptr_t)p % sizeof(long long) == 0);
 
@@ -319,8 +568,13 @@ void passwand_secure_free(void *p, size_t size) {
         }
         write_bitmap(c, index + offset, false);
       }
-      passwand_erase(p, size);
+      if (!erased)
+        passwand_erase(p, size);
       POISON(p, rounded);
+      ++stats.frees;
+      assert(stats.in_use >= rounded);
+      stats.in_use -= rounded;
+      mark_free(c, rounded / sizeof(long long));
       unlock();
       return;
     }
@@ -332,8 +586,252 @@ void passwand_secure_free(void *p, size_t size) {
   unlock();
 }
 
+// Secure arenas support the pattern of making many short-lived allocations
+// that can all be discarded together. While an arena is active on a thread,
+// that thread’s secure allocations are bump-allocated from page-sized blocks
+// acquired from the heap. Freeing one of these allocations individually erases
+// it, so secrets do not linger for the rest of the arena’s life, but does not
+// make its memory available again. When the arena ends, whatever was not
+// already erased is erased in a single batch and all the arena’s blocks are
+// returned to the heap.
+//
+// The bookkeeping for arena blocks lives in regular memory, so the blocks
+// themselves are entirely usable.
+
+// alignment of allocations handed out from an arena
+#define ARENA_ALIGN (sizeof(long long) * 2)
+
+// number of allocation units in the largest arena block
+#define ARENA_UNITS (EXPECTED_PAGE_SIZE / ARENA_ALIGN)
+
+typedef struct arena_block_ {
+  uint8_t *base;
+  size_t size;
+  size_t used;
+  uint8_t erased[ARENA_UNITS / 8]; // units already erased by a free
+  struct arena_block_ *prev;
+} arena_block_t;
+
+static _Thread_local struct {
+  arena_block_t *top; // most recently acquired block
+  size_t depth;       // nesting level of passwand_secure_arena_begin calls
+  size_t paused;      // nesting level of arena_pause calls
+} arena;
+
+static int arena_grow(size_t size) {
+  assert(size <= EXPECTED_PAGE_SIZE);
+
+  arena_block_t *const b = calloc(1, sizeof(*b));
+  if (b == NULL)
+    return -1;
+
+  b->base = heap_malloc(size);
+  if (b->base == NULL) {
+    free(b);
+    return -1;
+  }
+  b->size = size;
+  b->prev = arena.top;
+  arena.top = b;
+
+  return 0;
+}
+
+static void *arena_malloc(size_t size) {
+
+  if (size == 0)
+    return NULL;
+
+  if (SIZE_MAX - size < ARENA_ALIGN)
+    return NULL;
+  const size_t rounded = round_up(size, ARENA_ALIGN);
+  if (rounded > EXPECTED_PAGE_SIZE)
+    return NULL;
+
+  arena_block_t *b = arena.top;
+  if (b == NULL || b->size - b->used < rounded) {
+    if (arena_grow(EXPECTED_PAGE_SIZE) != 0)
+      return NULL;
+    b = arena.top;
+  }
+
+  void *const p = b->base + b->used;
+  b->used += rounded;
+  return p;
+}
+
+/// find the arena block containing a pointer, if any
+static arena_block_t *arena_block_of(const void *p) {
+  for (arena_block_t *b = arena.top; b != NULL; b = b->prev) {
+    if ((uintptr_t)p >= (uintptr_t)b->base &&
+        (uintptr_t)p < (uintptr_t)b->base + b->size)
+      return b;
+  }
+  return NULL;
+}
+
+static bool arena_is_erased(const arena_block_t *b, size_t unit) {
+  return b->erased[unit / 8] & (1u << (unit % 8));
+}
+
+/// note that an allocation within a block has been erased
+static void arena_mark_erased(arena_block_t *b, const void *p, size_t size) {
+  const size_t offset = (size_t)((uintptr_t)p - (uintptr_t)b->base);
+  const size_t first = offset / ARENA_ALIGN;
+  // the allocation’s padding was never written, so it counts as erased too
+  size_t last = first + round_up(size, ARENA_ALIGN) / ARENA_ALIGN;
+  if (last > b->used / ARENA_ALIGN)
+    last = b->used / ARENA_ALIGN;
+  for (size_t i = first; i < last; i++)
+    b->erased[i / 8] |= (uint8_t)(1u << (i % 8));
+}
+
+/// erase the contents of all arena blocks not already erased, coalescing
+/// adjacent regions
+///
+/// @return True if the blocks were erased
+static bool arena_erase(void) {
+
+  // each block contributes at most one region per pair of units
+  size_t count = 0;
+  size_t limit = 0;
+  for (const arena_block_t *b = arena.top; b != NULL; b = b->prev) {
+    ++count;
+    limit += b->used / ARENA_ALIGN / 2 + 1;
+  }
+
+  const arena_block_t **const blocks = calloc(count, sizeof(blocks[0]));
+  if (blocks == NULL)
+    return false;
+  passwand_span_t *const spans = calloc(limit, sizeof(spans[0]));
+  if (spans == NULL) {
+    free(blocks);
+    return false;
+  }
+
+  // sort the blocks by address
+  size_t n = 0;
+  for (const arena_block_t *b = arena.top; b != NULL; b = b->prev) {
+    size_t i = n;
+    for (; i > 0 && (uintptr_t)blocks[i - 1]->base > (uintptr_t)b->base; i--)
+      blocks[i] = blocks[i - 1];
+    blocks[i] = b;
+    ++n;
+  }
+
+  // Build the regions to erase from the runs of units that were not erased on
+  // free, merging runs that are contiguous in memory. A run may also be merged
+  // across the unused tail of a preceding block. This erases the tail, but that
+  // is harmless and lets us make fewer, larger erasures.
+  size_t merged = 0;
+  uintptr_t joinable = 0; // where a run may start to extend the last region
+  for (size_t i = 0; i < n; i++) {
+    const arena_block_t *const b = blocks[i];
+    const size_t units = b->used / ARENA_ALIGN;
+    for (size_t j = 0; j < units;) {
+      if (arena_is_erased(b, j)) {
+        ++j;
+        continue;
+      }
+      size_t k = j;
+      while (k < units && !arena_is_erased(b, k))
+        ++k;
+      uint8_t *const start = b->base + j * ARENA_ALIGN;
+      const size_t length = (k - j) * ARENA_ALIGN;
+      if (merged > 0 && (uintptr_t)start == joinable) {
+        passwand_span_t *const last = &spans[merged - 1];
+        last->length =
+            (size_t)((uintptr_t)start + length - (uintptr_t)last->base);
+      } else {
+        spans[merged++] = (passwand_span_t){.base = start, .length = length};
+      }
+      joinable = (uintptr_t)start + length;
+      j = k;
+    }
+    if (merged > 0 && joinable == (uintptr_t)b->base + b->used)
+      joinable = (uintptr_t)b->base + b->size;
+  }
+  assert(merged <= limit);
+
+  (void)passwand_erase_bulk(spans, merged);
+  free(spans);
+  free(blocks);
+
+  return true;
+}
+
+int passwand_secure_arena_begin(size_t size_hint) {
+
+  ++arena.depth;
+
+  // nested arenas share the outermost arena’s memory
+  if (arena.depth > 1)
+    return 0;
+
+  // eagerly acquire a first block, so the caller learns of failure early
+  size_t size = round_up(size_hint, ARENA_ALIGN);
+  if (size == 0 || size > EXPECTED_PAGE_SIZE)
+    size = EXPECTED_PAGE_SIZE;
+  if (arena_grow(size) != 0) {
+    --arena.depth;
+    return -1;
+  }
+
+  return 0;
+}
+
+void passwand_secure_arena_end(void) {
+
+  assert(arena.depth > 0 && "ending an arena that was not begun");
+  if (arena.depth == 0)
+    return;
+
+  --arena.depth;
+  if (arena.depth > 0)
+    return;
+
+  // erase the used portion of every block not yet erased in a single batch
+  bool erased = arena_erase();
+
+  // release all blocks
+  while (arena.top != NULL) {
+    arena_block_t *const b = arena.top;
+    arena.top = b->prev;
+    heap_free(b->base, b->size, erased);
+    free(b);
+  }
+}
+
+void arena_pause(void) { ++arena.paused; }
+
+void arena_resume(void) {
+  assert(arena.paused > 0);
+  --arena.paused;
+}
+
+void *passwand_secure_malloc(size_t size) {
+  if (arena.depth > 0 && arena.paused == 0)
+    return arena_malloc(size);
+  return heap_malloc(size);
+}
+
+void passwand_secure_free(void *p, size_t size) {
+  // Arena allocations are released when their arena ends, but are erased now.
+  // Record this, so the arena’s end does not erase them again.
+  arena_block_t *const b = arena.top == NULL ? NULL : arena_block_of(p);
+  if (b != NULL) {
+    passwand_erase(p, size);
+    arena_mark_erased(b, p, size);
+    return;
+  }
+  heap_free(p, size, false);
+}
+
 int passwand_secure_malloc_reset(void) {
 
+  // the random byte buffer is held for the life of the thread, so is not a leak
+  random_release();
+
   lock();
 
   if (disabled) {
@@ -352,23 +850,93 @@ int passwand_secure_malloc_reset(void) {
     }
   }
 
-  // now we can free all chunks
-  for (chunk_t *c = freelist; c != NULL;) {
-    int r __attribute__((unused)) = munlock(c->base, EXPECTED_PAGE_SIZE);
-    assert(r == 0 && "munlock unexpectedly failed");
-    free(c->base);
-    chunk_t *next = c->next;
-    free(c);
-    c = next;
+  // now we can free all extents and the chunks within them
+  for (extent_t *e = extents; e != NULL;) {
+    extent_t *next = e->next;
+    unmap_extent(e);
+    e = next;
   }
 
-  // reset the freelist head
+  // reset the list heads
   freelist = NULL;
+  extents = NULL;
+
+  // forget any sizing we learnt, as we no longer hold any locked memory
+  extent_size = EXTENT_MIN;
+  extent_limit = EXTENT_MAX;
 
   unlock();
   return 0;
 }
 
+int passwand_secure_malloc_reserve(size_t size) {
+
+  if (size == 0)
+    return 0;
+
+  lock();
+
+  if (disabled) {
+    unlock();
+    return -1;
+  }
+
+  // acquire extents until we have covered the request, accepting smaller ones
+  // if we cannot lock it all at once
+  size_t reserved = 0;
+  while (reserved < size) {
+    extent_t *const e = morecore(EXPECTED_PAGE_SIZE, size - reserved);
+    if (e == NULL) {
+      unlock();
+      return -1;
+    }
+    // keep it even while it is unused, as the caller asked for it
+    e->pinned = true;
+    reserved += e->size;
+  }
+
+  unlock();
+  return 0;
+}
+
+size_t passwand_secure_heap_trim(void) {
+
+  lock();
+
+  if (disabled) {
+    unlock();
+    return 0;
+  }
+
+  size_t released = 0;
+  for (extent_t *e = extents; e != NULL;) {
+    extent_t *const next = e->next;
+    if (e->busy == 0) {
+      released += e->size;
+      release_extent(e);
+    }
+    e = next;
+  }
+
+  unlock();
+  return released;
+}
+
+size_t passwand_secure_heap_set_spare(size_t chunks) {
+  lock();
+  const size_t previous = spare_chunks;
+  spare_chunks = chunks;
+  unlock();
+  return previous;
+}
+
+passwand_secure_heap_stats_t passwand_secure_heap_stats(void) {
+  lock();
+  const passwand_secure_heap_stats_t s = stats;
+  unlock();
+  return s;
+}
+
 void passwand_secure_heap_print(FILE *f) {
   for (chunk_t *c = freelist; c != NULL; c = c->next) {
     fprintf(f, "%p:\n", c->base);
@@ -0,0 +1,500 @@
+// A pipeline for decrypting many entries on a pool of threads.
+//
+// Each entry needs two expensive Scrypt key derivations: one for checking its
+// MAC and one for decrypting its fields. These are independent, so we treat
+// them as separate tasks, numbered 2 × position and 2 × position + 1, that
+// threads claim in order from a shared counter. Whichever thread finishes the
+// second of an entry’s tasks goes on to the cheap final stage: decrypting the
+// fields, if the MAC was good, and running the user’s action.
+//
+// The intermediate state of an entry lives in a slot of a fixed-size ring,
+// making this a bounded queue between stages. A slot is handed from one entry
+// to the entry `SLOTS` positions later using a sequence number, so handing it
+// over needs no locks unless a thread is waiting. A thread that claims a task
+// for an entry whose slot is still in use sleeps until the slot is released.
+// Because tasks are claimed in order, the entry holding the slot always has its
+// tasks running on other threads, so this cannot deadlock.
+//
+// In adaptive mode, the number of threads claiming tasks is tuned while the
+// pipeline runs. Throughput is measured over a window of completed tasks, then
+// some threads are parked and it is measured again. This continues while
+// parking threads does not make things slower. A parked thread has no task
+// claimed, so it cannot hold up the slot handover above.
+
+#include "internal.h"
+#include "types.h"
+#include <assert.h>
+#include <passwand/passwand.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef struct {
+  atomic_size_t turn;            ///< position of the entry that may use this
+  atomic_uint pending;           ///< tasks yet to complete for this entry
+  _Atomic passwand_error_t err;  ///< first failure among this entry’s tasks
+  k_t *key;                      ///< derived decryption key
+  atomic_uint waiting;           ///< threads sleeping until `turn` advances
+  pthread_cond_t released;       ///< signalled when `turn` advances
+} slot_t;
+
+// counters for one thread, only touched by that thread until the pipeline ends
+typedef struct {
+  size_t entries;
+  uint64_t busy_ns;
+  passwand_time_t kdf;
+  passwand_time_t hmac;
+  passwand_time_t aes;
+  passwand_time_t action;
+} thread_t;
+
+// tasks each active thread completes during one throughput measurement
+enum { WINDOW = 8 };
+
+// how much slower, as a percentage, fewer threads may be and still be preferred
+enum { TOLERANCE = 5 };
+
+typedef struct {
+  passwand_pool_t *pool;
+  const char *mainpass;
+  const passwand_entry_t *entries;
+  size_t entry_len;
+  const size_t *order;
+  void (*action)(void *state, size_t index, const char *space, const char *key,
+                 const char *value);
+  passwand_error_t (*on_error)(void *state, size_t index, passwand_error_t err);
+  bool (*proceed)(void *state);
+  void *state;
+
+  slot_t *slots;
+  size_t slot_len; ///< a power of 2
+
+  thread_t *threads; ///< one per thread of the pool
+
+  atomic_size_t next_task;
+
+  // utilisation counters
+  atomic_size_t entries_done;
+  atomic_uint_least64_t mac_ns;
+  atomic_uint_least64_t key_ns;
+  atomic_uint_least64_t decrypt_ns;
+  atomic_uint_least64_t stall_ns;
+
+  // adaptive thread count
+  atomic_size_t active;     ///< threads that may claim tasks
+  atomic_size_t tasks_done; ///< tasks completed so far
+  atomic_bool tuning;       ///< still searching for the best `active`?
+  pthread_mutex_t lock;     ///< for the waits below, and protects the fields
+  pthread_cond_t unparked;  ///< signalled when `active` grows or on finishing
+  bool finished;            ///< has a thread run out of work?
+  size_t settle_until;      ///< tasks to complete before the next window opens
+  size_t window_tasks;      ///< `tasks_done` when the window opened
+  uint64_t window_ns;       ///< when the window opened, or 0 if not yet open
+  double best_rate;         ///< tasks/ns with `best_active` threads
+  size_t best_active;       ///< fewest threads found not to be slower
+  size_t tuned;             ///< the chosen `active`, once tuning is done
+} pipeline_t;
+
+static uint64_t now_ns(void) { return clock_ns(CLOCK_MONOTONIC); }
+
+static uint64_t cpu_ns(void) { return clock_ns(CLOCK_THREAD_CPUTIME_ID); }
+
+typedef struct {
+  const pipeline_t *pipeline;
+  thread_t *thread;
+  size_t index;
+} trampoline_t;
+
+// juggle the calling convention of entry_decrypt to that of our action
+static void trampoline(void *state, const char *space, const char *key,
+                       const char *value) {
+  const trampoline_t *t = state;
+  const uint64_t wall = now_ns();
+  const uint64_t cpu = cpu_ns();
+  t->pipeline->action(t->pipeline->state, t->index, space, key, value);
+  t->thread->action.wall_ns += now_ns() - wall;
+  t->thread->action.cpu_ns += cpu_ns() - cpu;
+}
+
+/// the final stage, once both of an entry’s key derivations are complete
+static passwand_error_t finish(pipeline_t *p, thread_t *thread, slot_t *slot,
+                               size_t index) {
+
+  // if the action has found what it wanted, this entry no longer matters
+  if (pool_cancelled(p->pool))
+    return PW_OK;
+
+  passwand_error_t err = slot->err;
+
+  if (err == PW_OK) {
+    const passwand_entry_t *e = &p->entries[index];
+    const uint64_t start = now_ns();
+    const uint64_t cpu_start = cpu_ns();
+    const passwand_time_t action = thread->action;
+    if (passwand_secure_arena_begin(entry_arena_hint(p->mainpass, e)) != 0) {
+      err = PW_NO_MEM;
+    } else {
+      trampoline_t t = {.pipeline = p, .thread = thread, .index = index};
+      err = entry_decrypt(e, *slot->key, trampoline, &t);
+      passwand_secure_arena_end();
+    }
+    const uint64_t elapsed = now_ns() - start;
+    p->decrypt_ns += elapsed;
+    thread->busy_ns += elapsed;
+
+    // whatever was not spent in the action was spent decrypting
+    thread->aes.wall_ns += elapsed - (thread->action.wall_ns - action.wall_ns);
+    thread->aes.cpu_ns +=
+        cpu_ns() - cpu_start - (thread->action.cpu_ns - action.cpu_ns);
+
+    if (err == PW_OK) {
+      ++p->entries_done;
+      ++thread->entries;
+    }
+  }
+
+  return err;
+}
+
+/// stop tuning, settling on a number of threads
+///
+/// The caller must hold `p->lock`.
+static void settle(pipeline_t *p, size_t active) {
+  p->active = active;
+  p->tuned = active;
+  p->tuning = false;
+  (void)pthread_cond_broadcast(&p->unparked);
+}
+
+/// measure throughput and adjust the number of active threads
+static void adapt(pipeline_t *p) {
+
+  if (!p->tuning)
+    return;
+
+  // if another thread is already doing this, leave it to them
+  if (pthread_mutex_trylock(&p->lock) != 0)
+    return;
+
+  const size_t done = p->tasks_done;
+  const size_t active = p->active;
+
+  // Let tasks claimed before the last change drain, so they do not flatter the
+  // new configuration, then open a window.
+  if (!p->tuning || done < p->settle_until)
+    goto out;
+  if (p->window_ns == 0) {
+    p->window_ns = now_ns();
+    p->window_tasks = done;
+    goto out;
+  }
+  if (done - p->window_tasks < WINDOW * active)
+    goto out;
+
+  const uint64_t elapsed = now_ns() - p->window_ns;
+  const double rate =
+      (double)(done - p->window_tasks) / (double)(elapsed == 0 ? 1 : elapsed);
+
+  if (p->best_active != 0 && rate * 100 < p->best_rate * (100 - TOLERANCE)) {
+    // the threads we last parked were pulling their weight
+    settle(p, p->best_active);
+    goto out;
+  }
+
+  p->best_rate = rate;
+  p->best_active = active;
+
+  if (active == 1) {
+    settle(p, 1);
+    goto out;
+  }
+
+  // park some threads and measure again
+  const size_t step = active / 4 == 0 ? 1 : active / 4;
+  p->active = active - step;
+  p->settle_until = done + active;
+  p->window_ns = 0;
+
+out:
+  (void)pthread_mutex_unlock(&p->lock);
+}
+
+/// wait while a thread is parked
+///
+/// @return True if the thread should resume claiming tasks
+static bool park(pipeline_t *p, size_t thread) {
+  (void)pthread_mutex_lock(&p->lock);
+  while (thread >= p->active && !p->finished)
+    (void)pthread_cond_wait(&p->unparked, &p->lock);
+  const bool resume = !p->finished;
+  (void)pthread_mutex_unlock(&p->lock);
+  return resume;
+}
+
+/// sleep until a slot is released to the entry at the given position
+static void wait_turn(pipeline_t *p, slot_t *slot, size_t position) {
+  (void)pthread_mutex_lock(&p->lock);
+  ++slot->waiting;
+  while (slot->turn != position)
+    (void)pthread_cond_wait(&slot->released, &p->lock);
+  --slot->waiting;
+  (void)pthread_mutex_unlock(&p->lock);
+}
+
+/// release a slot to the entry that will next use it
+static void release_slot(pipeline_t *p, slot_t *slot, size_t position) {
+  slot->turn = position + p->slot_len;
+
+  // A waiter registers itself before checking `turn`, so either it sees the
+  // new value or we see it waiting. Taking the lock ensures it has gone to
+  // sleep before we signal it.
+  if (slot->waiting == 0)
+    return;
+  (void)pthread_mutex_lock(&p->lock);
+  (void)pthread_cond_broadcast(&slot->released);
+  (void)pthread_mutex_unlock(&p->lock);
+}
+
+/// claim and run tasks until there are none left
+static passwand_error_t run_tasks(pipeline_t *p, size_t thread) {
+
+  thread_t *me = &p->threads[thread];
+
+  for (;;) {
+
+    if (pool_cancelled(p->pool))
+      return PW_OK;
+
+    if (thread >= p->active && !park(p, thread))
+      return PW_OK;
+
+    const size_t task = atomic_fetch_add(&p->next_task, 1);
+    if (task >= 2 * p->entry_len)
+      return PW_OK;
+
+    const size_t position = task / 2;
+    const size_t index = p->order == NULL ? position : p->order[position];
+    assert(index < p->entry_len);
+    const passwand_entry_t *e = &p->entries[index];
+    slot_t *slot = &p->slots[position & (p->slot_len - 1)];
+
+    // wait for the entry ahead of us to release this slot
+    if (slot->turn != position) {
+      const uint64_t start = now_ns();
+      wait_turn(p, slot, position);
+      p->stall_ns += now_ns() - start;
+    }
+
+    // if the caller has what it needs, do not spend a key derivation on this
+    if (p->proceed != NULL && !pool_cancelled(p->pool) && !p->proceed(p->state))
+      passwand_pool_cancel(p->pool);
+
+    // Run this task. Even if we have been cancelled, we need to take part in
+    // the slot bookkeeping below so it is released for any waiters.
+    passwand_error_t err = PW_OK;
+    if (!pool_cancelled(p->pool)) {
+      const uint64_t start = now_ns();
+      const uint64_t cpu_start = cpu_ns();
+      const passwand_time_t kdf_start = make_key_time();
+      if (passwand_secure_arena_begin(entry_arena_hint(p->mainpass, e)) != 0) {
+        err = PW_NO_MEM;
+      } else {
+        if (task % 2 == 0) {
+          err = passwand_entry_check_mac(p->mainpass, e);
+        } else {
+          err = entry_derive_key(p->mainpass, e, *slot->key);
+        }
+        passwand_secure_arena_end();
+      }
+      const uint64_t elapsed = now_ns() - start;
+      const uint64_t cpu = cpu_ns() - cpu_start;
+      const passwand_time_t kdf_end = make_key_time();
+      const passwand_time_t kdf = {
+          .wall_ns = kdf_end.wall_ns - kdf_start.wall_ns,
+          .cpu_ns = kdf_end.cpu_ns - kdf_start.cpu_ns};
+      me->busy_ns += elapsed;
+      me->kdf.wall_ns += kdf.wall_ns;
+      me->kdf.cpu_ns += kdf.cpu_ns;
+      if (task % 2 == 0) {
+        p->mac_ns += elapsed;
+        // the rest of checking a MAC is computing and comparing it
+        me->hmac.wall_ns += elapsed - kdf.wall_ns;
+        me->hmac.cpu_ns += cpu - kdf.cpu_ns;
+      } else {
+        p->key_ns += elapsed;
+      }
+      ++p->tasks_done;
+      adapt(p);
+    }
+    if (err != PW_OK) {
+      passwand_error_t expected = PW_OK;
+      (void)atomic_compare_exchange_strong(&slot->err, &expected, err);
+    }
+
+    // if we were not the last of this entry’s tasks, we are done with it
+    if (atomic_fetch_sub(&slot->pending, 1) != 1)
+      continue;
+
+    err = finish(p, me, slot, index);
+
+    // reset and release the slot
+    (void)passwand_erase(*slot->key, sizeof(*slot->key));
+    slot->err = PW_OK;
+    slot->pending = 2;
+    release_slot(p, slot, position);
+
+    if (err != PW_OK && p->on_error != NULL)
+      err = p->on_error(p->state, index, err);
+    if (err != PW_OK)
+      return err;
+  }
+}
+
+/// a thread’s work loop, as an action for passwand_pool_for
+static passwand_error_t work(void *state, size_t thread) {
+
+  pipeline_t *p = state;
+  assert(p != NULL);
+
+  const passwand_error_t err = run_tasks(p, thread);
+
+  // Once any thread leaves, either there are no more tasks to claim or the work
+  // has been cancelled, so parked threads can leave too.
+  (void)pthread_mutex_lock(&p->lock);
+  p->finished = true;
+  (void)pthread_cond_broadcast(&p->unparked);
+  (void)pthread_mutex_unlock(&p->lock);
+
+  return err;
+}
+
+passwand_error_t passwand_entries_do(
+    passwand_pool_t *pool, const char *mainpass,
+    const passwand_entry_t *entries, size_t entry_len, const size_t *order,
+    void (*action)(void *state, size_t index, const char *space,
+                   const char *key, const char *value),
+    passwand_error_t (*on_error)(void *state, size_t index,
+                                 passwand_error_t err),
+    bool (*proceed)(void *state), void *state,
+    passwand_pipeline_stats_t *stats) {
+
+  assert(pool != NULL);
+  assert(mainpass != NULL);
+  assert(entries != NULL || entry_len == 0);
+  assert(action != NULL);
+
+  if (stats != NULL)
+    *stats = (passwand_pipeline_stats_t){0};
+
+  if (SIZE_MAX / 2 < entry_len)
+    return PW_OVERFLOW;
+
+  const uint64_t start = now_ns();
+  const size_t threads = passwand_pool_size(pool);
+
+  pipeline_t p = {
+      .pool = pool,
+      .mainpass = mainpass,
+      .entries = entries,
+      .entry_len = entry_len,
+      .order = order,
+      .action = action,
+      .on_error = on_error,
+      .proceed = proceed,
+      .state = state,
+      .active = threads,
+      .tuning = pool_adaptive(pool) && threads > 1,
+      .lock = PTHREAD_MUTEX_INITIALIZER,
+      .unparked = PTHREAD_COND_INITIALIZER,
+  };
+  passwand_error_t rc = PW_NO_MEM;
+  size_t slots_ready = 0; // slots whose condition variable is initialised
+
+  // Each thread has at most one task in flight and tasks are claimed in order,
+  // so twice as many slots as threads means we should rarely need to wait.
+  p.slot_len = 1;
+  while (p.slot_len < 2 * threads)
+    p.slot_len *= 2;
+
+  p.threads = calloc(threads, sizeof(p.threads[0]));
+  if (p.threads == NULL)
+    goto done;
+
+  p.slots = calloc(p.slot_len, sizeof(p.slots[0]));
+  if (p.slots == NULL)
+    goto done;
+  for (size_t i = 0; i < p.slot_len; ++i) {
+    p.slots[i].turn = i;
+    p.slots[i].pending = 2;
+    p.slots[i].err = PW_OK;
+    if (pthread_cond_init(&p.slots[i].released, NULL) != 0)
+      goto done;
+    ++slots_ready;
+    p.slots[i].key = passwand_secure_malloc(sizeof(*p.slots[i].key));
+    if (p.slots[i].key == NULL)
+      goto done;
+  }
+
+  rc = passwand_pool_for(pool, threads, work, &p);
+
+done:
+  if (p.slots != NULL) {
+    for (size_t i = 0; i < p.slot_len; ++i) {
+      if (p.slots[i].key != NULL)
+        passwand_secure_free(p.slots[i].key, sizeof(*p.slots[i].key));
+    }
+    for (size_t i = 0; i < slots_ready; ++i)
+      (void)pthread_cond_destroy(&p.slots[i].released);
+  }
+  free(p.slots);
+  (void)pthread_cond_destroy(&p.unparked);
+  (void)pthread_mutex_destroy(&p.lock);
+
+  if (stats != NULL) {
+    *stats = (passwand_pipeline_stats_t){
+        .threads = threads,
+        .entries = p.entries_done,
+        .wall_ns = now_ns() - start,
+        .mac_ns = p.mac_ns,
+        .key_ns = p.key_ns,
+        .decrypt_ns = p.decrypt_ns,
+        .stall_ns = p.stall_ns,
+        .tuned = p.tuned,
+    };
+
+    // total the per-thread counters, and pass them on to the caller
+    if (p.threads != NULL) {
+      stats->per_thread = calloc(threads, sizeof(stats->per_thread[0]));
+      for (size_t i = 0; i < threads; ++i) {
+        const thread_t *t = &p.threads[i];
+#define ADD(field)                                                             \
+  do {                                                                         \
+    stats->field.wall_ns += t->field.wall_ns;                                  \
+    stats->field.cpu_ns += t->field.cpu_ns;                                    \
+  } while (0)
+        ADD(kdf);
+        ADD(hmac);
+        ADD(aes);
+        ADD(action);
+#undef ADD
+        if (stats->per_thread != NULL)
+          stats->per_thread[i] = (passwand_thread_stats_t){
+              .entries = t->entries, .busy_ns = t->busy_ns};
+      }
+    }
+  }
+  free(p.threads);
+
+  return rc;
+}
+
+void passwand_pipeline_stats_free(passwand_pipeline_stats_t *stats) {
+  if (stats == NULL)
+    return;
+  free(stats->per_thread);
+  stats->per_thread = NULL;
+}
@@ -0,0 +1,241 @@
+#include "internal.h"
+#include <assert.h>
+#include <passwand/passwand.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+struct passwand_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t work; ///< signalled when work is posted or on shutdown
+  pthread_cond_t idle; ///< signalled when the last worker finishes its work
+
+  pthread_t *threads;
+  size_t thread_len; ///< number of threads, excluding the caller
+  bool adaptive;     ///< park threads that do not improve throughput?
+
+  // state protected by `lock`
+  uint64_t generation; ///< incremented each time work is posted
+  size_t busy;         ///< threads yet to finish the current work
+  bool shutdown;
+
+  // the current work, constant while it is running
+  size_t count;
+  passwand_error_t (*action)(void *state, size_t index);
+  void *state;
+
+  // progress through the current work
+  atomic_size_t next;
+  atomic_bool cancelled;
+  _Atomic passwand_error_t error;
+};
+
+/// claim and run indices until the current work is exhausted or cancelled
+static void run(passwand_pool_t *pool) {
+  for (;;) {
+
+    if (pool->cancelled)
+      break;
+
+    size_t index = atomic_fetch_add(&pool->next, 1);
+    if (index >= pool->count)
+      break;
+
+    passwand_error_t err = pool->action(pool->state, index);
+    if (err != PW_OK) {
+      passwand_error_t expected = PW_OK;
+      (void)atomic_compare_exchange_strong(&pool->error, &expected, err);
+      pool->cancelled = true;
+      break;
+    }
+  }
+}
+
+static void *worker(void *arg) {
+  passwand_pool_t *pool = arg;
+  assert(pool != NULL);
+
+  uint64_t seen = 0;
+
+  (void)pthread_mutex_lock(&pool->lock);
+  for (;;) {
+
+    while (!pool->shutdown && pool->generation == seen)
+      (void)pthread_cond_wait(&pool->work, &pool->lock);
+    if (pool->shutdown)
+      break;
+    seen = pool->generation;
+
+    (void)pthread_mutex_unlock(&pool->lock);
+    run(pool);
+    (void)pthread_mutex_lock(&pool->lock);
+
+    assert(pool->busy > 0);
+    --pool->busy;
+    if (pool->busy == 0)
+      (void)pthread_cond_signal(&pool->idle);
+  }
+  (void)pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+passwand_error_t passwand_pool_create(passwand_pool_t **pool, size_t jobs) {
+
+  assert(pool != NULL);
+
+  passwand_pool_t *p = NULL;
+  bool lock_inited = false;
+  bool work_inited = false;
+  bool idle_inited = false;
+  passwand_error_t rc = PW_NO_MEM;
+
+  p = calloc(1, sizeof(*p));
+  if (p == NULL)
+    goto done;
+
+  if (pthread_mutex_init(&p->lock, NULL) != 0)
+    goto done;
+  lock_inited = true;
+
+  if (pthread_cond_init(&p->work, NULL) != 0)
+    goto done;
+  work_inited = true;
+
+  if (pthread_cond_init(&p->idle, NULL) != 0)
+    goto done;
+  idle_inited = true;
+
+  if (jobs > 1) {
+    p->threads = calloc(jobs - 1, sizeof(p->threads[0]));
+    if (p->threads == NULL)
+      goto done;
+  }
+
+  // Start as many threads as we can. Failing to create one, e.g. because of
+  // resource limits, just means running with less parallelism.
+  for (size_t i = 0; i + 1 < jobs; ++i) {
+    if (pthread_create(&p->threads[i], NULL, worker, p) != 0)
+      break;
+    ++p->thread_len;
+  }
+
+  *pool = p;
+  p = NULL;
+  rc = PW_OK;
+
+done:
+  if (p != NULL) {
+    free(p->threads);
+    if (idle_inited)
+      (void)pthread_cond_destroy(&p->idle);
+    if (work_inited)
+      (void)pthread_cond_destroy(&p->work);
+    if (lock_inited)
+      (void)pthread_mutex_destroy(&p->lock);
+    free(p);
+  }
+
+  return rc;
+}
+
+size_t passwand_pool_size(const passwand_pool_t *pool) {
+  assert(pool != NULL);
+  return pool->thread_len + 1;
+}
+
+passwand_error_t passwand_pool_for(passwand_pool_t *pool, size_t count,
+                                   passwand_error_t (*action)(void *state,
+                                                              size_t index),
+                                   void *state) {
+
+  assert(pool != NULL);
+  assert(action != NULL);
+
+  // post the work to the other threads
+  (void)pthread_mutex_lock(&pool->lock);
+  assert(pool->busy == 0 && "nested or concurrent use of a pool");
+  pool->count = count;
+  pool->action = action;
+  pool->state = state;
+  pool->next = 0;
+  pool->cancelled = false;
+  pool->error = PW_OK;
+  pool->busy = pool->thread_len;
+  ++pool->generation;
+  (void)pthread_cond_broadcast(&pool->work);
+  (void)pthread_mutex_unlock(&pool->lock);
+
+  // join in ourselves
+  run(pool);
+
+  // wait for the other threads to finish
+  (void)pthread_mutex_lock(&pool->lock);
+  while (pool->busy > 0)
+    (void)pthread_cond_wait(&pool->idle, &pool->lock);
+  (void)pthread_mutex_unlock(&pool->lock);
+
+  return pool->error;
+}
+
+bool pool_cancelled(passwand_pool_t *pool) {
+  assert(pool != NULL);
+  return pool->cancelled;
+}
+
+void passwand_pool_set_adaptive(passwand_pool_t *pool, bool adaptive) {
+  assert(pool != NULL);
+  pool->adaptive = adaptive;
+}
+
+bool pool_adaptive(const passwand_pool_t *pool) {
+  assert(pool != NULL);
+  return pool->adaptive;
+}
+
+void passwand_pool_cancel(passwand_pool_t *pool) {
+  assert(pool != NULL);
+  pool->cancelled = true;
+}
+
+passwand_error_t passwand_pool_set_affinity(passwand_pool_t *pool,
+                                            passwand_affinity_t affinity) {
+
+  assert(pool != NULL);
+
+  // the calling thread takes the first placement, then the pool’s threads
+  pthread_t *threads = calloc(pool->thread_len + 1, sizeof(threads[0]));
+  if (threads == NULL)
+    return PW_NO_MEM;
+  threads[0] = pthread_self();
+  for (size_t i = 0; i < pool->thread_len; ++i)
+    threads[i + 1] = pool->threads[i];
+
+  passwand_error_t rc = pin_threads(threads, pool->thread_len + 1, affinity);
+  free(threads);
+
+  return rc;
+}
+
+void passwand_pool_destroy(passwand_pool_t *pool) {
+
+  if (pool == NULL)
+    return;
+
+  (void)pthread_mutex_lock(&pool->lock);
+  pool->shutdown = true;
+  (void)pthread_cond_broadcast(&pool->work);
+  (void)pthread_mutex_unlock(&pool->lock);
+
+  for (size_t i = 0; i < pool->thread_len; ++i)
+    (void)pthread_join(pool->threads[i], NULL);
+
+  free(pool->threads);
+  (void)pthread_cond_destroy(&pool->idle);
+  (void)pthread_cond_destroy(&pool->work);
+  (void)pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
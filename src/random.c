@@ -1,11 +1,15 @@
 // Note that we avoid OpenSSL’s RAND_bytes because it does not contain as much
 // entropy as it claims (https://eprint.iacr.org/2016/367).
 
+#include "internal.h"
 #include <assert.h>
 #include <errno.h>
 #include <passwand/passwand.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #ifdef __linux__
@@ -26,34 +30,157 @@ static ssize_t getrandom(void *buf, size_t buflen, unsigned flags) {
 #endif
 #endif
 
-passwand_error_t passwand_random_bytes(void *buffer, uint8_t buffer_len) {
-
-  assert(buffer != NULL);
-
 #if defined(__APPLE__) || defined(__DragonFly__) || defined(__FreeBSD__) ||    \
     defined(__NetBSD__)
 
+// arc4random is already a buffered generator in user space, so we use it as is
+
+passwand_error_t passwand_random_bytes_ex(void *buffer, size_t buffer_len) {
+
+  assert(buffer != NULL || buffer_len == 0);
+
   arc4random_buf(buffer, buffer_len);
   return PW_OK;
+}
+
+void random_release(void) {}
 
 #elif defined(__linux__) && LINUX_VERSION_CODE >= KERNEL_VERSION(3, 17, 0)
 
-  ssize_t r;
-  do {
-    r = getrandom(buffer, buffer_len, 0);
-  } while (r < 0 && errno == EAGAIN);
+// Each getrandom() call is a system call, so small requests, like the several
+// salts and IVs of a new entry, are served from a per-thread buffer that is
+// refilled in larger reads. The buffer is in secure memory and bytes are
+// erased from it as they are handed out, so a later memory disclosure does not
+// reveal earlier random data.
+
+// bytes read from the kernel at once
+enum { BUFFER_SIZE = 1024 };
+
+static _Thread_local struct {
+  unsigned char *data; ///< secure buffer, or NULL if not yet allocated
+  size_t start;        ///< offset of the first unused byte
+} reserve;
+
+// key whose destructor frees each thread’s buffer when the thread exits
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+static int key_error;
+
+/// release a buffer, called on thread exit
+static void destroy(void *data) {
+  if (data != NULL)
+    passwand_secure_free(data, BUFFER_SIZE);
+}
+
+/// discard buffered bytes in a forked child, so it does not repeat its parent
+static void discard(void) {
+  if (reserve.data == NULL)
+    return;
+  (void)passwand_erase(reserve.data, BUFFER_SIZE);
+  reserve.start = BUFFER_SIZE;
+}
+
+static void create_key(void) {
+  key_error = pthread_key_create(&key, destroy);
+  if (key_error == 0)
+    key_error = pthread_atfork(NULL, NULL, discard);
+}
+
+/// read directly from the kernel
+static passwand_error_t fill(void *buffer, size_t buffer_len) {
+
+  unsigned char *p = buffer;
+
+  // large reads may be cut short by a signal, so loop until we have enough
+  while (buffer_len > 0) {
+    const ssize_t r = getrandom(p, buffer_len, 0);
+    if (r < 0 && (errno == EAGAIN || errno == EINTR))
+      continue;
+    if (r < 0)
+      return PW_IO;
+    assert((size_t)r <= buffer_len &&
+           "unexpected number of bytes from getrandom()");
+    p += r;
+    buffer_len -= (size_t)r;
+  }
 
-  if (r < 0)
-    return PW_IO;
+  return PW_OK;
+}
+
+/// refill this thread’s buffer
+static passwand_error_t refill(void) {
+
+  if (reserve.data == NULL) {
+    if (pthread_once(&key_once, create_key) != 0 || key_error != 0)
+      return PW_IO;
+
+    // the buffer outlives any arena this thread is in
+    arena_pause();
+    unsigned char *data = passwand_secure_malloc(BUFFER_SIZE);
+    arena_resume();
+    if (data == NULL)
+      return PW_NO_MEM;
+
+    if (pthread_setspecific(key, data) != 0) {
+      passwand_secure_free(data, BUFFER_SIZE);
+      return PW_IO;
+    }
+    reserve.data = data;
+  }
+
+  const passwand_error_t err = fill(reserve.data, BUFFER_SIZE);
+  if (err != PW_OK)
+    return err;
+  reserve.start = 0;
+
+  return PW_OK;
+}
 
-  assert(r <= UINT8_MAX && (uint8_t)r == buffer_len &&
-         "unexpected number of bytes from getrandom()");
+passwand_error_t passwand_random_bytes_ex(void *buffer, size_t buffer_len) {
+
+  assert(buffer != NULL || buffer_len == 0);
+
+  // large requests gain nothing from going through the buffer
+  if (buffer_len >= BUFFER_SIZE)
+    return fill(buffer, buffer_len);
+
+  unsigned char *p = buffer;
+  while (buffer_len > 0) {
+
+    if (reserve.data == NULL || reserve.start == BUFFER_SIZE) {
+      // if we cannot buffer, fall back to reading directly
+      if (refill() != PW_OK)
+        return fill(p, buffer_len);
+    }
+
+    size_t n = BUFFER_SIZE - reserve.start;
+    if (n > buffer_len)
+      n = buffer_len;
+    memcpy(p, &reserve.data[reserve.start], n);
+    (void)passwand_erase(&reserve.data[reserve.start], n);
+    reserve.start += n;
+    p += n;
+    buffer_len -= n;
+  }
 
   return PW_OK;
+}
+
+void random_release(void) {
+  if (reserve.data == NULL)
+    return;
+  (void)pthread_setspecific(key, NULL);
+  passwand_secure_free(reserve.data, BUFFER_SIZE);
+  reserve.data = NULL;
+  reserve.start = 0;
+}
 
 #else
 
 #error no usable kernel API for generating random data
 
 #endif
+
+passwand_error_t passwand_random_bytes(void *buffer, uint8_t buffer_len) {
+  return passwand_random_bytes_ex(buffer, buffer_len);
 }
@@ -4,12 +4,22 @@
 Framework for writing integration tests.
 '''
 
+import contextlib
+import fcntl
+import hashlib
+import http.server
 import itertools
 import json
+import os
 import re
+import shutil
+import socket
+import ssl
 import subprocess
 import sys
 import tempfile
+import threading
+import time
 from pathlib import Path
 from typing import Iterable, List, Union
 import pexpect
@@ -378,6 +388,153 @@ def test_generate_long(tmp_path: Path, multithreaded: bool):
   # The value should exhibit some basic variation.
   assert any(x != v[0] for x in v[1:10])
 
+@pytest.mark.parametrize('multithreaded', (False, True))
+def test_generate_policy(tmp_path: Path, multithreaded: bool):
+  '''
+  Test generation of a password from a given alphabet with required classes.
+  '''
+  data = tmp_path / 'generate_policy.json'
+
+  # Request a password from a small alphabet, so each class is unlikely to
+  # appear by chance in every attempt.
+  args = ['generate', '--data', str(data), '--space', 'foo', '--key', 'bar',
+          '--charset', 'a-f0-3!', '--no-ambiguous', '--require',
+          'lower,digit', '--require', 'symbol', '--length', '5']
+  if not multithreaded:
+    args += ['--jobs', '1']
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+  type_password_with_confirmation(p, 'test')
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus == 0
+
+  args = ['get', '--data', str(data), '--space', 'foo', '--key', 'bar']
+  if not multithreaded:
+    args += ['--jobs', '1']
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+  type_password(p, 'test')
+  v = p.read().strip()
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus == 0
+
+  # the value should only use the allowed characters, 0 and 1 being ambiguous
+  assert len(v) == 5
+  assert re.match(b'[a-f23!]+$', v) is not None
+  assert re.search(b'[a-f]', v) is not None
+  assert re.search(b'[23]', v) is not None
+  assert b'!' in v
+
+@pytest.mark.parametrize('args', (
+  ('--charset', 'a-z', '--require', 'digit'),
+  ('--charset', '01', '--no-ambiguous'),
+  ('--require', 'lower,upper,digit', '--length', '2'),
+))
+def test_generate_impossible_policy(tmp_path: Path, args: Iterable[str]):
+  '''
+  Test generation refuses a policy no password can meet.
+  '''
+  data = tmp_path / 'generate_impossible_policy.json'
+
+  p = pexpect.spawn('pw-cli', ['generate', '--data', str(data), '--space',
+                               'foo', '--key', 'bar'] + list(args),
+                    timeout=120)
+  type_password_with_confirmation(p, 'test')
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus != 0
+  assert not data.exists()
+
+@pytest.mark.parametrize('multithreaded', (False, True))
+def test_generate_count(tmp_path: Path, multithreaded: bool):
+  '''
+  Test generation of several entries at once.
+  '''
+  data = tmp_path / 'generate_count.json'
+  do_set(data, 'test', 'other', 'bar', 'baz', multithreaded)
+
+  args = ['generate', '--data', str(data), '--space-prefix', 'foo', '--key',
+          'bar', '--count', '12']
+  if not multithreaded:
+    args += ['--jobs', '1']
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+  type_password_with_confirmation(p, 'test')
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus == 0
+
+  # the new entries should come first, in order
+  do_list(data, 'test', [(f'foo{i}', 'bar') for i in range(1, 13)] +
+                        [('other', 'bar')])
+
+  # each should have its own password
+  args = ['get', '--data', str(data), '--space', 'foo1', '--key', 'bar']
+  for i in range(2, 13):
+    args += ['--space', f'foo{i}', '--key', 'bar']
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+  type_password(p, 'test')
+  values = p.read().split()
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus == 0
+  assert len(values) == 12
+  assert len(set(values)) == 12
+
+  # generating over an existing entry should fail without writing anything
+  with open(data, 'rt') as f:
+    reference = f.read()
+  args = ['generate', '--data', str(data), '--space-prefix', 'foo', '--key',
+          'bar', '--count', '20']
+  if not multithreaded:
+    args += ['--jobs', '1']
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+  type_password_with_confirmation(p, 'test')
+  p.expect('an entry for foo[0-9]+/bar already exists')
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus != 0
+  with open(data, 'rt') as f:
+    assert f.read() == reference
+
+@pytest.mark.parametrize('args,error', (
+  (('--key', 'bar'), 'missing required argument --space'),
+  (('--space', 'foo', '--space-prefix', 'foo', '--key', 'bar'),
+   '--space and --space-prefix cannot be given together'),
+  (('--space', 'foo', '--key', 'bar', '--count', '2'),
+   '--count greater than 1 requires --space-prefix'),
+  (('--space', 'foo', '--key', 'bar', '--charset', 'z-a'),
+   'invalid argument to --charset'),
+  (('--space', 'foo', '--key', 'bar', '--require', 'lower,vowel'),
+   'invalid argument to --require'),
+))
+def test_generate_bad_arguments(tmp_path: Path, args: Iterable[str],
+                                error: str):
+  '''
+  Test generate rejects invalid combinations of arguments.
+  '''
+  data = tmp_path / 'generate_bad_arguments.json'
+
+  p = pexpect.spawn('pw-cli', ['generate', '--data', str(data)] + list(args),
+                    timeout=120)
+  p.expect(re.escape(error))
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus != 0
+
+def test_generate_irrelevant(tmp_path: Path):
+  '''
+  Test password generation options are rejected by other commands.
+  '''
+  data = tmp_path / 'generate_irrelevant.json'
+
+  args = ['set', '--data', str(data), '--space', 'foo', '--key', 'bar',
+          '--value', 'baz', '--count', '2']
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+  p.expect('irrelevant argument --count')
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus != 0
+
 @pytest.mark.parametrize('multithreaded', (False, True))
 def test_change_main_empty(tmp_path: Path, multithreaded: bool):
   '''
@@ -532,6 +689,124 @@ def test_change_main_basic(tmp_path: Path, multithreaded: bool):
   # Request retrieval of the entry again, but use the new password.
   do_get(data, 'test2', 'space', 'key', 'value', multithreaded)
 
+def do_change_main(db: Path, old: str, new: str, multithreaded: bool = False):
+  '''
+  Run a change-main operation, returning its exit status and output.
+  '''
+  args = ['change-main', '--data', str(db)]
+  if not multithreaded:
+    args += ['--jobs', '1']
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+  type_password(p, old)
+  p.expect('new main password: ')
+  p.sendline(new)
+  p.expect('confirm new main password: ')
+  p.sendline(new)
+  p.expect(pexpect.EOF)
+  p.close()
+  return p.exitstatus, p.before.decode('utf-8')
+
+@pytest.mark.parametrize('multithreaded', (False, True))
+def test_change_main_resume(tmp_path: Path, multithreaded: bool):
+  '''
+  Test an interrupted change of main password can be resumed.
+  '''
+  data = tmp_path / 'change_main_resume.json'
+  shadow = tmp_path / 'change_main_resume.json.rekey'
+
+  for i in range(3):
+    do_set(data, 'test', 'space', f'key{i}', f'value{i}', multithreaded)
+
+  # append an entry under a different password, that will cause change-main to
+  # fail when it reaches it
+  bad = tmp_path / 'change_main_resume_bad.json'
+  do_set(bad, 'other', 'space', 'bad', 'value', multithreaded)
+  with open(data, 'rt') as f:
+    entries = json.load(f)
+  with open(bad, 'rt') as f:
+    entries += json.load(f)
+  with open(data, 'wt') as f:
+    json.dump(entries, f)
+
+  with open(data, 'rb') as f:
+    original = f.read()
+
+  status, output = do_change_main(data, 'test', 'test2', multithreaded)
+  assert status != 0
+  assert 'progress saved' in output
+
+  # the database should be untouched, but progress saved alongside it
+  with open(data, 'rb') as f:
+    assert f.read() == original
+  with open(shadow, 'rt') as f:
+    assert len(json.load(f)) == 4, 'incorrect checkpoint'
+
+  # running again should pick up where we left off
+  status, output = do_change_main(data, 'test', 'test2', multithreaded)
+  assert status != 0
+  assert 'resuming from entry 3 of 4' in output
+
+  # changing to a different password should not use the earlier progress
+  status, output = do_change_main(data, 'test', 'test3', multithreaded)
+  assert status != 0
+  assert 'resuming' not in output
+  assert 'ignoring progress' in output
+
+@pytest.mark.parametrize('multithreaded', (False, True))
+def test_change_main_resume_wrong_password(tmp_path: Path, multithreaded: bool):
+  '''
+  Test resuming a change of main password with a main password that does not
+  match the entries already re-encrypted is refused.
+  '''
+  data = tmp_path / 'change_main_resume_wrong_password.json'
+
+  for i in range(3):
+    do_set(data, 'test', 'space', f'key{i}', f'value{i}', multithreaded)
+
+  # append an entry under a different password, that will cause change-main to
+  # fail when it reaches it
+  bad = tmp_path / 'change_main_resume_wrong_password_bad.json'
+  do_set(bad, 'other', 'space', 'bad', 'value', multithreaded)
+  with open(data, 'rt') as f:
+    entries = json.load(f)
+  with open(bad, 'rt') as f:
+    entries += json.load(f)
+  with open(data, 'wt') as f:
+    json.dump(entries, f)
+
+  with open(data, 'rb') as f:
+    original = f.read()
+
+  status, output = do_change_main(data, 'test', 'test2', multithreaded)
+  assert status != 0
+  assert 'progress saved' in output
+
+  # resuming with the password of the remaining entry should not skip over the
+  # entries it cannot decrypt
+  status, output = do_change_main(data, 'other', 'test2', multithreaded)
+  assert status != 0, 'change-main resumed with the wrong password'
+  assert 'resuming' not in output
+  assert 'failed to resume' in output
+
+  with open(data, 'rb') as f:
+    assert f.read() == original, 'corrupted database was modified'
+
+def test_change_main_no_shadow(tmp_path: Path):
+  '''
+  Test a successful change of main password leaves no progress behind.
+  '''
+  data = tmp_path / 'change_main_no_shadow.json'
+  shadow = tmp_path / 'change_main_no_shadow.json.rekey'
+
+  for i in range(2):
+    do_set(data, 'test', 'space', f'key{i}', f'value{i}')
+
+  status, _ = do_change_main(data, 'test', 'test2')
+  assert status == 0
+  assert not shadow.exists()
+
+  do_get(data, 'test2', 'space', 'key0', 'value0')
+
 @pytest.mark.parametrize('multithreaded', (False, True))
 def test_list_empty(tmp_path: Path, multithreaded: bool):
   '''
@@ -912,85 +1187,629 @@ def test_cmd_differing_work_factor(tmp_path: Path, multithreaded: bool,
     elif args[0] in ('generate', 'set'):
       type_password_with_confirmation(p, 'test')
     else:
-      type_password(p, 'test')
+      type_password(p, 'test')
+    p.expect(pexpect.EOF)
+    p.close()
+
+    if args[0] != 'get': # allow `get` to succeed because it can early exit
+      assert p.exitstatus != 0, 'command incorrectly succeeded'
+
+    with open(combined, 'rt') as f:
+      content = f.read()
+    assert content == reference, 'corrupted database was modified'
+
+@pytest.mark.parametrize('target', (0, 1, 2))
+@pytest.mark.parametrize('multithreaded', (False, True))
+def test_set(tmp_path: Path, target: int, multithreaded: bool):
+  '''
+  Test trying to overwrite one of a set of three entries.
+  '''
+  data = tmp_path / 'set_xxx.json'
+
+  # Setup a database with three entries.
+  for i in range(3):
+
+    # Request to save a key and value.
+    do_set(data, 'test', f'space{i}', f'key{i}', f'value{i}', multithreaded)
+
+  # Now try to overwrite the 'target'-th entry.
+  args = ['set', '--data', str(data), '--space', f'space{target}', '--key',
+          f'key{target}', '--value', 'valuenew']
+  if not multithreaded:
+    args += ['--jobs', '1']
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+
+  # Enter the main password.
+  type_password_with_confirmation(p, 'test')
+
+  # Now passwand should exit with failure.
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus != 0
+
+  # Now retrieve each value.
+  for i in range(3):
+    do_get(data, 'test', f'space{i}', f'key{i}', f'value{i}', multithreaded)
+
+@pytest.mark.parametrize('multithreaded', (False, True))
+def test_list_standard(tmp_path: Path, multithreaded: bool):
+  '''
+  Test list of ten entries.
+  '''
+  data = tmp_path / 'list_standard.json'
+
+  # Request to save 10 keys and values.
+  for i in range(10):
+    do_set(data, 'test', f'space{i}', f'key{i}', f'value{i}', multithreaded)
+
+  # Now request to list the database.
+  args = ['list', '--data', str(data)]
+  if not multithreaded:
+    args += ['--jobs', '1']
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+
+  # Enter the main password.
+  type_password(p, 'test')
+
+  # Scan the entries we get.
+  output = p.read()
+  seen = set()
+  for line in output.decode('utf-8', 'replace').strip().splitlines():
+    m = re.match(r'^space(\d+)/key\1', line)
+    assert m is not None, 'unexpected entry received from \'list\''
+    i = int(m.group(1))
+    assert i not in seen, 'duplicate entry in list'
+    seen.add(i)
+  assert seen == set(range(10)), 'incorrect list of entries'
+
+  # List should exit with success.
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus == 0
+
+def test_access_stats(tmp_path: Path):
+  '''
+  Test look ups record access statistics without rewriting the database.
+  '''
+  data = tmp_path / 'access_stats.json'
+  sidecar = tmp_path / 'access_stats.json.access'
+
+  for i in range(3):
+    do_set(data, 'test', f'space{i}', f'key{i}', f'value{i}')
+
+  with open(data, 'rb') as f:
+    original = f.read()
+
+  # a look up should create the statistics sidecar
+  do_get(data, 'test', 'space0', 'key0', 'value0')
+  assert sidecar.exists()
+
+  # the sidecar should be encrypted
+  with open(sidecar, 'rt') as f:
+    stats = json.load(f)
+  assert len(stats) == 1
+  assert 'space0' not in json.dumps(stats)
+
+  # repeated look ups, now ordered by the statistics, should still succeed
+  do_get(data, 'test', 'space0', 'key0', 'value0')
+  do_get(data, 'test', 'space1', 'key1', 'value1')
+  do_get(data, 'test', 'space2', 'key2', 'value2')
+
+  # the database itself should not have been touched
+  with open(data, 'rb') as f:
+    assert f.read() == original
+
+def test_access_stats_reorder(tmp_path: Path):
+  '''
+  Test a look up that changes the order entries are scanned in is always saved.
+  '''
+  data = tmp_path / 'access_stats_reorder.json'
+  sidecar = tmp_path / 'access_stats_reorder.json.access'
+
+  for i in range(3):
+    do_set(data, 'test', f'space{i}', f'key{i}', f'value{i}')
+
+  do_get(data, 'test', 'space0', 'key0', 'value0')
+  with open(sidecar, 'rb') as f:
+    first = f.read()
+
+  # an entry with no statistics gaining some moves it ahead of the others
+  do_get(data, 'test', 'space2', 'key2', 'value2')
+  with open(sidecar, 'rb') as f:
+    assert f.read() != first, 'reordering look up was not saved'
+
+def test_access_stats_corrupt(tmp_path: Path):
+  '''
+  Test a damaged access statistics sidecar is ignored and replaced.
+  '''
+  data = tmp_path / 'access_stats_corrupt.json'
+  sidecar = tmp_path / 'access_stats_corrupt.json.access'
+
+  for i in range(3):
+    do_set(data, 'test', f'space{i}', f'key{i}', f'value{i}')
+
+  with open(sidecar, 'wt') as f:
+    f.write('not JSON')
+
+  do_get(data, 'test', 'space0', 'key0', 'value0')
+
+  with open(sidecar, 'rt') as f:
+    assert len(json.load(f)) == 1
+
+@pytest.mark.parametrize('multithreaded', (False, True))
+def test_heap_stats(tmp_path: Path, multithreaded: bool):
+  '''
+  Test we can retrieve secure heap statistics from a command.
+  '''
+  data = tmp_path / 'heap_stats.json'
+
+  do_set(data, 'test', 'space', 'key', 'value', multithreaded)
+
+  args = ['get', '--data', str(data), '--space', 'space', '--key', 'key',
+          '--heap-stats']
+  if not multithreaded:
+    args += ['--jobs', '1']
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+  type_password(p, 'test')
+  p.expect('value\r\n')
+
+  # we should see a summary of the heap, which should have been used
+  p.expect('secure heap statistics:')
+  p.expect(r'high watermark: (\d+) bytes')
+  assert int(p.match.group(1)) > 0
+  p.expect(r'allocations: (\d+)')
+  assert int(p.match.group(1)) > 0
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus == 0
+
+def test_memory_budget(tmp_path: Path):
+  '''
+  Test a memory budget too small for even one key derivation still lets us
+  proceed with a single thread.
+  '''
+  data = tmp_path / 'memory_budget.json'
+
+  do_set(data, 'test', 'space', 'key', 'value', True)
+
+  def threads(budget: str) -> int:
+    '''
+    run a lookup with the given budget, returning how many threads it used
+    '''
+    args = ['get', '--data', str(data), '--space', 'space', '--key', 'key',
+            '--jobs', '4', '--memory-budget', budget, '--pipeline-stats']
+    p = pexpect.spawn('pw-cli', args, timeout=120)
+    type_password(p, 'test')
+    p.expect(r'threads: (\d+)')
+    n = int(p.match.group(1))
+    p.expect('value\r\n')
+    p.expect(pexpect.EOF)
+    p.close()
+    assert p.exitstatus == 0
+    return n
+
+  # the budget should cap the requested jobs
+  assert threads('1K') == 1, '--memory-budget did not limit threads'
+
+  # while a budget with room for every job should not
+  assert threads('1G') == 4
+
+def test_memory_budget_invalid(tmp_path: Path):
+  '''
+  Test an unparseable memory budget is rejected.
+  '''
+  data = tmp_path / 'memory_budget_invalid.json'
+
+  args = ['list', '--data', str(data), '--memory-budget', '12X']
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+  p.expect('invalid argument to --memory-budget')
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus != 0
+
+@pytest.mark.parametrize('multithreaded', (False, True))
+def test_pipeline_stats(tmp_path: Path, multithreaded: bool):
+  '''
+  Test we can retrieve statistics about the stages of decrypting entries.
+  '''
+  data = tmp_path / 'pipeline_stats.json'
+
+  for i in range(3):
+    do_set(data, 'test', f'space{i}', f'key{i}', f'value{i}', multithreaded)
+
+  args = ['list', '--data', str(data), '--pipeline-stats']
+  if not multithreaded:
+    args += ['--jobs', '1']
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+  type_password(p, 'test')
+
+  # every entry should have passed through each stage
+  p.expect('pipeline statistics:')
+  p.expect(r'entries decrypted: (\d+)')
+  assert int(p.match.group(1)) == 3
+  p.expect(r'MAC stage: [\d.]+s \([\d.]+% utilisation\)')
+  p.expect(r'key stage: [\d.]+s \([\d.]+% utilisation\)')
+  p.expect(r'decrypt stage: [\d.]+s \([\d.]+% utilisation\)')
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus == 0
+
+def test_stats(tmp_path: Path):
+  '''
+  Test we can retrieve a report of where time went.
+  '''
+  data = tmp_path / 'stats.json'
+
+  for i in range(3):
+    do_set(data, 'test', f'space{i}', f'key{i}', f'value{i}', True)
+
+  args = ['list', '--data', str(data), '--jobs', '2', '--stats']
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+  type_password(p, 'test')
+  p.expect('run statistics:')
+  for phase in ('lock wait', 'import', 'password prompt'):
+    p.expect(rf'{phase}: [\d.]+s wall, [\d.]+s CPU')
+  for phase in ('key derivation', 'HMAC', 'AES', 'callback'):
+    p.expect(rf'{phase}: [\d.]+s thread time, [\d.]+s CPU')
+  p.expect(r'export: [\d.]+s wall, [\d.]+s CPU')
+  p.expect(r'thread 0: \d+ entries')
+  p.expect(r'secure heap high water: \d+ bytes')
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus == 0
+
+def test_stats_json(tmp_path: Path):
+  '''
+  Test the report of where time went can be retrieved as JSON.
+  '''
+  data = tmp_path / 'stats_json.json'
+
+  for i in range(3):
+    do_set(data, 'test', f'space{i}', f'key{i}', f'value{i}', True)
+
+  args = ['list', '--data', str(data), '--jobs', '2', '--stats=json']
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+  type_password(p, 'test')
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus == 0
+
+  report = json.loads(p.before.decode('utf-8').splitlines()[-1])
+  for phase in ('lock', 'import', 'prompt', 'kdf', 'hmac', 'aes', 'callback',
+                'export'):
+    assert report['phases'][phase]['wall_ns'] >= 0
+    assert report['phases'][phase]['cpu_ns'] >= 0
+  assert report['phases']['kdf']['cpu_ns'] > 0
+  assert sum(t['entries'] for t in report['threads']) == 3
+  assert report['secure_heap_high_water'] > 0
+
+def test_jobs_auto(tmp_path: Path):
+  '''
+  Test a number of jobs chosen on an earlier run is reused.
+  '''
+  data = tmp_path / 'jobs_auto.json'
+
+  for i in range(3):
+    do_set(data, 'test', f'space{i}', f'key{i}', f'value{i}', True)
+
+  # keep the cache out of the real home directory
+  env = dict(os.environ)
+  env['HOME'] = str(tmp_path)
+
+  args = ['list', '--data', str(data), '--jobs', 'auto', '--pipeline-stats']
+  p = pexpect.spawn('pw-cli', args, timeout=120, env=env)
+  type_password(p, 'test')
+  p.expect(r'entries decrypted: (\d+)')
+  assert int(p.match.group(1)) == 3
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus == 0
+
+  # record a choice for this host
+  cpus = os.sysconf('SC_NPROCESSORS_ONLN')
+  cache = tmp_path / '.passwand.jobs'
+  cache.write_text(f'other-host {cpus} 14 5\n'
+                   f'{socket.gethostname()} {cpus} 14 3\n', encoding='utf-8')
+
+  p = pexpect.spawn('pw-cli', args, timeout=120, env=env)
+  type_password(p, 'test')
+  p.expect(r'threads: (\d+)')
+  assert int(p.match.group(1)) == 3
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus == 0
+
+@pytest.mark.parametrize('affinity', ('none', 'compact', 'scatter', 'numa'))
+def test_affinity(tmp_path: Path, affinity: str):
+  '''
+  Test thread placement policies do not change results.
+  '''
+  data = tmp_path / 'affinity.json'
+
+  for i in range(3):
+    do_set(data, 'test', f'space{i}', f'key{i}', f'value{i}', True)
+
+  args = ['get', '--data', str(data), '--space', 'space1', '--key', 'key1',
+          '--affinity', affinity]
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+  type_password(p, 'test')
+  p.expect('value1')
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus == 0
+
+def test_affinity_invalid(tmp_path: Path):
+  '''
+  Test an unknown thread placement policy is rejected.
+  '''
+  data = tmp_path / 'affinity_invalid.json'
+
+  args = ['list', '--data', str(data), '--affinity', 'bogus']
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+  p.expect('invalid argument to --affinity')
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus != 0
+
+@pytest.mark.parametrize('multithreaded', (False, True))
+def test_get_multiple(tmp_path: Path, multithreaded: bool):
+  '''
+  Test looking up several entries at once prints them in the order requested.
+  '''
+  data = tmp_path / 'get_multiple.json'
+
+  for i in range(4):
+    do_set(data, 'test', f'space{i % 2}', f'key{i}', f'value{i}', multithreaded)
+
+  args = ['get', '--data', str(data)]
+  for i in (3, 0, 2):
+    args += ['--space', f'space{i % 2}', '--key', f'key{i}']
+  if not multithreaded:
+    args += ['--jobs', '1']
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+  type_password(p, 'test')
+  p.expect('value3\r\nvalue0\r\nvalue2\r\n')
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus == 0
+
+def test_get_multiple_missing(tmp_path: Path):
+  '''
+  Test looking up several entries when one does not exist.
+  '''
+  data = tmp_path / 'get_multiple_missing.json'
+
+  do_set(data, 'test', 'space', 'key', 'value')
+
+  # a single --space should apply to every --key
+  args = ['get', '--data', str(data), '--space', 'space', '--key', 'key',
+          '--key', 'missing']
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+  type_password(p, 'test')
+  p.expect('not found: space/missing')
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus != 0
+  assert 'value' not in p.before.decode('utf-8'), \
+    'partial results printed'
+
+def test_get_keys_from(tmp_path: Path):
+  '''
+  Test looking up entries listed in a file.
+  '''
+  data = tmp_path / 'get_keys_from.json'
+
+  do_set(data, 'test', 'space', 'key1', 'value1')
+  do_set(data, 'test', 'space', 'key2', 'value2')
+  do_set(data, 'test', 'other', 'key3', 'value3')
+
+  keys = tmp_path / 'keys.txt'
+  keys.write_text('key2\nother\tkey3\n\nkey1\n')
+
+  args = ['get', '--data', str(data), '--space', 'space', '--keys-from',
+          str(keys)]
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+  type_password(p, 'test')
+  p.expect('value2\r\nvalue3\r\nvalue1\r\n')
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus == 0
+
+def test_set_multiple(tmp_path: Path):
+  '''
+  Test commands operating on a single entry reject repeated --key.
+  '''
+  data = tmp_path / 'set_multiple.json'
+
+  args = ['pw-cli', 'set', '--data', data, '--space', 'space', '--key', 'a',
+          '--key', 'b', '--value', 'value']
+  p = run(args, '')
+  assert p.returncode != 0
+  assert '--key given more than once' in p.stderr
+
+def test_set_keys_from(tmp_path: Path):
+  '''
+  Test commands operating on a single entry reject --keys-from, rather than
+  letting it stand in for --space and --key.
+  '''
+  data = tmp_path / 'set_keys_from.json'
+
+  keys = tmp_path / 'keys.txt'
+  keys.write_text('space\tkey\n')
+
+  args = ['pw-cli', 'set', '--data', data, '--keys-from', keys, '--value',
+          'value']
+  p = run(args, '')
+  assert p.returncode != 0
+  assert 'irrelevant argument --keys-from' in p.stderr
+  assert not data.exists()
+
+def do_batch(db: Path, password, ops: List[dict], confirm: bool = True,
+             multithreaded: bool = False):
+  '''
+  Run a batch of operations, returning the per-operation results and the exit
+  status.
+  '''
+  with tempfile.NamedTemporaryFile('wt') as f:
+    for op in ops:
+      f.write(f'{json.dumps(op)}\n')
+    f.flush()
+
+    # stdin comes from the operations, leaving the terminal for the password
+    command = f'pw-cli batch --data {db}'
+    if not multithreaded:
+      command += ' --jobs 1'
+    p = pexpect.spawn('sh', ['-c', f'{command} <{f.name}'], timeout=120)
+    if confirm:
+      type_password_with_confirmation(p, password)
+    else:
+      type_password(p, password)
     p.expect(pexpect.EOF)
     p.close()
 
-    if args[0] != 'get': # allow `get` to succeed because it can early exit
-      assert p.exitstatus != 0, 'command incorrectly succeeded'
-
-    with open(combined, 'rt') as f:
-      content = f.read()
-    assert content == reference, 'corrupted database was modified'
+  output = p.before.decode('utf-8')
+  results = [json.loads(l) for l in output.splitlines() if l.startswith('{')]
+  return results, p.exitstatus
 
-@pytest.mark.parametrize('target', (0, 1, 2))
 @pytest.mark.parametrize('multithreaded', (False, True))
-def test_set(tmp_path: Path, target: int, multithreaded: bool):
+def test_batch(tmp_path: Path, multithreaded: bool):
   '''
-  Test trying to overwrite one of a set of three entries.
+  Test a batch of operations is applied in order with one result each.
   '''
-  data = tmp_path / 'set_xxx.json'
+  data = tmp_path / 'batch.json'
+
+  do_set(data, 'test', 'space', 'key1', 'value1', multithreaded)
+  do_set(data, 'test', 'space', 'key2', 'value2', multithreaded)
+
+  ops = [
+    {'op': 'get', 'space': 'space', 'key': 'key1'},
+    {'op': 'set', 'space': 'space', 'key': 'key3', 'value': 'va"lue3'},
+    {'op': 'set', 'space': 'space', 'key': 'key1', 'value': 'clobber'},
+    {'op': 'update', 'space': 'space', 'key': 'key1', 'value': 'new1'},
+    {'op': 'get', 'space': 'space', 'key': 'key1'},
+    {'op': 'delete', 'space': 'space', 'key': 'key2'},
+    {'op': 'get', 'space': 'space', 'key': 'key2'},
+    {'op': 'get', 'space': 'space', 'key': 'key3'},
+    {'op': 'delete', 'space': 'space', 'key': 'missing'},
+  ]
+  results, status = do_batch(data, 'test', ops, multithreaded=multithreaded)
+
+  assert results == [
+    {'ok': True, 'value': 'value1'},
+    {'ok': True},
+    {'ok': False, 'error': 'already exists'},
+    {'ok': True},
+    {'ok': True, 'value': 'new1'},
+    {'ok': True},
+    {'ok': False, 'error': 'not found'},
+    {'ok': True, 'value': 'va"lue3'},
+    {'ok': False, 'error': 'not found'},
+  ]
+  assert status != 0, 'failed operations not reflected in exit status'
+
+  # the successful writes should have been committed
+  do_get(data, 'test', 'space', 'key1', 'new1', multithreaded)
+  do_get(data, 'test', 'space', 'key3', 'va"lue3', multithreaded)
+  with open(data, 'rt') as f:
+    assert len(json.load(f)) == 2
+
+def test_batch_read_only(tmp_path: Path):
+  '''
+  Test a batch of look ups neither asks for confirmation nor writes.
+  '''
+  data = tmp_path / 'batch_read_only.json'
 
-  # Setup a database with three entries.
   for i in range(3):
+    do_set(data, 'test', 'space', f'key{i}', f'value{i}')
 
-    # Request to save a key and value.
-    do_set(data, 'test', f'space{i}', f'key{i}', f'value{i}', multithreaded)
+  with open(data, 'rb') as f:
+    original = f.read()
 
-  # Now try to overwrite the 'target'-th entry.
-  args = ['set', '--data', str(data), '--space', f'space{target}', '--key',
-          f'key{target}', '--value', 'valuenew']
-  if not multithreaded:
-    args += ['--jobs', '1']
-  p = pexpect.spawn('pw-cli', args, timeout=120)
+  ops = [{'op': 'get', 'space': 'space', 'key': f'key{i}'}
+         for i in (2, 0, 1)]
+  results, status = do_batch(data, 'test', ops, confirm=False)
+  assert results == [{'ok': True, 'value': f'value{i}'} for i in (2, 0, 1)]
+  assert status == 0
 
-  # Enter the main password.
-  type_password_with_confirmation(p, 'test')
+  with open(data, 'rb') as f:
+    assert f.read() == original
 
-  # Now passwand should exit with failure.
-  p.expect(pexpect.EOF)
-  p.close()
-  assert p.exitstatus != 0
+def test_batch_lock(tmp_path: Path):
+  '''
+  Test a batch of look ups only needs a shared lock on the database.
+  '''
+  data = tmp_path / 'batch_lock.json'
 
-  # Now retrieve each value.
-  for i in range(3):
-    do_get(data, 'test', f'space{i}', f'key{i}', f'value{i}', multithreaded)
+  do_set(data, 'test', 'space', 'key', 'value')
 
-@pytest.mark.parametrize('multithreaded', (False, True))
-def test_list_standard(tmp_path: Path, multithreaded: bool):
+  with open(data, 'rb') as f:
+    # hold a shared lock, as a concurrent reader would
+    fcntl.flock(f, fcntl.LOCK_SH)
+
+    ops = [{'op': 'get', 'space': 'space', 'key': 'key'}]
+    results, status = do_batch(data, 'test', ops, confirm=False)
+    assert results == [{'ok': True, 'value': 'value'}]
+    assert status == 0
+
+    # a batch that writes should still be excluded
+    with tempfile.NamedTemporaryFile('wt') as g:
+      g.write('{"op": "delete", "space": "space", "key": "key"}\n')
+      g.flush()
+      p = pexpect.spawn('sh', ['-c', f'pw-cli batch --data {data} <{g.name}'],
+                        timeout=120)
+      p.expect('failed to lock database')
+      p.expect(pexpect.EOF)
+      p.close()
+    assert p.exitstatus != 0
+
+def test_batch_invalid(tmp_path: Path):
   '''
-  Test list of ten entries.
+  Test malformed input is rejected without changing anything.
   '''
-  data = tmp_path / 'list_standard.json'
+  data = tmp_path / 'batch_invalid.json'
 
-  # Request to save 10 keys and values.
-  for i in range(10):
-    do_set(data, 'test', f'space{i}', f'key{i}', f'value{i}', multithreaded)
+  do_set(data, 'test', 'space', 'key', 'value')
 
-  # Now request to list the database.
-  args = ['list', '--data', str(data)]
-  if not multithreaded:
-    args += ['--jobs', '1']
-  p = pexpect.spawn('pw-cli', args, timeout=120)
+  with open(data, 'rb') as f:
+    original = f.read()
 
-  # Enter the main password.
-  type_password(p, 'test')
+  with tempfile.NamedTemporaryFile('wt') as f:
+    f.write('{"op": "delete", "space": "space", "key": "key"}\n')
+    f.write('{"op": "frobnicate", "space": "space", "key": "key"}\n')
+    f.flush()
+    p = pexpect.spawn('sh', ['-c', f'pw-cli batch --data {data} <{f.name}'],
+                      timeout=120)
 
-  # Scan the entries we get.
-  output = p.read()
-  seen = set()
-  for line in output.decode('utf-8', 'replace').strip().splitlines():
-    m = re.match(r'^space(\d+)/key\1', line)
-    assert m is not None, 'unexpected entry received from \'list\''
-    i = int(m.group(1))
-    assert i not in seen, 'duplicate entry in list'
-    seen.add(i)
-  assert seen == set(range(10)), 'incorrect list of entries'
+    # input is read before the database is locked, so we are not asked for the
+    # main password
+    p.expect('line 2: invalid op "frobnicate"')
+    p.expect(pexpect.EOF)
+    p.close()
+  assert p.exitstatus != 0
 
-  # List should exit with success.
-  p.expect(pexpect.EOF)
-  p.close()
-  assert p.exitstatus == 0
+  with open(data, 'rb') as f:
+    assert f.read() == original
+
+def test_batch_long_line(tmp_path: Path):
+  '''
+  Test a line too long to hold in secure memory is rejected.
+  '''
+  data = tmp_path / 'batch_long_line.json'
+
+  do_set(data, 'test', 'space', 'key', 'value')
+
+  with tempfile.NamedTemporaryFile('wt') as f:
+    op = {'op': 'update', 'space': 'space', 'key': 'key', 'value': 'x' * 5000}
+    f.write(f'{json.dumps(op)}\n')
+    f.flush()
+    p = pexpect.spawn('sh', ['-c', f'pw-cli batch --data {data} <{f.name}'],
+                      timeout=120)
+    p.expect('line 1: too long')
+    p.expect(pexpect.EOF)
+    p.close()
+  assert p.exitstatus != 0
+
+  do_get(data, 'test', 'space', 'key', 'value')
 
 @pytest.mark.parametrize('multithreaded', (False, True))
 def test_delete_empty(tmp_path: Path, multithreaded: bool):
@@ -1313,6 +2132,480 @@ def test_check_xxx(tmp_path: Path, weak_mask: int, multithreaded: bool):
       found |= 1 << index
   assert found == weak_mask, 'missed warning for weak password(s)'
 
+@pytest.mark.parametrize('value,reason', (
+  ('hunter', 'dictionary word'),
+  ('HUNT3R', 'variant of a dictionary word'),
+  ('Hunt3r', 'variant of a dictionary word'),
+))
+def test_check_dictionary(tmp_path: Path, value: str, reason: str):
+  '''
+  Test checking against a word list given by --dictionary.
+  '''
+  data = tmp_path / 'check_dictionary.json'
+  words = tmp_path / 'words'
+  words.write_text('apple\nhunter\nzebra\n', encoding='utf-8')
+
+  do_set(data, 'test', 'space', 'key', value)
+
+  # keep the index out of the real home directory
+  env = dict(os.environ)
+  env['HOME'] = str(tmp_path)
+
+  # the first run builds the index and the second loads it
+  for _ in range(2):
+    args = ['check', '--data', str(data), '--dictionary', str(words)]
+    p = pexpect.spawn('pw-cli', args, timeout=120, env=env)
+    type_password(p, 'test')
+    p.expect(f'space/key: weak password \\({reason}\\)')
+    p.expect(pexpect.EOF)
+    p.close()
+    assert p.exitstatus != 0
+
+    assert (tmp_path / '.passwand.dict').exists()
+
+def test_check_dictionary_path(tmp_path: Path):
+  '''
+  Test the cached index is rebuilt for a word list at a different path, even
+  when it is the same file.
+  '''
+  data = tmp_path / 'check_dictionary_path.json'
+  words = tmp_path / 'words'
+  words.write_text('apple\nhunter\nzebra\n', encoding='utf-8')
+  link = tmp_path / 'other-words'
+  os.link(words, link)
+
+  do_set(data, 'test', 'space', 'key', 'hunter')
+
+  # keep the index out of the real home directory
+  env = dict(os.environ)
+  env['HOME'] = str(tmp_path)
+  index = tmp_path / '.passwand.dict'
+
+  for path in (words, link):
+    args = ['check', '--data', str(data), '--dictionary', str(path)]
+    p = pexpect.spawn('pw-cli', args, timeout=120, env=env)
+    type_password(p, 'test')
+    p.expect('space/key: weak password \\(dictionary word\\)')
+    p.expect(pexpect.EOF)
+    p.close()
+    assert p.exitstatus != 0
+
+    # the index should name the word list it was built from
+    assert os.path.realpath(path).encode('utf-8') + b'\0' in \
+      index.read_bytes()
+
+@pytest.mark.parametrize('jobs', (1, 4))
+def test_check_reuse(tmp_path: Path, jobs: int):
+  '''
+  Test --reuse reports entries that share a password.
+  '''
+  data = tmp_path / 'check_reuse.json'
+
+  # weak passwords, so none of them need Have I Been Pwned
+  words = tmp_path / 'words'
+  words.write_text('apple\nhunter\nzebra\n', encoding='utf-8')
+  entries = {('space', 'a'): 'apple', ('other', 'b'): 'apple',
+             ('space', 'c'): 'hunter', ('space', 'd'): 'zebra',
+             ('other', 'e'): 'zebra', ('space', 'f'): 'zebra'}
+  for (space, key), value in entries.items():
+    do_set(data, 'test', space, key, value)
+
+  args = ['check', '--data', str(data), '--dictionary', str(words), '--reuse',
+          '--jobs', str(jobs)]
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+  type_password(p, 'test')
+  output = p.read().decode('utf-8', 'replace')
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus != 0
+
+  assert 'other/b, space/a: weak password (shared by 2 entries)' in output
+  assert 'other/e, space/d, space/f: weak password (shared by 3 entries)' \
+    in output
+  assert output.count('shared by') == 2
+
+def test_reuse_irrelevant(tmp_path: Path):
+  '''
+  Test --reuse is rejected by commands that do not check passwords.
+  '''
+  data = tmp_path / 'reuse_irrelevant.json'
+
+  args = ['list', '--data', str(data), '--reuse']
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+  p.expect('irrelevant argument --reuse')
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus != 0
+
+def build_breach_db(path: Path, passwords: dict) -> None:
+  '''
+  write a breach list in the downloaded format and index it
+  '''
+  # include some unrelated hashes, unsorted, with a duplicate
+  lines = [f'{hashlib.sha1(f"filler{i}".encode()).hexdigest().upper()}:{i + 1}'
+           for i in range(50)]
+  lines.append(lines[0])
+  for password, count in passwords.items():
+    lines.append(f'{hashlib.sha1(password.encode()).hexdigest().upper()}:'
+                 f'{count}')
+  lines.sort(key=lambda l: l[::-1])
+  path.write_text('\r\n'.join(lines) + '\r\n', encoding='utf-8')
+
+  args = ['check', '--breach-db', str(path), '--build-index']
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+  p.expect(r'built filter of (\d+) bytes .* \(([\d.]+) bytes per hash, '
+           r'([\d.]+)% false positives\)')
+  assert float(p.match.group(2)) > 0
+  assert float(p.match.group(3)) < 5
+  p.expect(r'indexed (\d+) breached password hashes')
+  assert int(p.match.group(1)) == 50 + len(passwords)
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus == 0
+
+@pytest.mark.parametrize('multithreaded', (False, True))
+def test_check_breach_db(tmp_path: Path, multithreaded: bool):
+  '''
+  Test checking against a local breach list, without network access.
+  '''
+  data = tmp_path / 'check_breach_db.json'
+  breaches = tmp_path / 'pwned-passwords.txt'
+  build_breach_db(breaches, {'Tr0ub4dor&3': 42})
+  assert (tmp_path / 'pwned-passwords.txt.idx').exists()
+
+  do_set(data, 'test', 'space', 'weak', 'Tr0ub4dor&3')
+  do_set(data, 'test', 'space', 'strong', HARD_PASSWORD)
+
+  # an empty word list keeps the system dictionary out of this
+  words = tmp_path / 'words'
+  words.write_text('', encoding='utf-8')
+
+  args = ['check', '--data', str(data), '--dictionary', str(words),
+          '--breach-db', str(breaches)]
+  if not multithreaded:
+    args += ['--jobs', '1']
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+  type_password(p, 'test')
+  output = p.read().decode('utf-8', 'replace')
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus != 0
+
+  assert 'space/weak: weak password (found in password breaches 42 times)' \
+    in output
+  assert 'space/strong: OK (not in breach database)' in output
+
+  # the strong password alone should pass
+  p = pexpect.spawn('pw-cli', args + ['--space', 'space', '--key', 'strong'],
+                    timeout=120)
+  type_password(p, 'test')
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus == 0
+
+@pytest.mark.parametrize('keep', ('filter', 'idx'))
+def test_check_breach_db_partial(tmp_path: Path, keep: str):
+  '''
+  Test checking with only one of the breach filter and index.
+  '''
+  data = tmp_path / 'check_breach_db_partial.json'
+  breaches = tmp_path / 'pwned-passwords.txt'
+  build_breach_db(breaches, {'Tr0ub4dor&3': 42})
+  drop = 'idx' if keep == 'filter' else 'filter'
+  (tmp_path / f'pwned-passwords.txt.{drop}').unlink()
+
+  do_set(data, 'test', 'space', 'weak', 'Tr0ub4dor&3')
+  do_set(data, 'test', 'space', 'strong', HARD_PASSWORD)
+
+  words = tmp_path / 'words'
+  words.write_text('', encoding='utf-8')
+
+  args = ['check', '--data', str(data), '--dictionary', str(words),
+          '--breach-db', str(breaches)]
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+  type_password(p, 'test')
+  output = p.read().decode('utf-8', 'replace')
+  p.expect(pexpect.EOF)
+  p.close()
+
+  # the filter rules out the strong password either way
+  assert 'space/strong: OK (not in breach database)' in output
+
+  # without the index, a possible hit goes to Have I Been Pwned, which
+  # confirms it or, without network access, cannot
+  assert 'space/weak: OK' not in output
+  if keep == 'idx':
+    assert 'found in password breaches 42 times' in output
+    assert p.exitstatus != 0
+
+def test_check_breach_db_unindexed(tmp_path: Path):
+  '''
+  Test using a breach list that has not been indexed is rejected.
+  '''
+  data = tmp_path / 'check_breach_db_unindexed.json'
+  breaches = tmp_path / 'pwned-passwords.txt'
+  breaches.write_text('', encoding='utf-8')
+
+  do_set(data, 'test', 'space', 'key', HARD_PASSWORD)
+
+  args = ['check', '--data', str(data), '--breach-db', str(breaches)]
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+  type_password(p, 'test')
+  p.expect('--build-index')
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus != 0
+
+def test_check_breach_db_malformed(tmp_path: Path):
+  '''
+  Test indexing a file that is not a breach list fails.
+  '''
+  breaches = tmp_path / 'pwned-passwords.txt'
+  breaches.write_text('hello world\n', encoding='utf-8')
+
+  args = ['check', '--breach-db', str(breaches), '--build-index']
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+  p.expect('pwned-passwords.txt:1: expected a SHA-1 hash and count')
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus != 0
+  assert not (tmp_path / 'pwned-passwords.txt.idx').exists()
+
+@contextlib.contextmanager
+def hibp_stand_in(tmp_path: Path, mode: str, breached: dict):
+  '''
+  run a local HTTPS server that answers like the Have I Been Pwned range API
+  '''
+  if shutil.which('openssl') is None:
+    pytest.skip('openssl not available to create a certificate')
+  cert = tmp_path / 'cert.pem'
+  key = tmp_path / 'key.pem'
+  subprocess.check_call(['openssl', 'req', '-x509', '-newkey', 'rsa:2048',
+                         '-nodes', '-keyout', key, '-out', cert, '-days', '1',
+                         '-subj', '/CN=localhost'],
+                        stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+  hashes = {hashlib.sha1(p.encode()).hexdigest().upper(): c
+            for p, c in breached.items()}
+  stats = {'connections': 0, 'requests': 0, 'resumed': 0, 'peak': 0}
+  in_flight = 0
+  lock = threading.Lock()
+
+  class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def setup(self):
+      super().setup()
+      with lock:
+        stats['connections'] += 1
+        if self.connection.session_reused:
+          stats['resumed'] += 1
+
+    def do_GET(self):
+      nonlocal in_flight
+      with lock:
+        stats['requests'] += 1
+        in_flight += 1
+        stats['peak'] = max(stats['peak'], in_flight)
+      # answer slowly, as a distant server would
+      if mode == 'slow':
+        time.sleep(2)
+      with lock:
+        in_flight -= 1
+      prefix = self.path[len('/range/'):]
+      lines = [f'{i:035X}:{i + 1}' for i in range(20)]
+      lines += [f'{h[5:]}:{c}' for h, c in hashes.items()
+                if h.startswith(prefix)]
+      body = '\r\n'.join(lines).encode('utf-8')
+
+      self.send_response(200)
+      self.send_header('Content-Type', 'text/plain')
+      if mode == 'chunked':
+        self.send_header('Transfer-Encoding', 'chunked')
+        self.end_headers()
+        for i in range(0, len(body), 100):
+          chunk = body[i:i + 100]
+          self.wfile.write(f'{len(chunk):x}\r\n'.encode('utf-8') + chunk +
+                           b'\r\n')
+        self.wfile.write(b'0\r\n\r\n')
+      else:
+        self.send_header('Content-Length', str(len(body)))
+        if mode == 'close':
+          self.send_header('Connection', 'close')
+        self.end_headers()
+        self.wfile.write(body)
+        # hang up without warning, as a server dropping idle connections would
+        if mode == 'drop':
+          self.close_connection = True
+
+    def log_message(self, *args):
+      pass
+
+  context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+  context.load_cert_chain(cert, key)
+  server = http.server.ThreadingHTTPServer(('127.0.0.1', 0), Handler)
+  server.socket = context.wrap_socket(server.socket, server_side=True)
+  thread = threading.Thread(target=server.serve_forever, daemon=True)
+  thread.start()
+  try:
+    yield f'127.0.0.1:{server.server_address[1]}', stats
+  finally:
+    server.shutdown()
+    server.server_close()
+
+@pytest.mark.parametrize('mode', ('keep-alive', 'chunked', 'close', 'drop'))
+def test_check_hibp_server(tmp_path: Path, mode: str):
+  '''
+  Test checking against a stand-in for Have I Been Pwned.
+  '''
+  data = tmp_path / 'check_hibp_server.json'
+
+  for i in range(3):
+    do_set(data, 'test', 'space', f'strong{i}', f'{HARD_PASSWORD}{i}')
+  do_set(data, 'test', 'space', 'weak', 'Tr0ub4dor&3')
+
+  words = tmp_path / 'words'
+  words.write_text('', encoding='utf-8')
+
+  with hibp_stand_in(tmp_path, mode, {'Tr0ub4dor&3': 42}) as (server, stats):
+    args = ['check', '--data', str(data), '--dictionary', str(words),
+            '--hibp-server', server, '--jobs', '1']
+    p = pexpect.spawn('pw-cli', args, timeout=120)
+    type_password(p, 'test')
+    output = p.read().decode('utf-8', 'replace')
+    p.expect(pexpect.EOF)
+    p.close()
+    assert p.exitstatus != 0
+
+  assert 'space/weak: weak password (found in password breaches 42 times)' \
+    in output
+  for i in range(3):
+    assert f'space/strong{i}: OK (searched 20 candidate' in output
+
+  # a single connection should have been reused, unless the server closed it
+  assert stats['requests'] == 4
+  if mode in ('close', 'drop'):
+    assert stats['connections'] == 4
+    # OpenSSL refuses to resume a session that ended without a TLS close
+    if mode == 'close':
+      assert stats['resumed'] > 0, 'TLS sessions not resumed'
+  else:
+    assert stats['connections'] == 1
+
+def test_check_hibp_concurrent(tmp_path: Path):
+  '''
+  Test look ups are made in the background, several at once.
+  '''
+  data = tmp_path / 'check_hibp_concurrent.json'
+
+  for i in range(12):
+    do_set(data, 'test', 'space', f'key{i}', f'{HARD_PASSWORD}{i}')
+
+  words = tmp_path / 'words'
+  words.write_text('', encoding='utf-8')
+
+  with hibp_stand_in(tmp_path, 'slow', {}) as (server, stats):
+    # with a single decrypting thread, which should not wait on responses
+    args = ['check', '--data', str(data), '--dictionary', str(words),
+            '--hibp-server', server, '--jobs', '1']
+    p = pexpect.spawn('pw-cli', args, timeout=120)
+    type_password(p, 'test')
+    output = p.read().decode('utf-8', 'replace')
+    p.expect(pexpect.EOF)
+    p.close()
+    assert p.exitstatus == 0
+
+  assert output.count('OK (searched 20 candidate') == 12
+  assert stats['requests'] == 12
+  assert stats['peak'] > 1, 'look ups were not overlapped'
+  assert stats['connections'] <= 8, 'too many connections'
+
+def shared_prefix_passwords() -> List[str]:
+  '''
+  find two strong passwords whose hashes share a Have I Been Pwned prefix
+  '''
+  seen = {}
+  for i in itertools.count():
+    password = f'{HARD_PASSWORD}{i}'
+    prefix = hashlib.sha1(password.encode()).hexdigest()[:5]
+    if prefix in seen:
+      return [seen[prefix], password]
+    seen[prefix] = password
+
+def test_check_hibp_cache(tmp_path: Path):
+  '''
+  Test each prefix is fetched once per run and cached across runs.
+  '''
+  data = tmp_path / 'check_hibp_cache.json'
+
+  # two passwords that share a prefix, and one that (almost certainly) does not
+  passwords = shared_prefix_passwords() + [HARD_PASSWORD]
+  for i, password in enumerate(passwords):
+    do_set(data, 'test', 'space', f'key{i}', password)
+
+  words = tmp_path / 'words'
+  words.write_text('', encoding='utf-8')
+
+  env = dict(os.environ)
+  env['XDG_CACHE_HOME'] = str(tmp_path / 'cache')
+  cache = tmp_path / 'cache' / 'passwand' / 'hibp'
+
+  def run_check(server: str, *extra: str):
+    args = ['check', '--data', str(data), '--dictionary', str(words),
+            '--hibp-server', server] + list(extra)
+    p = pexpect.spawn('pw-cli', args, timeout=120, env=env)
+    type_password(p, 'test')
+    output = p.read().decode('utf-8', 'replace')
+    p.expect(pexpect.EOF)
+    p.close()
+    assert p.exitstatus == 0
+    assert output.count('OK (searched 20 candidate') == 3
+
+  # without --hibp-cache, a prefix still being fetched should not be fetched
+  # again
+  with hibp_stand_in(tmp_path, 'slow', {}) as (server, stats):
+    run_check(server, '--jobs', '1')
+    assert stats['requests'] == 2
+    assert not cache.exists()
+
+  # nor one that has already been fetched
+  with hibp_stand_in(tmp_path, 'keep-alive', {}) as (server, stats):
+    run_check(server, '--jobs', '1')
+    assert stats['requests'] == 2
+    assert not cache.exists()
+
+  with hibp_stand_in(tmp_path, 'keep-alive', {}) as (server, stats):
+
+    # with it, responses should be saved and the shared prefix fetched once
+    run_check(server, '--hibp-cache', '1h')
+    assert stats['requests'] == 2
+    assert len(list(cache.iterdir())) == 2
+
+    # and then reused
+    run_check(server, '--hibp-cache', '1h')
+    assert stats['requests'] == 2
+
+    # until they expire
+    for f in cache.iterdir():
+      os.utime(f, (0, 0))
+    run_check(server, '--hibp-cache', '1h')
+    assert stats['requests'] == 4
+
+def test_dictionary_irrelevant(tmp_path: Path):
+  '''
+  Test --dictionary is rejected by commands that do not check passwords.
+  '''
+  data = tmp_path / 'dictionary_irrelevant.json'
+  words = tmp_path / 'words'
+  words.write_text('hunter\n', encoding='utf-8')
+
+  args = ['list', '--data', str(data), '--dictionary', str(words)]
+  p = pexpect.spawn('pw-cli', args, timeout=120)
+  p.expect('irrelevant argument --dictionary')
+  p.expect(pexpect.EOF)
+  p.close()
+  assert p.exitstatus != 0
+
 @pytest.mark.parametrize('multithreaded', (False, True))
 def test_update_overwrite(tmp_path: Path, multithreaded: bool):
   '''
@@ -1958,6 +3251,33 @@ def test_gui_concurrent_manipulation(tmp_path: Path):
   s.expect(pexpect.EOF)
   s.close()
 
+def test_gui_access_stats(tmp_path: Path):
+  '''
+  Test look ups from the GUI record access statistics without rewriting the
+  database.
+  '''
+  data = tmp_path / 'gui_access_stats.json'
+  sidecar = tmp_path / 'gui_access_stats.json.access'
+
+  for i in range(3):
+    do_set(data, 'test', f'space{i}', f'key{i}', f'value{i}')
+
+  with open(data, 'rb') as f:
+    original = f.read()
+
+  for _ in range(2):
+    args = ['pw-gui-test-stub', '--data', data, '--jobs', '1']
+    input = ('space0\n'
+             'key0\n'
+             'test\n')
+    p = run(args, input)
+    assert p.returncode == 0
+    assert p.stdout == 'value0\n'
+    assert sidecar.exists()
+
+  with open(data, 'rb') as f:
+    assert f.read() == original
+
 def test_gui_error_rate(tmp_path: Path):
   '''
   Ensure that entering the wrong password results in only a single error.
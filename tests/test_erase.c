@@ -20,3 +20,17 @@ TEST("erase: erase(\"\")") {
   int r = passwand_erase(empty, strlen(empty));
   ASSERT_EQ(r, 0);
 }
+
+TEST("erase: bulk") {
+  char first[20] = "hello world";
+  char second[20] = "goodbye world";
+  const passwand_span_t spans[] = {
+      {.base = first, .length = strlen(first)},
+      {.base = NULL, .length = 10},
+      {.base = second, .length = strlen(second)},
+  };
+  int r = passwand_erase_bulk(spans, sizeof(spans) / sizeof(spans[0]));
+  ASSERT_EQ(r, 0);
+  ASSERT_STRNE(first, "hello world");
+  ASSERT_STRNE(second, "goodbye world");
+}
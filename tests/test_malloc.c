@@ -98,3 +98,228 @@ TEST("malloc: limit") {
   ASSERT_NOT_NULL(n);
   passwand_secure_free(n, sizeof(*n));
 }
+
+TEST("malloc: reserve") {
+
+  // reserving a few pages up front should succeed in any reasonable
+  // environment
+  ASSERT_EQ(passwand_secure_malloc_reserve(16 * 1024), 0);
+
+  // we should be able to allocate from the reserved memory
+  void *const p = passwand_secure_malloc(128);
+  ASSERT_NOT_NULL(p);
+  void *const q = passwand_secure_malloc(4096);
+  ASSERT_NOT_NULL(q);
+
+  passwand_secure_free(q, 4096);
+  passwand_secure_free(p, 128);
+
+  // once everything is freed, we should be able to release the reservation
+  ASSERT_EQ(passwand_secure_malloc_reset(), 0);
+}
+
+TEST("malloc: reserve outlasts frees") {
+
+  // release memory as eagerly as possible
+  const size_t spare = passwand_secure_heap_set_spare(0);
+
+  ASSERT_EQ(passwand_secure_malloc_reserve(16 * 1024), 0);
+  const size_t locked = passwand_secure_heap_stats().locked;
+  ASSERT_GE(locked, 16ul * 1024);
+
+  // using and freeing the reservation should not give it up
+  void *const p = passwand_secure_malloc(128);
+  ASSERT_NOT_NULL(p);
+  passwand_secure_free(p, 128);
+  ASSERT_EQ(passwand_secure_heap_stats().locked, locked);
+
+  // but an explicit trim should
+  ASSERT_EQ(passwand_secure_heap_trim(), locked);
+  ASSERT_EQ(passwand_secure_heap_stats().locked, 0ul);
+
+  (void)passwand_secure_heap_set_spare(spare);
+  ASSERT_EQ(passwand_secure_malloc_reset(), 0);
+}
+
+TEST("malloc: many pages") {
+
+  // allocate page-sized blocks, enough to span more than one extent if
+  // RLIMIT_MEMLOCK allows
+  enum { COUNT = 100 };
+  void *ps[COUNT] = {0};
+  size_t allocated;
+  for (allocated = 0; allocated < COUNT; allocated++) {
+    ps[allocated] = passwand_secure_malloc(4096);
+    if (ps[allocated] == NULL)
+      break;
+    memset(ps[allocated], (int)allocated, 4096);
+  }
+
+  // we should have got at least one allocation done
+  ASSERT_GT(allocated, 0ul);
+
+  // each block should have retained its contents
+  for (size_t i = 0; i < allocated; i++) {
+    const unsigned char *p = ps[i];
+    ASSERT_EQ((int)p[0], (int)(i & 0xff));
+    ASSERT_EQ((int)p[4095], (int)(i & 0xff));
+  }
+
+  for (size_t i = 0; i < allocated; i++)
+    passwand_secure_free(ps[i], 4096);
+
+  ASSERT_EQ(passwand_secure_malloc_reset(), 0);
+}
+
+TEST("malloc: stats") {
+
+  const passwand_secure_heap_stats_t before = passwand_secure_heap_stats();
+
+  void *const p = passwand_secure_malloc(100);
+  ASSERT_NOT_NULL(p);
+
+  // the allocation should be accounted for
+  const passwand_secure_heap_stats_t during = passwand_secure_heap_stats();
+  ASSERT_EQ(during.allocations, before.allocations + 1);
+  ASSERT_GE(during.in_use, before.in_use + 100);
+  ASSERT_GE(during.high_water, during.in_use);
+  ASSERT_GT(during.chunks, 0ul);
+  ASSERT_GT(during.locked, 0ul);
+
+  passwand_secure_free(p, 100);
+
+  // and so should the free
+  const passwand_secure_heap_stats_t after = passwand_secure_heap_stats();
+  ASSERT_EQ(after.frees, during.frees + 1);
+  ASSERT_EQ(after.in_use, before.in_use);
+  ASSERT_EQ(after.high_water, during.high_water);
+
+  // an oversized allocation should be counted as a failure
+  ASSERT(passwand_secure_malloc(8192) == NULL);
+  ASSERT_EQ(passwand_secure_heap_stats().failed_allocations,
+            after.failed_allocations + 1);
+
+  // releasing the heap should drop our locked memory
+  ASSERT_EQ(passwand_secure_malloc_reset(), 0);
+  ASSERT_EQ(passwand_secure_heap_stats().locked, 0ul);
+}
+
+TEST("malloc: trim") {
+
+  // disable incremental release so we can observe an explicit trim
+  const size_t spare = passwand_secure_heap_set_spare(SIZE_MAX);
+
+  void *const p = passwand_secure_malloc(128);
+  ASSERT_NOT_NULL(p);
+  passwand_secure_free(p, 128);
+
+  // the backing memory should have been retained
+  ASSERT_GT(passwand_secure_heap_stats().locked, 0ul);
+
+  // trimming should release it
+  ASSERT_GT(passwand_secure_heap_trim(), 0ul);
+  ASSERT_EQ(passwand_secure_heap_stats().locked, 0ul);
+
+  // and the heap should still be usable afterwards
+  void *const q = passwand_secure_malloc(128);
+  ASSERT_NOT_NULL(q);
+
+  // trimming with an outstanding allocation should leave it intact
+  memset(q, 42, 128);
+  (void)passwand_secure_heap_trim();
+  ASSERT_EQ((int)((unsigned char *)q)[127], 42);
+  passwand_secure_free(q, 128);
+
+  (void)passwand_secure_heap_set_spare(spare);
+  ASSERT_EQ(passwand_secure_malloc_reset(), 0);
+}
+
+TEST("malloc: incremental release") {
+
+  // retain no spare memory
+  const size_t spare = passwand_secure_heap_set_spare(0);
+
+  void *const p = passwand_secure_malloc(128);
+  ASSERT_NOT_NULL(p);
+  ASSERT_GT(passwand_secure_heap_stats().locked, 0ul);
+
+  // freeing the only allocation should return all backing memory
+  passwand_secure_free(p, 128);
+  ASSERT_EQ(passwand_secure_heap_stats().locked, 0ul);
+
+  (void)passwand_secure_heap_set_spare(spare);
+  ASSERT_EQ(passwand_secure_malloc_reset(), 0);
+}
+
+TEST("malloc: arena") {
+
+  const passwand_secure_heap_stats_t before = passwand_secure_heap_stats();
+
+  ASSERT_EQ(passwand_secure_arena_begin(256), 0);
+
+  // make a series of allocations that should be satisfied from the arena
+  char *ps[20];
+  for (size_t i = 0; i < sizeof(ps) / sizeof(ps[0]); i++) {
+    ps[i] = passwand_secure_malloc(100);
+    ASSERT_NOT_NULL(ps[i]);
+    memset(ps[i], (int)i, 100);
+  }
+
+  // they should not overlap
+  for (size_t i = 0; i < sizeof(ps) / sizeof(ps[0]); i++)
+    ASSERT_EQ((int)ps[i][99], (int)i);
+
+  // freeing an individual allocation should be permitted, and erase it
+  passwand_secure_free(ps[1], 100);
+  for (size_t i = 0; i < 100; i++)
+    ASSERT_EQ((int)ps[1][i], 0);
+
+  // nesting an arena should be permitted
+  ASSERT_EQ(passwand_secure_arena_begin(0), 0);
+  char *const q = passwand_secure_malloc(10);
+  ASSERT_NOT_NULL(q);
+  passwand_secure_arena_end();
+
+  // the arena should have needed far fewer heap allocations than we made
+  const passwand_secure_heap_stats_t during = passwand_secure_heap_stats();
+  ASSERT(during.allocations - before.allocations < 20);
+
+  passwand_secure_arena_end();
+
+  // ending the arena should have released everything
+  ASSERT_EQ(passwand_secure_heap_stats().in_use, before.in_use);
+  ASSERT_EQ(passwand_secure_malloc_reset(), 0);
+}
+
+TEST("malloc: arena erases on end") {
+
+  ASSERT_EQ(passwand_secure_arena_begin(0), 0);
+
+  // fill more than one block, so erasure spans several
+  const char secret[] = "hello world";
+  char *ps[100];
+  for (size_t i = 0; i < sizeof(ps) / sizeof(ps[0]); i++) {
+    ps[i] = passwand_secure_malloc(sizeof(secret));
+    ASSERT_NOT_NULL(ps[i]);
+    memcpy(ps[i], secret, sizeof(secret));
+  }
+
+  // free some of them early, so erasure must skip over these
+  for (size_t i = 0; i < sizeof(ps) / sizeof(ps[0]); i += 3)
+    passwand_secure_free(ps[i], sizeof(secret));
+
+  // keep the backing memory around so we can inspect it afterwards
+  const size_t spare = passwand_secure_heap_set_spare(SIZE_MAX);
+
+  passwand_secure_arena_end();
+
+  // cheat slightly and look at the memory the arena has released
+  for (size_t i = 0; i < sizeof(ps) / sizeof(ps[0]); i++) {
+    UNPOISON(ps[i], sizeof(secret));
+    ASSERT_NE(strncmp(ps[i], secret, sizeof(secret)), 0);
+    POISON(ps[i], sizeof(secret));
+  }
+
+  (void)passwand_secure_heap_set_spare(spare);
+  ASSERT_EQ(passwand_secure_malloc_reset(), 0);
+}
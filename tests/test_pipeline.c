@@ -0,0 +1,249 @@
+#include "../common/streq.h"
+#include "test.h"
+#include <passwand/passwand.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+enum { ENTRY_LEN = 6 };
+
+static const char *MAINPASS = "hello world";
+
+static void cleanup_entries(void *arg) {
+  passwand_entry_t *entries = arg;
+  for (size_t i = 0; i < ENTRY_LEN; ++i) {
+    free(entries[i].space);
+    free(entries[i].key);
+    free(entries[i].value);
+    free(entries[i].hmac);
+    free(entries[i].hmac_salt);
+    free(entries[i].salt);
+    free(entries[i].iv);
+  }
+  free(entries);
+}
+
+/// create some entries with distinct keys “0”, “1”, …, freed on test exit
+static passwand_entry_t *make_entries(void) {
+  passwand_entry_t *entries = calloc(ENTRY_LEN, sizeof(entries[0]));
+  if (entries == NULL)
+    return NULL;
+
+  cleanup_t *const c = calloc(1, sizeof(*c));
+  if (c == NULL) {
+    free(entries);
+    return NULL;
+  }
+  c->function = cleanup_entries;
+  c->arg = entries;
+  c->next = cleanups;
+  cleanups = c;
+
+  for (size_t i = 0; i < ENTRY_LEN; ++i) {
+    char key[2] = {(char)('0' + i), '\0'};
+    if (passwand_entry_new(&entries[i], MAINPASS, "space", key, "value", 10) !=
+        PW_OK)
+      return NULL;
+  }
+  return entries;
+}
+
+typedef struct {
+  passwand_pool_t *pool;
+  atomic_size_t visits[ENTRY_LEN];
+  atomic_size_t calls;
+  _Atomic(size_t) sequence[ENTRY_LEN]; ///< order in which entries were seen
+  atomic_bool mismatch;
+  size_t cancel_at; ///< call count at which to cancel, or SIZE_MAX
+  atomic_size_t failures;
+  size_t proceed_for;          ///< key derivations to allow
+  atomic_size_t proceed_calls; ///< times we were asked
+} visit_t;
+
+static void visit(void *state, size_t index, const char *space,
+                  const char *key, const char *value) {
+  visit_t *v = state;
+  if (index >= ENTRY_LEN || !streq(space, "space") || !streq(value, "value") ||
+      key[0] != (char)('0' + index) || key[1] != '\0') {
+    v->mismatch = true;
+    return;
+  }
+  ++v->visits[index];
+  const size_t call = v->calls++;
+  if (call < ENTRY_LEN)
+    v->sequence[call] = index;
+  if (call + 1 == v->cancel_at)
+    passwand_pool_cancel(v->pool);
+}
+
+static passwand_error_t tolerate(void *state, size_t index,
+                                 passwand_error_t err) {
+  visit_t *v = state;
+  if (index >= ENTRY_LEN || err != PW_BAD_HMAC) {
+    v->mismatch = true;
+    return err;
+  }
+  ++v->failures;
+  return PW_OK;
+}
+
+TEST("pipeline: visits every entry once") {
+  passwand_entry_t *entries = make_entries();
+  ASSERT_NOT_NULL(entries);
+
+  passwand_pool_t *pool = NULL;
+  int err = passwand_pool_create(&pool, 3);
+  ASSERT_EQ(err, PW_OK);
+
+  visit_t v = {.pool = pool, .cancel_at = SIZE_MAX};
+  passwand_pipeline_stats_t stats;
+  err = passwand_entries_do(pool, MAINPASS, entries, ENTRY_LEN, NULL, visit,
+                            NULL, NULL, &v, &stats);
+  passwand_pool_destroy(pool);
+  ASSERT_EQ(err, PW_OK);
+  ASSERT(!v.mismatch);
+  for (size_t i = 0; i < ENTRY_LEN; ++i)
+    ASSERT_EQ((size_t)v.visits[i], (size_t)1);
+
+  ASSERT_EQ(stats.entries, (size_t)ENTRY_LEN);
+  ASSERT_GE(stats.threads, (size_t)1);
+  ASSERT_GT(stats.mac_ns, (uint64_t)0);
+  ASSERT_GT(stats.key_ns, (uint64_t)0);
+
+  // key derivation is the bulk of the work in either stage
+  ASSERT_GT(stats.kdf.wall_ns, (uint64_t)0);
+  ASSERT_GE(stats.mac_ns + stats.key_ns, stats.kdf.wall_ns);
+
+  // every entry was decrypted by some thread
+  ASSERT_NOT_NULL(stats.per_thread);
+  size_t decrypted = 0;
+  for (size_t i = 0; i < stats.threads; ++i)
+    decrypted += stats.per_thread[i].entries;
+  ASSERT_EQ(decrypted, (size_t)ENTRY_LEN);
+  passwand_pipeline_stats_free(&stats);
+}
+
+TEST("pipeline: adaptive mode visits every entry once") {
+  passwand_entry_t *entries = make_entries();
+  ASSERT_NOT_NULL(entries);
+
+  // two threads are enough for one to be parked partway through
+  passwand_pool_t *pool = NULL;
+  int err = passwand_pool_create(&pool, 2);
+  ASSERT_EQ(err, PW_OK);
+  passwand_pool_set_adaptive(pool, true);
+
+  visit_t v = {.pool = pool, .cancel_at = SIZE_MAX};
+  passwand_pipeline_stats_t stats;
+  err = passwand_entries_do(pool, MAINPASS, entries, ENTRY_LEN, NULL, visit,
+                            NULL, NULL, &v, &stats);
+  passwand_pool_destroy(pool);
+  ASSERT_EQ(err, PW_OK);
+  ASSERT(!v.mismatch);
+  for (size_t i = 0; i < ENTRY_LEN; ++i)
+    ASSERT_EQ((size_t)v.visits[i], (size_t)1);
+
+  ASSERT_EQ(stats.entries, (size_t)ENTRY_LEN);
+  ASSERT_GE(stats.threads, stats.tuned);
+  passwand_pipeline_stats_free(&stats);
+}
+
+TEST("pipeline: respects order") {
+  passwand_entry_t *entries = make_entries();
+  ASSERT_NOT_NULL(entries);
+
+  // with a single thread, entries complete in the order we give
+  passwand_pool_t *pool = NULL;
+  int err = passwand_pool_create(&pool, 1);
+  ASSERT_EQ(err, PW_OK);
+
+  const size_t order[ENTRY_LEN] = {3, 5, 0, 1, 4, 2};
+  visit_t v = {.pool = pool, .cancel_at = SIZE_MAX};
+  err = passwand_entries_do(pool, MAINPASS, entries, ENTRY_LEN, order, visit,
+                            NULL, NULL, &v, NULL);
+  passwand_pool_destroy(pool);
+  ASSERT_EQ(err, PW_OK);
+  ASSERT(!v.mismatch);
+  for (size_t i = 0; i < ENTRY_LEN; ++i)
+    ASSERT_EQ((size_t)v.sequence[i], order[i]);
+}
+
+TEST("pipeline: cancellation") {
+  passwand_entry_t *entries = make_entries();
+  ASSERT_NOT_NULL(entries);
+
+  passwand_pool_t *pool = NULL;
+  int err = passwand_pool_create(&pool, 1);
+  ASSERT_EQ(err, PW_OK);
+
+  visit_t v = {.pool = pool, .cancel_at = 2};
+  err = passwand_entries_do(pool, MAINPASS, entries, ENTRY_LEN, NULL, visit,
+                            NULL, NULL, &v, NULL);
+  passwand_pool_destroy(pool);
+  ASSERT_EQ(err, PW_OK);
+  ASSERT_EQ((size_t)v.calls, (size_t)2);
+}
+
+static bool proceed(void *state) {
+  visit_t *v = state;
+  return v->proceed_calls++ < v->proceed_for;
+}
+
+TEST("pipeline: stops before key derivation when told") {
+  passwand_entry_t *entries = make_entries();
+  ASSERT_NOT_NULL(entries);
+
+  passwand_pool_t *pool = NULL;
+  int err = passwand_pool_create(&pool, 1);
+  ASSERT_EQ(err, PW_OK);
+
+  // allow only the two key derivations of the first entry
+  visit_t v = {.pool = pool, .cancel_at = SIZE_MAX, .proceed_for = 2};
+  err = passwand_entries_do(pool, MAINPASS, entries, ENTRY_LEN, NULL, visit,
+                            NULL, proceed, &v, NULL);
+  passwand_pool_destroy(pool);
+  ASSERT_EQ(err, PW_OK);
+  ASSERT(!v.mismatch);
+  ASSERT_EQ((size_t)v.calls, (size_t)1);
+  ASSERT_EQ((size_t)v.visits[0], (size_t)1);
+  ASSERT_EQ((size_t)v.proceed_calls, (size_t)3);
+}
+
+TEST("pipeline: wrong password") {
+  passwand_entry_t *entries = make_entries();
+  ASSERT_NOT_NULL(entries);
+
+  passwand_pool_t *pool = NULL;
+  int err = passwand_pool_create(&pool, 3);
+  ASSERT_EQ(err, PW_OK);
+
+  visit_t v = {.pool = pool, .cancel_at = SIZE_MAX};
+  err = passwand_entries_do(pool, "not hello world", entries, ENTRY_LEN, NULL,
+                            visit, NULL, NULL, &v, NULL);
+  passwand_pool_destroy(pool);
+  ASSERT_EQ(err, PW_BAD_HMAC);
+  ASSERT_EQ((size_t)v.calls, (size_t)0);
+}
+
+TEST("pipeline: error handler continues past failures") {
+  passwand_entry_t *entries = make_entries();
+  ASSERT_NOT_NULL(entries);
+
+  // corrupt the MAC of one entry
+  entries[2].hmac[0] ^= 1;
+
+  passwand_pool_t *pool = NULL;
+  int err = passwand_pool_create(&pool, 3);
+  ASSERT_EQ(err, PW_OK);
+
+  visit_t v = {.pool = pool, .cancel_at = SIZE_MAX};
+  err = passwand_entries_do(pool, MAINPASS, entries, ENTRY_LEN, NULL, visit,
+                            tolerate, NULL, &v, NULL);
+  passwand_pool_destroy(pool);
+  ASSERT_EQ(err, PW_OK);
+  ASSERT(!v.mismatch);
+  ASSERT_EQ((size_t)v.failures, (size_t)1);
+  ASSERT_EQ((size_t)v.calls, (size_t)ENTRY_LEN - 1);
+  ASSERT_EQ((size_t)v.visits[2], (size_t)0);
+}
@@ -0,0 +1,141 @@
+#include "test.h"
+#include <passwand/passwand.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+enum { COUNT = 1000 };
+
+static atomic_size_t visits[COUNT];
+
+static passwand_error_t visit(void *state __attribute__((unused)),
+                              size_t index) {
+  ++visits[index];
+  return PW_OK;
+}
+
+TEST("pool: visits every index once") {
+  passwand_pool_t *pool = NULL;
+  int err = passwand_pool_create(&pool, 4);
+  ASSERT_EQ(err, PW_OK);
+  ASSERT_GE(passwand_pool_size(pool), (size_t)1);
+
+  for (size_t i = 0; i < COUNT; ++i)
+    visits[i] = 0;
+
+  // run twice to check the pool can be reused
+  for (size_t run = 1; run <= 2; ++run) {
+    err = passwand_pool_for(pool, COUNT, visit, NULL);
+    ASSERT_EQ(err, PW_OK);
+    for (size_t i = 0; i < COUNT; ++i)
+      ASSERT_EQ((size_t)visits[i], run);
+  }
+
+  passwand_pool_destroy(pool);
+}
+
+TEST("pool: single job") {
+  passwand_pool_t *pool = NULL;
+  int err = passwand_pool_create(&pool, 1);
+  ASSERT_EQ(err, PW_OK);
+  ASSERT_EQ(passwand_pool_size(pool), (size_t)1);
+
+  for (size_t i = 0; i < COUNT; ++i)
+    visits[i] = 0;
+
+  err = passwand_pool_for(pool, COUNT, visit, NULL);
+  ASSERT_EQ(err, PW_OK);
+  for (size_t i = 0; i < COUNT; ++i)
+    ASSERT_EQ((size_t)visits[i], (size_t)1);
+
+  passwand_pool_destroy(pool);
+}
+
+TEST("pool: empty range") {
+  passwand_pool_t *pool = NULL;
+  int err = passwand_pool_create(&pool, 4);
+  ASSERT_EQ(err, PW_OK);
+
+  err = passwand_pool_for(pool, 0, visit, NULL);
+  ASSERT_EQ(err, PW_OK);
+
+  passwand_pool_destroy(pool);
+}
+
+static atomic_size_t started;
+
+static passwand_error_t cancel_at_10(void *state, size_t index) {
+  passwand_pool_t *pool = state;
+  ++started;
+  if (index == 10)
+    passwand_pool_cancel(pool);
+  return PW_OK;
+}
+
+TEST("pool: cancellation") {
+  passwand_pool_t *pool = NULL;
+  int err = passwand_pool_create(&pool, 4);
+  ASSERT_EQ(err, PW_OK);
+
+  started = 0;
+  err = passwand_pool_for(pool, COUNT, cancel_at_10, pool);
+  ASSERT_EQ(err, PW_OK);
+
+  // each thread may have claimed at most one further index after cancellation
+  ASSERT_GE((size_t)started, (size_t)11);
+  ASSERT(started <= 11 + passwand_pool_size(pool));
+
+  passwand_pool_destroy(pool);
+}
+
+static passwand_error_t fail_from_10(void *state __attribute__((unused)),
+                                     size_t index) {
+  ++started;
+  if (index >= 10)
+    return index == 10 ? PW_BAD_HMAC : PW_IO;
+  return PW_OK;
+}
+
+TEST("pool: first error") {
+  passwand_pool_t *pool = NULL;
+  int err = passwand_pool_create(&pool, 1);
+  ASSERT_EQ(err, PW_OK);
+
+  started = 0;
+  err = passwand_pool_for(pool, COUNT, fail_from_10, NULL);
+  ASSERT_EQ(err, PW_BAD_HMAC);
+  ASSERT_EQ((size_t)started, (size_t)11);
+
+  passwand_pool_destroy(pool);
+}
+
+TEST("pool: affinity") {
+  passwand_pool_t *pool = NULL;
+  int err = passwand_pool_create(&pool, 3);
+  ASSERT_EQ(err, PW_OK);
+
+  const passwand_affinity_t affinities[] = {
+      PW_AFFINITY_NONE, PW_AFFINITY_COMPACT, PW_AFFINITY_SCATTER,
+      PW_AFFINITY_NUMA};
+
+  for (size_t i = 0; i < sizeof(affinities) / sizeof(affinities[0]); ++i) {
+    err = passwand_pool_set_affinity(pool, affinities[i]);
+#ifdef __linux__
+    ASSERT_EQ(err, PW_OK);
+#else
+    if (affinities[i] != PW_AFFINITY_NONE) {
+      ASSERT_EQ(err, PW_UNSUPPORTED);
+      continue;
+    }
+#endif
+
+    // placement should not affect the work done
+    for (size_t j = 0; j < COUNT; ++j)
+      visits[j] = 0;
+    err = passwand_pool_for(pool, COUNT, visit, NULL);
+    ASSERT_EQ(err, PW_OK);
+    for (size_t j = 0; j < COUNT; ++j)
+      ASSERT_EQ((size_t)visits[j], (size_t)1);
+  }
+
+  passwand_pool_destroy(pool);
+}
@@ -20,3 +20,44 @@ TEST("random_bytes: random_bytes(0)") {
   uint8_t buffer2[sizeof(buffer)] = {0};
   ASSERT_EQ(memcmp(buffer, buffer2, sizeof(buffer)), 0);
 }
+
+TEST("random_bytes: random_bytes_ex basic functionality") {
+  uint8_t buffer[10] = {0};
+  int r = passwand_random_bytes_ex(buffer, sizeof(buffer));
+  ASSERT_EQ(r, 0);
+
+  uint8_t buffer2[sizeof(buffer)] = {0};
+  ASSERT_NE(memcmp(buffer, buffer2, sizeof(buffer)), 0);
+
+  // successive requests should not repeat data
+  r = passwand_random_bytes_ex(buffer2, sizeof(buffer2));
+  ASSERT_EQ(r, 0);
+  ASSERT_NE(memcmp(buffer, buffer2, sizeof(buffer)), 0);
+}
+
+TEST("random_bytes: random_bytes_ex(0)") {
+  uint8_t buffer[10] = {0};
+  int r = passwand_random_bytes_ex(buffer, 0);
+  ASSERT_EQ(r, 0);
+
+  uint8_t buffer2[sizeof(buffer)] = {0};
+  ASSERT_EQ(memcmp(buffer, buffer2, sizeof(buffer)), 0);
+}
+
+TEST("random_bytes: random_bytes_ex with large lengths") {
+  // lengths beyond what passwand_random_bytes can express, and beyond what is
+  // buffered, with the end of the buffer checked to be filled
+  static const size_t lengths[] = {300, 1023, 5000};
+  for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i) {
+    uint8_t buffer[5000] = {0};
+    int r = passwand_random_bytes_ex(buffer, lengths[i]);
+    ASSERT_EQ(r, 0);
+
+    uint8_t buffer2[16] = {0};
+    ASSERT_NE(memcmp(&buffer[lengths[i] - sizeof(buffer2)], buffer2,
+                     sizeof(buffer2)),
+              0);
+    for (size_t j = lengths[i]; j < sizeof(buffer); ++j)
+      ASSERT_EQ((int)buffer[j], 0);
+  }
+}